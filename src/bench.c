@@ -0,0 +1,1073 @@
+/*
+ * ============================================================================
+ * BENCH - Medição de desempenho do servidor - Projeto SO 25/26
+ * ============================================================================
+ *
+ * OBJETIVO:
+ * Comparar os ciclos de eventos do servidor (--loop classic/uring/threads) com
+ * a mesma carga: P produtores submetem N mensagens com C comandos "true"
+ * cada uma, e medimos quanto tempo demora até todos estarem no log.
+ *
+ * COMO FUNCIONA:
+ * 1. Lança ./build/server com o ciclo escolhido e um log temporário
+ * 2. Cria P processos produtores que usam a biblioteca exec_ring
+ *    (FIFO, ou o anel com --ring)
+ * 3. Conta as linhas do log até chegar a N * C
+ * 4. Termina o servidor (SIGTERM) e mostra os resultados
+ *
+ * EXEMPLO DE USO:
+ *   ./build/bench                      (compara os três ciclos)
+ *   ./build/bench --loop uring -n 5000 -p 8 -c 4 --ring
+ *   ./build/bench --builtins           (os "true" correm sem fork())
+ *   ./build/bench --shards 4           (4 servidores, um FIFO cada)
+ *   ./build/bench --replay logs/server.log --speed 10 --stub
+ *                                      (repete um log real, ver abaixo)
+ *
+ * NOTA: usa o FIFO /tmp/exec_fifo, por isso não pode haver outro
+ * servidor a correr ao mesmo tempo.
+ *
+ * ============================================================================
+ */
+
+#include <stdlib.h>     // exit(), atoi(), strtod(), qsort()
+#include <unistd.h>     // fork(), execv(), read(), write(), close()
+#include <fcntl.h>      // open(), O_RDONLY
+#include <string.h>     // strcmp(), strlen()
+#include <signal.h>     // kill(), SIGTERM
+#include <sys/wait.h>   // waitpid()
+#include <sys/stat.h>   // stat()
+#include <time.h>       // clock_gettime(), nanosleep()
+#include <poll.h>       // poll() (--replay)
+#include <sys/socket.h> // socket(), connect() (--watch do servidor de teste)
+#include <sys/un.h>     // struct sockaddr_un
+
+#include "exec_ring.h"  // exec_client_open(), exec_client_submit()
+
+#define BENCH_LOG "/tmp/exec_bench.log"
+#define SERVER_BIN "./build/server"
+#define TIMEOUT_MS 120000
+
+/*
+ * ============================================================================
+ * FUNÇÕES AUXILIARES PARA I/O SEM USAR STDIO.H
+ * ============================================================================
+ */
+
+void print_str(const char *str) {
+    write(STDOUT_FILENO, str, strlen(str));
+}
+
+void print_err(const char *str) {
+    write(STDERR_FILENO, str, strlen(str));
+}
+
+/*
+ * Escreve um inteiro (long) alinhado à direita em width colunas
+ */
+void print_long(long num, int width) {
+    char buffer[32];
+    int i = 0;
+
+    do {
+        buffer[i++] = '0' + (num % 10);
+        num /= 10;
+    } while (num > 0);
+
+    for (int pad = i; pad < width; pad++) write(STDOUT_FILENO, " ", 1);
+    while (i > 0) write(STDOUT_FILENO, &buffer[--i], 1);
+}
+
+long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+void sleep_ms(int ms) {
+    struct timespec ts = { ms / 1000, (long)(ms % 1000) * 1000000L };
+    nanosleep(&ts, NULL);
+}
+
+/*
+ * Ficheiro de um shard: "base.N" (só base se shard == -1)
+ */
+void shard_file(const char *base, int shard, char *path) {
+    int len = strlen(base);
+    memcpy(path, base, len);
+    if (shard >= 0) {
+        path[len++] = '.';
+        if (shard >= 10) path[len++] = '0' + shard / 10;
+        path[len++] = '0' + shard % 10;
+    }
+    path[len] = '\0';
+}
+
+/*
+ * Conta as linhas do log (cada registo termina em '\n'); com --shards,
+ * dos logs de todos os shards (BENCH_LOG.N).
+ * Lê só o que foi acrescentado desde a última chamada, para a medição
+ * não competir com o servidor pelo CPU. num_log_fds = 0 recomeça do início.
+ */
+int num_logs = 1;            // --shards K: K logs
+int log_fds[SHARDS_MAX];
+int num_log_fds = 0;
+long log_lines = 0;
+
+long count_log_lines(void) {
+    while (num_log_fds < num_logs) {
+        char path[64];
+        shard_file(BENCH_LOG, num_logs > 1 ? num_log_fds : -1, path);
+        int fd = open(path, O_RDONLY);
+        if (fd == -1) return log_lines;
+        log_fds[num_log_fds++] = fd;
+    }
+
+    char buffer[65536];
+    for (int f = 0; f < num_log_fds; f++) {
+        ssize_t n;
+        while ((n = read(log_fds[f], buffer, sizeof(buffer))) > 0) {
+            for (ssize_t i = 0; i < n; i++) {
+                if (buffer[i] == '\n') log_lines++;
+            }
+        }
+    }
+    return log_lines;
+}
+
+/*
+ * Fecha os logs e apaga-os (e as métricas, com --builtins)
+ */
+void remove_logs(void) {
+    while (num_log_fds > 0) close(log_fds[--num_log_fds]);
+    log_lines = 0;
+
+    for (int shard = -1; shard < num_logs; shard++) {
+        char path[64];
+        shard_file(BENCH_LOG, shard, path);
+        unlink(path);
+        shard_file("/tmp/exec_bench.metrics", shard, path);
+        unlink(path);
+    }
+}
+
+/*
+ * ============================================================================
+ * CONFIGURAÇÃO DA CARGA
+ * ============================================================================
+ */
+int num_messages = 2000;     // -n: mensagens no total
+int num_producers = 4;       // -p: processos produtores
+int cmds_per_message = 1;    // -c: comandos por mensagem
+int use_ring = 0;            // --ring: servidor e clientes usam o anel
+int use_builtins = 0;        // --builtins: o servidor corre "true" sem fork()
+int num_shards = 0;          // --shards: o servidor arranca K shards
+const char *shards_arg = NULL;
+const char *replay_path = NULL;  // --replay: repete este log em vez da carga sintética
+double replay_speed = 1.0;   // --speed: 10 = dez vezes mais depressa
+int replay_stub = 0;         // --stub: "sleep" com a duração original
+
+/*
+ * Lança o servidor com o ciclo pedido, com stdout/stderr em /dev/null
+ */
+pid_t start_server(const char *loop) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+
+        char *args[14] = { SERVER_BIN, "--loop", (char *)loop, "--log", BENCH_LOG };
+        int n = 5;
+        if (use_ring) args[n++] = "--ring";
+        if (num_shards > 0) {
+            args[n++] = "--shards";
+            args[n++] = (char *)shards_arg;
+        }
+        if (replay_path != NULL) args[n++] = "--watch";  // Resultados do replay
+        if (use_builtins) {
+            args[n++] = "--builtins";
+            args[n++] = "all";
+            args[n++] = "--metrics";
+            args[n++] = "/tmp/exec_bench.metrics";
+        }
+        args[n] = NULL;
+        execv(SERVER_BIN, args);
+        _exit(127);
+    }
+    return pid;
+}
+
+/*
+ * Espera que o servidor crie o FIFO (e o anel, com --ring), ou os FIFOs
+ * de todos os shards
+ */
+int wait_server_ready(void) {
+    struct stat st;
+    for (int i = 0; i < 200; i++) {
+        int ready = !use_ring || stat("/dev/shm" RING_NAME, &st) == 0;
+        for (int shard = num_shards > 0 ? 0 : -1; shard < num_shards; shard++) {
+            char path[64];
+            exec_shard_fifo(shard, path, sizeof(path));
+            ready &= stat(path, &st) == 0;
+        }
+        if (ready) {
+            sleep_ms(50);  // Dá tempo ao servidor de abrir o FIFO
+            return 0;
+        }
+        sleep_ms(10);
+    }
+    return -1;
+}
+
+/*
+ * Um produtor: submete count mensagens
+ */
+void producer(int count) {
+    struct exec_client client;
+    char message[RING_SLOT_SIZE];
+    int len = 0;
+
+    for (int c = 0; c < cmds_per_message; c++) {
+        if (c > 0) message[len++] = ';';
+        memcpy(message + len, "true", 4);
+        len += 4;
+    }
+
+    if (exec_client_open(&client) == -1) _exit(EXIT_FAILURE);
+    for (int i = 0; i < count; i++) {
+        if (exec_client_submit(&client, message, len) == -1) _exit(EXIT_FAILURE);
+    }
+    exec_client_close(&client);
+    _exit(0);
+}
+
+/*
+ * Corre a carga contra um ciclo de eventos e mostra uma linha da tabela.
+ * Retorna 0 ou -1 se o servidor não respondeu a tempo.
+ */
+int run_bench(const char *loop) {
+    remove_logs();
+    unlink(FIFO_PATH);
+
+    pid_t server = start_server(loop);
+    if (server == -1 || wait_server_ready() == -1) {
+        print_err("[BENCH] O servidor não arrancou\n");
+        return -1;
+    }
+
+    long expected = (long)num_messages * cmds_per_message;
+    long start = now_us();
+
+    pid_t *producers = malloc(num_producers * sizeof(pid_t));
+    for (int p = 0; p < num_producers; p++) {
+        int count = num_messages / num_producers;
+        if (p < num_messages % num_producers) count++;
+        producers[p] = fork();
+        if (producers[p] == 0) producer(count);
+    }
+    // Espera só pelos produtores (o servidor também é nosso filho)
+    for (int p = 0; p < num_producers; p++) {
+        waitpid(producers[p], NULL, 0);
+    }
+    free(producers);
+    long submitted = now_us();
+
+    long lines = 0;
+    while ((lines = count_log_lines()) < expected) {
+        if (now_us() - start > TIMEOUT_MS * 1000L) break;
+        sleep_ms(5);
+    }
+    long done = now_us();
+
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    remove_logs();
+
+    long total_ms = (done - start) / 1000;
+    print_str(loop);
+    for (int pad = strlen(loop); pad < 8; pad++) print_str(" ");
+    print_long(lines, 10);
+    print_long((submitted - start) / 1000, 12);
+    print_long(total_ms, 10);
+    print_long(total_ms > 0 ? lines * 1000 / total_ms : lines, 12);
+    print_str(lines < expected ? "   (TIMEOUT)\n" : "\n");
+    return lines < expected ? -1 : 0;
+}
+
+/*
+ * ============================================================================
+ * REPLAY DE UM LOG REAL (--replay)
+ * ============================================================================
+ *
+ * OBJETIVO:
+ * A carga sintética ("true" a toda a velocidade) não se parece com a de
+ * produção. Com --replay FICHEIRO, o bench lê um log de um servidor a
+ * sério, reconstrói quando chegou cada comando e volta a submetê-los a um
+ * servidor de teste com o mesmo ritmo (ou --speed vezes mais depressa).
+ * No fim compara com a corrida original: débito, fila, spawn e duração.
+ *
+ * FORMATOS ACEITES (linha a linha; o resto é ignorado):
+ *   [2026-10-18 08:28:34] make -j4; exit status: 0; cpu: 3
+ *       logs/server.log. O tempo é o do fim do job, ao segundo: os jobs
+ *       do mesmo segundo são espalhados por ele. Notas "; duration_ms: N",
+ *       "; queue_ms: N" e "; spawn_us: N" são usadas se existirem, e o
+ *       tempo pode ter milissegundos ("08:28:34.123").
+ *   {"id":17,"time":1760774400123,"cmd":"make -j4",...,"duration_ms":1520}
+ *       "./client --watch > ficheiro". Tem a duração de cada job, por
+ *       isso a chegada (time - duration_ms) é exata.
+ *
+ * duration_ms vai do pedido ao fim e inclui a fila; o tempo a correr é
+ * duration_ms - queue_ms quando o log traz a fila. É esse que o --stub
+ * usa e que a tabela compara ("execução job"), dos dois lados.
+ *
+ * --stub: em vez do comando corre "sleep D", com D o tempo a correr
+ * original a dividir por --speed. Se o log não tiver durações, cada comando
+ * diferente é corrido uma vez antes do replay para a medir (calibração).
+ *
+ * Os resultados vêm do --watch do servidor de teste (cada comando leva
+ * "%client=replay.N").
+ */
+#define REPLAY_CALIBRATE_BUCKETS 8192   // Comandos diferentes (potência de 2)
+
+struct replay_job {
+    long arrival_ms;        // Chegada, desde o primeiro pedido
+    long end_ms;            // Fim, na mesma escala
+    long duration_ms;       // -1 = desconhecida
+    long queue_ms;          // -1 = desconhecido
+    long run_ms;            // A correr, sem a fila (-1 = desconhecido)
+    long spawn_us;
+    int failed;
+    int coarse;             // Tempo só ao segundo
+    char *cmd;
+};
+
+/*
+ * Uma coluna da tabela final: v[STAT_...] (-1 = não se sabe)
+ */
+#define STAT_JOBS 0
+#define STAT_SPAN 1         // ms do primeiro pedido ao último fim
+#define STAT_RATE 2         // jobs/s
+#define STAT_PEAK 3         // jobs/s no melhor segundo
+#define STAT_FAILURES 4
+#define STAT_LOST 5         // Registos do --watch perdidos
+#define STAT_QUEUE_P50 6
+#define STAT_QUEUE_P99 7
+#define STAT_SPAWN_P50 8
+#define STAT_SPAWN_P99 9
+#define STAT_DUR_P50 10
+#define STAT_DUR_P99 11
+#define NUM_STATS 12
+
+const char *stat_labels[NUM_STATS] = {
+    "jobs", "duração total (ms)", "jobs/s (média)", "jobs/s (melhor segundo)",
+    "falhas", "registos perdidos", "fila p50 (ms)", "fila p99 (ms)",
+    "spawn p50 (us)", "spawn p99 (us)", "execução job p50 (ms)", "execução job p99 (ms)",
+};
+
+struct replay_stats {
+    const char *name;
+    long v[NUM_STATS];
+};
+
+struct replay_job *replay_jobs = NULL;
+int replay_count = 0;
+long replay_skipped = 0;
+
+/*
+ * Lê um número (com sinal) e avança p. Retorna 0 se não havia dígitos.
+ */
+int parse_long(const char **p, long *value) {
+    const char *s = *p;
+    int neg = *s == '-';
+    if (neg) s++;
+    if (*s < '0' || *s > '9') return 0;
+    long v = 0;
+    while (*s >= '0' && *s <= '9') v = v * 10 + (*s++ - '0');
+    *value = neg ? -v : v;
+    *p = s;
+    return 1;
+}
+
+/*
+ * Dias desde 1970-01-01 (calendário gregoriano)
+ */
+long days_from_civil(long y, long m, long d) {
+    y -= m <= 2;
+    long era = (y >= 0 ? y : y - 399) / 400;
+    long yoe = y - era * 400;
+    long doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+/*
+ * Valor de "chave": num registo JSON (ou NULL)
+ */
+const char *json_field(const char *line, const char *key) {
+    char pattern[64];
+    int len = strlen(key);
+    if (len + 4 > (int)sizeof(pattern)) return NULL;
+    pattern[0] = '"';
+    memcpy(pattern + 1, key, len);
+    memcpy(pattern + 1 + len, "\":", 3);
+    const char *p = strstr(line, pattern);
+    return p != NULL ? p + len + 3 : NULL;
+}
+
+long json_long(const char *line, const char *key) {
+    const char *p = json_field(line, key);
+    long value;
+    return p != NULL && parse_long(&p, &value) ? value : -1;
+}
+
+/*
+ * Copia uma string JSON (p aponta para as aspas). Os \uXXXX fora do
+ * ASCII ficam '?': só servem para voltar a correr o comando.
+ */
+char *json_string(const char *p) {
+    if (p == NULL || *p != '"') return NULL;
+    char *out = malloc(strlen(p));
+    if (out == NULL) return NULL;
+    int len = 0;
+    for (p++; *p != '\0' && *p != '"'; p++) {
+        if (*p != '\\') {
+            out[len++] = *p;
+            continue;
+        }
+        p++;
+        if (*p == 'u' && strlen(p) >= 5) {
+            int code = 0;
+            for (int i = 1; i <= 4; i++) {
+                char c = p[i];
+                code = code * 16 + (c >= 'a' ? c - 'a' + 10 : c >= 'A' ? c - 'A' + 10 : c - '0');
+            }
+            out[len++] = code < 0x80 ? code : '?';
+            p += 4;
+        } else if (*p == 'n') {
+            out[len++] = '\n';
+        } else if (*p == 't') {
+            out[len++] = '\t';
+        } else if (*p != '\0') {
+            out[len++] = *p;
+        } else {
+            break;
+        }
+    }
+    out[len] = '\0';
+    return out;
+}
+
+/*
+ * Tempo a correr: a duração sem a fila, se se souber (-1 = desconhecido)
+ */
+long run_time_ms(long duration_ms, long queue_ms) {
+    if (duration_ms < 0) return -1;
+    if (queue_ms < 0) return duration_ms;
+    return duration_ms > queue_ms ? duration_ms - queue_ms : 0;
+}
+
+/*
+ * Um registo do --watch. Retorna 0 ou -1 se não serve.
+ */
+int replay_parse_json(const char *line, struct replay_job *job) {
+    long time = json_long(line, "time");
+    job->cmd = json_string(json_field(line, "cmd"));
+    if (time < 0 || job->cmd == NULL) {
+        free(job->cmd);
+        return -1;
+    }
+    job->duration_ms = json_long(line, "duration_ms");
+    job->queue_ms = json_long(line, "queue_ms");
+    job->spawn_us = json_long(line, "spawn_us");
+    job->end_ms = time;
+    job->arrival_ms = time - (job->duration_ms > 0 ? job->duration_ms : 0);
+    const char *exit = json_field(line, "exit");
+    job->failed = exit == NULL || strncmp(exit, "0,", 2) != 0;
+    return 0;
+}
+
+/*
+ * Uma linha do log: "[AAAA-MM-DD HH:MM:SS(.mmm)] cmd; nota; nota..."
+ * Só serve se o job correu: tem "exit status" ou "terminou de forma
+ * anormal" (um "; ignorado: ..." do %after não conta). Retorna 0 ou -1.
+ */
+int replay_parse_log(const char *line, struct replay_job *job) {
+    const char *p = line + 1;
+    long y, mo, d, h, mi, s;
+    if (!parse_long(&p, &y) || *p++ != '-' || !parse_long(&p, &mo) || *p++ != '-' ||
+        !parse_long(&p, &d) || (*p != ' ' && *p != 'T') || (p++, !parse_long(&p, &h)) ||
+        *p++ != ':' || !parse_long(&p, &mi) || *p++ != ':' || !parse_long(&p, &s)) {
+        return -1;
+    }
+    long ms = 0;
+    job->coarse = *p != '.';
+    if (*p == '.') {
+        p++;
+        for (int scale = 100; *p >= '0' && *p <= '9'; p++, scale /= 10) {
+            ms += (*p - '0') * scale;
+        }
+    }
+    p = strchr(p, ']');
+    if (p == NULL || p[1] != ' ') return -1;
+    p += 2;
+
+    // O comando não tem ';' (separa comandos na mensagem): vai até à 1ª nota
+    const char *end = strstr(p, "; ");
+    if (end == NULL || end == p) return -1;
+    job->cmd = strndup(p, end - p);
+    if (job->cmd == NULL) return -1;
+
+    job->end_ms = ((days_from_civil(y, mo, d) * 24 + h) * 60 + mi) * 60000L + s * 1000 + ms;
+    job->failed = 1;
+    int ran = 0;
+    while (end != NULL) {
+        const char *note = end + 2;
+        long value;
+        if (strncmp(note, "exit status: ", 13) == 0) {
+            note += 13;
+            job->failed = !parse_long(&note, &value) || value != 0;
+            ran = 1;
+        } else if (strncmp(note, "terminou de forma anormal", 25) == 0) {
+            ran = 1;
+        } else if (strncmp(note, "duration_ms: ", 13) == 0) {
+            note += 13;
+            if (parse_long(&note, &value)) job->duration_ms = value;
+        } else if (strncmp(note, "queue_ms: ", 10) == 0) {
+            note += 10;
+            if (parse_long(&note, &value)) job->queue_ms = value;
+        } else if (strncmp(note, "spawn_us: ", 10) == 0) {
+            note += 10;
+            if (parse_long(&note, &value)) job->spawn_us = value;
+        }
+        end = strstr(note, "; ");
+    }
+    if (!ran) {
+        free(job->cmd);
+        return -1;
+    }
+    job->arrival_ms = job->end_ms - (job->duration_ms > 0 ? job->duration_ms : 0);
+    return 0;
+}
+
+int replay_by_arrival(const void *a, const void *b) {
+    const struct replay_job *x = a, *y = b;
+    return (x->arrival_ms > y->arrival_ms) - (x->arrival_ms < y->arrival_ms);
+}
+
+/*
+ * Lê o log todo para replay_jobs[], por ordem de chegada
+ */
+int replay_load(const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        print_err("[BENCH] Não consegui abrir o log do --replay\n");
+        return -1;
+    }
+    char *data = malloc(st.st_size + 1);
+    long len = 0;
+    ssize_t n;
+    while (data != NULL && (n = read(fd, data + len, st.st_size - len)) > 0) len += n;
+    close(fd);
+    if (data == NULL) return -1;
+    data[len] = '\0';
+
+    int lines = 1;
+    for (long i = 0; i < len; i++) lines += data[i] == '\n';
+    replay_jobs = calloc(lines, sizeof(struct replay_job));
+    if (replay_jobs == NULL) return -1;
+
+    for (char *line = data, *next; line < data + len; line = next) {
+        next = strchr(line, '\n');
+        if (next != NULL) *next++ = '\0';
+        else next = data + len;
+        if (*line == '\0') continue;
+
+        struct replay_job *job = &replay_jobs[replay_count];
+        job->duration_ms = job->queue_ms = job->spawn_us = -1;
+        int ok = *line == '{' ? replay_parse_json(line, job) :
+                 *line == '[' ? replay_parse_log(line, job) : -1;
+        if (ok == 0) {
+            job->run_ms = run_time_ms(job->duration_ms, job->queue_ms);
+            replay_count++;
+        } else {
+            replay_skipped++;
+        }
+    }
+    free(data);
+    if (replay_count == 0) {
+        print_err("[BENCH] O log do --replay não tem nenhum job\n");
+        return -1;
+    }
+
+    qsort(replay_jobs, replay_count, sizeof(struct replay_job), replay_by_arrival);
+
+    // Tempos ao segundo: espalha os jobs de cada segundo por ele
+    for (int i = 0; i < replay_count; ) {
+        int j = i;
+        while (j < replay_count && replay_jobs[j].coarse &&
+               replay_jobs[j].arrival_ms == replay_jobs[i].arrival_ms) {
+            j++;
+        }
+        for (int k = i; k < j; k++) {
+            long shift = (k - i) * 1000L / (j - i);
+            replay_jobs[k].arrival_ms += shift;
+            replay_jobs[k].end_ms += shift;
+        }
+        i = j > i ? j : i + 1;
+    }
+
+    long first = replay_jobs[0].arrival_ms;
+    for (int i = 0; i < replay_count; i++) {
+        replay_jobs[i].arrival_ms -= first;
+        replay_jobs[i].end_ms -= first;
+    }
+    return 0;
+}
+
+/*
+ * --stub sem durações no log: corre cada comando diferente uma vez
+ */
+void replay_calibrate(void) {
+    int *table = malloc(REPLAY_CALIBRATE_BUCKETS * sizeof(int));
+    if (table == NULL) return;
+    for (int i = 0; i < REPLAY_CALIBRATE_BUCKETS; i++) table[i] = -1;
+
+    int distinct = 0;
+    long start = now_us();
+    for (int i = 0; i < replay_count; i++) {
+        struct replay_job *job = &replay_jobs[i];
+        if (job->run_ms >= 0) continue;
+
+        unsigned long hash = 5381;
+        for (const char *c = job->cmd; *c != '\0'; c++) hash = hash * 33 + (unsigned char)*c;
+        unsigned long b = hash & (REPLAY_CALIBRATE_BUCKETS - 1);
+        int found = -1;
+        for (int probes = 0; probes < REPLAY_CALIBRATE_BUCKETS && table[b] != -1; probes++) {
+            if (strcmp(replay_jobs[table[b]].cmd, job->cmd) == 0) {
+                found = table[b];
+                break;
+            }
+            b = (b + 1) & (REPLAY_CALIBRATE_BUCKETS - 1);
+        }
+        if (found != -1) {
+            job->run_ms = replay_jobs[found].run_ms;
+            continue;
+        }
+
+        // Corre-o como o servidor: separado por espaços, sem shell
+        char copy[512];
+        char *args[32];
+        int argc = 0;
+        strncpy(copy, job->cmd, sizeof(copy) - 1);
+        copy[sizeof(copy) - 1] = '\0';
+        for (char *save, *tok = strtok_r(copy, " ", &save); tok != NULL && argc < 31;
+             tok = strtok_r(NULL, " ", &save)) {
+            args[argc++] = tok;
+        }
+        args[argc] = NULL;
+
+        long t0 = now_us();
+        pid_t pid = argc > 0 ? fork() : -1;
+        if (pid == 0) {
+            int null_fd = open("/dev/null", O_RDWR);
+            dup2(null_fd, STDIN_FILENO);
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+            execvp(args[0], args);
+            _exit(127);
+        }
+        if (pid > 0) waitpid(pid, NULL, 0);
+        job->run_ms = (now_us() - t0) / 1000;
+        distinct++;
+        if (table[b] == -1) table[b] = i;  // Tabela cheia: mede outra vez
+    }
+    free(table);
+
+    if (distinct > 0) {
+        print_str("[BENCH] Calibração: ");
+        print_long(distinct, 0);
+        print_str(" comando(s) diferente(s) em ");
+        print_long((now_us() - start) / 1000, 0);
+        print_str(" ms\n");
+    }
+}
+
+int by_value(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Percentil pct de values[0..count[ (ordena o array). -1 se vazio.
+ */
+long percentile(long *values, int count, int pct) {
+    if (count == 0) return -1;
+    qsort(values, count, sizeof(long), by_value);
+    return values[(long)(count - 1) * pct / 100];
+}
+
+/*
+ * Débito médio e no melhor segundo, a partir dos instantes de fim (ms)
+ */
+void replay_rates(struct replay_stats *st, long *ends, int count) {
+    long span = 0;
+    for (int i = 0; i < count; i++) {
+        if (ends[i] > span) span = ends[i];
+    }
+    st->v[STAT_SPAN] = span;
+    st->v[STAT_RATE] = span > 0 ? count * 1000L / span : count;
+
+    long *per_second = calloc(span / 1000 + 1, sizeof(long));
+    st->v[STAT_PEAK] = 0;
+    for (int i = 0; per_second != NULL && i < count; i++) {
+        long s = ends[i] < 0 ? 0 : ends[i] / 1000;
+        if (++per_second[s] > st->v[STAT_PEAK]) st->v[STAT_PEAK] = per_second[s];
+    }
+    free(per_second);
+}
+
+/*
+ * Coluna "original": tempos divididos por --speed para comparar
+ */
+void replay_original(struct replay_stats *st) {
+    long *a = malloc(replay_count * sizeof(long));
+    long *b = malloc(replay_count * sizeof(long));
+    long *c = malloc(replay_count * sizeof(long));
+    int nq = 0, ns = 0, nd = 0;
+
+    st->v[STAT_JOBS] = replay_count;
+    for (int i = 0; a != NULL && b != NULL && c != NULL && i < replay_count; i++) {
+        struct replay_job *job = &replay_jobs[i];
+        st->v[STAT_FAILURES] += job->failed;
+        if (job->queue_ms >= 0) a[nq++] = job->queue_ms / replay_speed;
+        if (job->spawn_us >= 0) b[ns++] = job->spawn_us;
+        if (job->run_ms >= 0) c[nd++] = job->run_ms / replay_speed;
+    }
+    st->v[STAT_QUEUE_P50] = percentile(a, nq, 50);
+    st->v[STAT_QUEUE_P99] = percentile(a, nq, 99);
+    st->v[STAT_SPAWN_P50] = percentile(b, ns, 50);
+    st->v[STAT_SPAWN_P99] = percentile(b, ns, 99);
+    st->v[STAT_DUR_P50] = percentile(c, nd, 50);
+    st->v[STAT_DUR_P99] = percentile(c, nd, 99);
+
+    for (int i = 0; a != NULL && i < replay_count; i++) {
+        a[i] = replay_jobs[i].end_ms / replay_speed;
+    }
+    if (a != NULL) replay_rates(st, a, replay_count);
+    free(a);
+    free(b);
+    free(c);
+}
+
+/*
+ * Mensagem de um job: "%client=replay.N " + comando (ou o sleep)
+ */
+int replay_message(char *msg, int i) {
+    int len = 0;
+    const char *tag = "%client=replay.";
+    memcpy(msg, tag, strlen(tag));
+    len += strlen(tag);
+
+    char digits[16];
+    int nd = 0;
+    int v = i;
+    do {
+        digits[nd++] = '0' + v % 10;
+        v /= 10;
+    } while (v > 0);
+    while (nd > 0) msg[len++] = digits[--nd];
+    msg[len++] = ' ';
+
+    struct replay_job *job = &replay_jobs[i];
+    if (replay_stub) {
+        long ms = job->run_ms > 0 ? (long)(job->run_ms / replay_speed) : 0;
+        memcpy(msg + len, "sleep ", 6);
+        len += 6;
+        long sec = ms / 1000;
+        nd = 0;
+        do {
+            digits[nd++] = '0' + sec % 10;
+            sec /= 10;
+        } while (sec > 0);
+        while (nd > 0) msg[len++] = digits[--nd];
+        msg[len++] = '.';
+        msg[len++] = '0' + ms / 100 % 10;
+        msg[len++] = '0' + ms / 10 % 10;
+        msg[len++] = '0' + ms % 10;
+    } else {
+        int cmd_len = strlen(job->cmd);
+        if (len + cmd_len >= RING_SLOT_SIZE) return -1;
+        memcpy(msg + len, job->cmd, cmd_len);
+        len += cmd_len;
+    }
+    return len;
+}
+
+int watch_open(void) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, WATCH_PATH, sizeof(addr.sun_path) - 1);
+
+    for (int i = 0; i < 200; i++) {
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd != -1 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) return fd;
+        if (fd != -1) close(fd);
+        sleep_ms(10);
+    }
+    return -1;
+}
+
+/*
+ * Um registo do servidor de teste
+ */
+void replay_record(const char *line, long at_ms, long *ends, long *queue, long *spawn,
+                   long *dur, int *nspawn, struct replay_stats *st) {
+    const char *client = json_field(line, "client");
+    if (client == NULL || strncmp(client, "\"replay.", 8) != 0) return;
+
+    long dropped = json_long(line, "dropped");
+    if (dropped > st->v[STAT_LOST]) st->v[STAT_LOST] = dropped;
+
+    long i = st->v[STAT_JOBS]++;
+    ends[i] = at_ms;
+    queue[i] = json_long(line, "queue_ms");
+    long us = json_long(line, "spawn_us");
+    if (us >= 0) spawn[(*nspawn)++] = us;
+    dur[i] = run_time_ms(json_long(line, "duration_ms"), queue[i]);
+    const char *exit = json_field(line, "exit");
+    st->v[STAT_FAILURES] += exit == NULL || strncmp(exit, "0,", 2) != 0;
+}
+
+/*
+ * Corre o replay contra um ciclo de eventos. Retorna 0 ou -1.
+ */
+int run_replay(const char *loop, struct replay_stats *st) {
+    unlink(BENCH_LOG);
+    unlink(FIFO_PATH);
+
+    pid_t server = start_server(loop);
+    int watch_fd = -1;
+    if (server == -1 || wait_server_ready() == -1 || (watch_fd = watch_open()) == -1) {
+        print_err("[BENCH] O servidor não arrancou\n");
+        if (server > 0) {
+            kill(server, SIGTERM);
+            waitpid(server, NULL, 0);
+        }
+        return -1;
+    }
+
+    long *ends = malloc(replay_count * sizeof(long));
+    long *queue = malloc(replay_count * sizeof(long));
+    long *spawn = malloc(replay_count * sizeof(long));
+    long *dur = malloc(replay_count * sizeof(long));
+    char *records = malloc(2 * RING_SLOT_SIZE);
+    struct exec_client client;
+    if (ends == NULL || queue == NULL || spawn == NULL || dur == NULL || records == NULL ||
+        exec_client_open(&client) == -1) {
+        print_err("[BENCH] Sem memória ou sem ligação ao servidor\n");
+        kill(server, SIGTERM);
+        waitpid(server, NULL, 0);
+        return -1;
+    }
+
+    memset(st, 0, sizeof(*st));
+    st->name = loop;
+    int nspawn = 0;
+    int next = 0;
+    int submitted = 0;
+    int rec_len = 0;
+    long deadline = replay_jobs[replay_count - 1].arrival_ms / replay_speed + TIMEOUT_MS;
+    long start = now_us();
+
+    for (;;) {
+        long elapsed = (now_us() - start) / 1000;
+        while (next < replay_count && replay_jobs[next].arrival_ms / replay_speed <= elapsed) {
+            char msg[RING_SLOT_SIZE];
+            int len = replay_message(msg, next);
+            if (len > 0 && exec_client_submit(&client, msg, len) == 0) submitted++;
+            next++;
+        }
+        if ((next == replay_count && st->v[STAT_JOBS] + st->v[STAT_LOST] >= submitted) || elapsed > deadline) {
+            break;
+        }
+
+        long wait = next < replay_count ?
+                    (long)(replay_jobs[next].arrival_ms / replay_speed) - elapsed : 100;
+        struct pollfd pfd = { watch_fd, POLLIN, 0 };
+        if (poll(&pfd, 1, wait < 0 ? 0 : wait > 100 ? 100 : wait) <= 0) continue;
+
+        ssize_t n = read(watch_fd, records + rec_len, 2 * RING_SLOT_SIZE - 1 - rec_len);
+        if (n <= 0) break;
+        rec_len += n;
+        records[rec_len] = '\0';
+
+        long at = (now_us() - start) / 1000;
+        char *line = records;
+        char *nl;
+        while ((nl = strchr(line, '\n')) != NULL) {
+            *nl = '\0';
+            if (st->v[STAT_JOBS] < replay_count) {
+                replay_record(line, at, ends, queue, spawn, dur, &nspawn, st);
+            }
+            line = nl + 1;
+        }
+        rec_len -= line - records;
+        memmove(records, line, rec_len);
+        if (rec_len == 2 * RING_SLOT_SIZE - 1) rec_len = 0;  // Registo comprido
+    }
+
+    exec_client_close(&client);
+    close(watch_fd);
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+
+    int done = st->v[STAT_JOBS];
+    replay_rates(st, ends, done);
+    st->v[STAT_QUEUE_P50] = percentile(queue, done, 50);
+    st->v[STAT_QUEUE_P99] = percentile(queue, done, 99);
+    st->v[STAT_SPAWN_P50] = percentile(spawn, nspawn, 50);
+    st->v[STAT_SPAWN_P99] = percentile(spawn, nspawn, 99);
+    st->v[STAT_DUR_P50] = percentile(dur, done, 50);
+    st->v[STAT_DUR_P99] = percentile(dur, done, 99);
+
+    free(ends);
+    free(queue);
+    free(spawn);
+    free(dur);
+    free(records);
+    return st->v[STAT_JOBS] + st->v[STAT_LOST] < submitted ? -1 : 0;
+}
+
+/*
+ * Tabela com uma coluna por corrida. Os rótulos têm acentos: o
+ * alinhamento conta caracteres e não bytes.
+ */
+void replay_table(struct replay_stats *cols, int ncols) {
+    print_str("                            ");
+    for (int c = 0; c < ncols; c++) {
+        for (int pad = strlen(cols[c].name); pad < 12; pad++) print_str(" ");
+        print_str(cols[c].name);
+    }
+    print_str("\n");
+
+    for (int field = 0; field < NUM_STATS; field++) {
+        const char *label = stat_labels[field];
+        int chars = 0;
+        for (const char *c = label; *c != '\0'; c++) chars += (*c & 0xC0) != 0x80;
+        print_str(label);
+        for (int pad = chars; pad < 28; pad++) print_str(" ");
+        for (int c = 0; c < ncols; c++) {
+            if (cols[c].v[field] < 0) print_str("           -");
+            else print_long(cols[c].v[field], 12);
+        }
+        print_str("\n");
+    }
+}
+
+int run_replays(const char *loop) {
+    if (replay_load(replay_path) == -1) return EXIT_FAILURE;
+    if (replay_stub) replay_calibrate();
+
+    print_str("[BENCH] Replay de ");
+    print_str(replay_path);
+    print_str(": ");
+    print_long(replay_count, 0);
+    print_str(" job(s) (");
+    print_long(replay_skipped, 0);
+    print_str(" linha(s) ignorada(s)), ");
+    print_str(replay_stub ? "com sleep no lugar dos comandos\n" : "com os comandos reais\n");
+    print_str("[BENCH] Tempos da coluna original a dividir por --speed.\n\n");
+
+    struct replay_stats cols[4];
+    int ncols = 1;
+    memset(cols, 0, sizeof(cols));
+    cols[0].name = "original";
+    replay_original(&cols[0]);
+
+    const char *loops[] = { "classic", "uring", "threads" };
+    int failed = 0;
+    for (int i = 0; i < 3; i++) {
+        if (strcmp(loop, loops[i]) == 0 || strcmp(loop, "all") == 0) {
+            failed |= run_replay(loops[i], &cols[ncols++]);
+        }
+    }
+
+    replay_table(cols, ncols);
+
+    unlink(BENCH_LOG);
+    return failed ? EXIT_FAILURE : 0;
+}
+
+void print_usage(void) {
+    print_err("Uso: ./bench [--loop classic|uring|threads|all] [-n mensagens] [-p produtores]\n");
+    print_err("             [-c comandos_por_mensagem] [--ring | --shards K] [--builtins]\n");
+    print_err("       ./bench --replay LOG [--speed X] [--stub] [--loop ...] [--ring] [--builtins]\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *loop = "all";
+
+    for (int i = 1; i < argc; i++) {
+        const char *value = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+        if (strcmp(argv[i], "--loop") == 0 && value != NULL) {
+            loop = value;
+            i++;
+        } else if (strcmp(argv[i], "-n") == 0 && value != NULL) {
+            num_messages = atoi(value);
+            i++;
+        } else if (strcmp(argv[i], "-p") == 0 && value != NULL) {
+            num_producers = atoi(value);
+            i++;
+        } else if (strcmp(argv[i], "-c") == 0 && value != NULL) {
+            cmds_per_message = atoi(value);
+            i++;
+        } else if (strcmp(argv[i], "--ring") == 0) {
+            use_ring = 1;
+        } else if (strcmp(argv[i], "--builtins") == 0) {
+            use_builtins = 1;
+        } else if (strcmp(argv[i], "--shards") == 0 && value != NULL) {
+            num_shards = atoi(value);
+            shards_arg = value;
+            i++;
+        } else if (strcmp(argv[i], "--replay") == 0 && value != NULL) {
+            replay_path = value;
+            i++;
+        } else if (strcmp(argv[i], "--speed") == 0 && value != NULL) {
+            replay_speed = strtod(value, NULL);
+            i++;
+        } else if (strcmp(argv[i], "--stub") == 0) {
+            replay_stub = 1;
+        } else {
+            print_usage();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (num_messages < 1 || num_producers < 1 || cmds_per_message < 1 ||
+        cmds_per_message > 32 || replay_speed <= 0 || num_shards < 0 ||
+        num_shards > SHARDS_MAX || (num_shards > 0 && (use_ring || replay_path != NULL))) {
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+    if (num_shards > 0) num_logs = num_shards;
+
+    if (replay_path != NULL) {
+        return run_replays(loop);
+    }
+
+    print_str("ciclo       comandos  submissão(ms)  total(ms)  comandos/s\n");
+
+    const char *loops[] = { "classic", "uring", "threads" };
+    int failed = 0;
+    for (int i = 0; i < 3; i++) {
+        if (strcmp(loop, loops[i]) == 0 || strcmp(loop, "all") == 0) {
+            failed |= run_bench(loops[i]);
+        }
+    }
+
+    remove_logs();
+    return failed ? EXIT_FAILURE : 0;
+}
@@ -16,6 +16,36 @@
  *   ./client "ls -la" "pwd" "date"
  *   
  *   Isto envia para o servidor: "ls -la;pwd;date"
+ *
+ *   ./client --coalesce "./warm-cache.sh"
+ *
+ *   Marca cada comando com "%coalesce ": se o mesmo comando já estiver a
+ *   correr no servidor, este pedido junta-se a ele em vez de o repetir.
+ *
+ *   ./client --cache=a.c,a.h "gcc -c a.c"
+ *
+ *   Marca cada comando com "%cache=a.c,a.h ": se o servidor já o correu
+ *   com os mesmos ficheiros de entrada, responde sem o voltar a correr.
+ *
+ *   ./client --map "gzip -9 {}" < ficheiros.txt
+ *
+ *   Um comando por linha do stdin, enviados em mensagens cheias; escreve
+ *   o exit status de cada item pela ordem da entrada.
+ *
+ *   ./client --watch exit=!0
+ *
+ *   Não envia comandos: liga-se ao servidor (--watch) e mostra uma linha
+ *   JSON por cada job que termina (aqui, só os que falharam).
+ *
+ *   ./client --fetch 1234
+ *
+ *   Mostra o output do job 1234 (ou do último de "--name NOME"), guardado
+ *   pelo servidor com --retain.
+ *
+ *   ./client --shard hash "make"
+ *
+ *   Servidor com --shards K: escolhe o FIFO pelo pid em vez de pelo shard
+ *   com menos jobs (a omissão). "--shard 2" usa o /tmp/exec_fifo.2.
  * 
  * ============================================================================
  */
@@ -26,6 +56,11 @@
 #include <sys/stat.h>   // permissões de ficheiros
 #include <string.h>     // strlen(), strcat()
 #include <errno.h>      // errno
+#include <sys/socket.h> // socket(), connect() (--watch)
+#include <sys/un.h>     // struct sockaddr_un
+#include <poll.h>       // poll() (--map)
+
+#include "exec_ring.h"  // FIFO_PATH, exec_client_open(), exec_client_submit()
 
 /*
  * ============================================================================
@@ -102,6 +137,9 @@ void print_error(const char *msg) {
         case ENOMEM:
             print_err("Out of memory");
             break;
+        case EMSGSIZE:
+            print_err("Message too long");
+            break;
         default:
             print_err("Error code ");
             print_int(STDERR_FILENO, errno);
@@ -110,18 +148,444 @@ void print_error(const char *msg) {
     print_err("\n");
 }
 
-/* 
- * Caminho do FIFO - tem de ser igual no cliente e no servidor
- * O FIFO é criado em /tmp porque é uma pasta acessível a todos
- */
-#define FIFO_PATH "/tmp/exec_fifo"
-
 /* 
  * Tamanho máximo da mensagem que podemos enviar
  * 4096 bytes é suficiente para vários comandos
  */
 #define MAX_MESSAGE 4096
 
+/*
+ * ============================================================================
+ * FUNÇÃO: watch
+ * ============================================================================
+ * ./client --watch [filtro ...]: envia os filtros (um por linha, ex:
+ * "cmd=make", "client=ci", "exit=!0") e copia para o stdout as linhas
+ * JSON que o servidor publica, até o servidor fechar a ligação.
+ */
+
+/*
+ * Liga-se ao socket do --watch e envia os filtros. Com wait_ready, pede
+ * também "ready" e só retorna quando o servidor confirmar que os filtros
+ * estão ativos (as linhas que cheguem antes são descartadas: podem não
+ * respeitar os filtros). Retorna o fd ou -1.
+ */
+int watch_connect(int count, char **filters, int wait_ready) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, WATCH_PATH, sizeof(addr.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        print_error("connect " WATCH_PATH " (o servidor usa --watch?)");
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (write(fd, filters[i], strlen(filters[i])) == -1 || write(fd, "\n", 1) == -1) {
+            print_error("write");
+            close(fd);
+            return -1;
+        }
+    }
+    if (!wait_ready) return fd;
+
+    if (write(fd, "ready\n", 6) == -1) {
+        print_error("write");
+        close(fd);
+        return -1;
+    }
+    char line[MAX_MESSAGE];
+    int len = 0;
+    char c;
+    while (read(fd, &c, 1) == 1) {
+        if (c != '\n') {
+            if (len < (int)sizeof(line) - 1) line[len++] = c;
+            continue;
+        }
+        line[len] = '\0';
+        if (strcmp(line, "{\"ready\":true}") == 0) return fd;
+        len = 0;
+    }
+    print_err("[CLIENT] Erro: o servidor fechou o --watch\n");
+    close(fd);
+    return -1;
+}
+
+int watch(int count, char **filters) {
+    int fd = watch_connect(count, filters, 1);
+    if (fd == -1) return EXIT_FAILURE;
+
+    char buffer[MAX_MESSAGE];
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+        write(STDOUT_FILENO, buffer, n);
+    }
+    close(fd);
+    return 0;
+}
+
+
+/*
+ * ============================================================================
+ * FUNÇÃO: fetch (./client --fetch ID)
+ * ============================================================================
+ * Pede ao servidor o output guardado de um job (ID = número do job, o
+ * "id" do --watch, ou o nome dado com --name). A resposta é uma linha
+ * {"fetch":...,"found":true|false,...} seguida do output; antes dela
+ * podem chegar registos do --watch, que são ignorados.
+ * Retorna 0 se o output existia, 1 se não.
+ */
+int fetch(const char *id) {
+    char request[MAX_MESSAGE];
+    if (strlen(id) + 7 > sizeof(request)) {
+        print_err("[CLIENT] Erro: id demasiado longo\n");
+        return EXIT_FAILURE;
+    }
+    strcpy(request, "fetch=");
+    strcat(request, id);
+
+    char *filters[1] = { request };
+    int fd = watch_connect(1, filters, 0);  // Depois de fetch= o resto é ignorado
+    if (fd == -1) return EXIT_FAILURE;
+
+    char buffer[MAX_MESSAGE];
+    int len = 0;
+    int found = -1;
+    ssize_t n;
+    while (found == -1 && (n = read(fd, buffer + len, sizeof(buffer) - len)) > 0) {
+        len += n;
+        char *nl;
+        while (found == -1 && (nl = memchr(buffer, '\n', len)) != NULL) {
+            *nl = '\0';
+            if (strncmp(buffer, "{\"fetch\":", 9) == 0) {
+                found = strstr(buffer, "\"found\":true") != NULL;
+            }
+            int used = nl - buffer + 1;
+            memmove(buffer, buffer + used, len - used);
+            len -= used;
+        }
+        if (len == (int)sizeof(buffer)) len = 0;  // Registo comprido: ignora
+    }
+
+    if (found == 1) {
+        write(STDOUT_FILENO, buffer, len);
+        while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+            write(STDOUT_FILENO, buffer, n);
+        }
+    } else {
+        print_err("[CLIENT] Não há output guardado para '");
+        print_err(id);
+        print_err("' (o servidor usa --retain?)\n");
+    }
+    close(fd);
+    return found == 1 ? 0 : 1;
+}
+
+
+/*
+ * ============================================================================
+ * FUNÇÃO: map (./client --map 'gzip -9 {}' < lista)
+ * ============================================================================
+ *
+ * OBJETIVO:
+ * Correr o mesmo comando para cada linha do stdin (como o xargs), sem ter
+ * de partir a lista à mão em mensagens de MAX_MESSAGE bytes.
+ *
+ * COMO FUNCIONA:
+ * 1. Cada linha substitui os "{}" do modelo (sem "{}", vai no fim)
+ * 2. Os comandos são juntos em mensagens tão grandes quanto possível
+ *    (MAX_MESSAGE bytes, MAX_COMMANDS comandos) e enviados logo
+ * 3. Cada comando leva "%client=map-PID.N": o cliente subscreve o --watch
+ *    do servidor com "client=map-PID" e sabe quando cada item termina
+ * 4. Escreve "estado<TAB>item" por cada item, pela ordem da entrada
+ *    (omissão) ou pela ordem em que terminam (--order done). O estado é o
+ *    exit status, ou 128 + sinal
+ *
+ * MEMÓRIA CONSTANTE:
+ * No máximo MAP_WINDOW itens estão enviados e por escrever. Com a janela
+ * cheia, o cliente deixa de ler o stdin até chegarem resultados. Como o
+ * servidor guarda até 1024 registos por subscritor, nenhum se perde.
+ *
+ * O servidor tem de usar --watch. Numa atualização do servidor a
+ * subscrição cai e o cliente termina com erro.
+ */
+#define MAP_WINDOW 512     // Itens enviados e ainda por escrever
+#define MAP_CMD_MAX 511    // Tamanho máximo de um comando (como no servidor)
+
+struct map_item {
+    char text[MAP_CMD_MAX + 1];
+    int done;
+    int status;
+};
+
+struct map_item map_items[MAP_WINDOW];
+long map_base = 0;          // Item mais antigo ainda por escrever
+long map_next = 0;          // Número do próximo item
+int map_in_order = 1;       // --order input (omissão) / done
+int map_failed = 0;
+
+void map_print(struct map_item *item) {
+    print_int(STDOUT_FILENO, item->status);
+    print_str("\t");
+    print_str(item->text);
+    print_str("\n");
+    if (item->status != 0) map_failed = 1;
+}
+
+/*
+ * O item seq terminou: escreve-o (já ou quando os anteriores terminarem)
+ */
+void map_done(long seq, int status) {
+    if (seq < map_base || seq >= map_next) return;
+    struct map_item *item = &map_items[seq % MAP_WINDOW];
+    if (item->done) return;
+
+    item->done = 1;
+    item->status = status;
+    if (!map_in_order) map_print(item);
+
+    while (map_base < map_next && map_items[map_base % MAP_WINDOW].done) {
+        if (map_in_order) map_print(&map_items[map_base % MAP_WINDOW]);
+        map_base++;
+    }
+}
+
+/*
+ * Valor numérico de "campo":N numa linha JSON (-1 se for null ou não existir)
+ */
+long json_long(const char *line, const char *field) {
+    const char *p = strstr(line, field);
+    if (p == NULL) return -1;
+    p += strlen(field);
+    if (*p < '0' || *p > '9') return -1;
+
+    long value = 0;
+    while (*p >= '0' && *p <= '9') value = value * 10 + (*p++ - '0');
+    return value;
+}
+
+/*
+ * Um registo do --watch: {"...","client":"map-PID.N",...,"exit":0,"signal":null,...}
+ */
+void map_record(const char *line, const char *tag) {
+    const char *p = strstr(line, tag);
+    if (p == NULL) return;
+    long seq = json_long(p, tag);
+
+    // Depois de "client" (o "cmd", antes, pode ter qualquer texto)
+    long code = json_long(p, "\"exit\":");
+    long sig = json_long(p, "\"signal\":");
+    map_done(seq, code != -1 ? (int)code : 128 + (int)sig);
+}
+
+int map(const char *template, const char *prefix) {
+    char tag[64];               // "map-PID" (filtro) e "\"client\":\"map-PID." (registos)
+    char name[32];
+    char *filters[1];
+    int pid = getpid();
+
+    strcpy(name, "client=map-");
+    int len = strlen(name);
+    for (int div = 1000000000; div > 0; div /= 10) {
+        if (pid >= div || div == 1) name[len++] = '0' + (pid / div) % 10;
+    }
+    name[len] = '\0';
+    filters[0] = name;
+    strcpy(tag, "\"client\":\"");
+    strcat(tag, name + 7);
+    strcat(tag, ".");
+
+    int watch_fd = watch_connect(1, filters, 1);  // Antes de submeter: nenhum fim se perde
+    if (watch_fd == -1) return EXIT_FAILURE;
+
+    struct exec_client conn;
+    if (exec_client_open(&conn) == -1) {
+        print_error("open");
+        return EXIT_FAILURE;
+    }
+
+    char in[MAX_MESSAGE];       // stdin ainda por tratar
+    int in_len = 0;
+    int in_eof = 0;
+    char records[MAX_MESSAGE];  // Registos do --watch ainda incompletos
+    int records_len = 0;
+    char message[MAX_MESSAGE];
+    int message_len = 0;
+    int message_cmds = 0;
+
+    while (!in_eof || in_len > 0 || map_base < map_next) {
+        /*
+         * Itens completos no buffer -> comandos na mensagem, enquanto
+         * houver lugar na janela. Só recomeça com lugar para uma mensagem
+         * cheia: encher um lugar de cada vez dava mensagens de um comando.
+         */
+        int start = 0;
+        int room = MAP_WINDOW - (int)(map_next - map_base);
+        if (room < MAX_COMMANDS && map_base < map_next) room = 0;
+        while (room-- > 0) {
+            char *nl = memchr(in + start, '\n', in_len - start);
+            if (nl == NULL && !(in_eof && start < in_len)) break;
+            int item_len = nl != NULL ? nl - (in + start) : in_len - start;
+            char *item_text = in + start;
+            item_text[item_len] = '\0';
+            start += item_len + (nl != NULL);
+            if (item_len == 0) continue;
+
+            // Comando: modelo com "{}" substituído pelo item
+            char cmd[MAX_MESSAGE];
+            int cmd_len = 0;
+            int replaced = 0;
+            for (const char *t = template; *t != '\0' && cmd_len < MAX_MESSAGE - 1; t++) {
+                if (t[0] == '{' && t[1] == '}') {
+                    int n = item_len < MAX_MESSAGE - 1 - cmd_len ? item_len : MAX_MESSAGE - 1 - cmd_len;
+                    memcpy(cmd + cmd_len, item_text, n);
+                    cmd_len += n;
+                    replaced = 1;
+                    t++;
+                } else {
+                    cmd[cmd_len++] = *t;
+                }
+            }
+            if (!replaced && cmd_len + 1 + item_len < MAX_MESSAGE) {
+                cmd[cmd_len++] = ' ';
+                memcpy(cmd + cmd_len, item_text, item_len);
+                cmd_len += item_len;
+            }
+            cmd[cmd_len] = '\0';
+
+            long seq = map_next++;
+            struct map_item *item = &map_items[seq % MAP_WINDOW];
+            strncpy(item->text, item_text, MAP_CMD_MAX);
+            item->text[MAP_CMD_MAX] = '\0';
+            item->done = 0;
+
+            if (cmd_len > MAP_CMD_MAX || strchr(cmd, ';') != NULL) {
+                print_err("[CLIENT] Item ignorado (comando longo ou com ';'): ");
+                print_err(item->text);
+                print_err("\n");
+                map_done(seq, 127);
+                continue;
+            }
+
+            // "%client=map-PID.N " + comando
+            char entry[MAX_MESSAGE];
+            strcpy(entry, prefix);
+            strcat(entry, "%client=");
+            strcat(entry, name + 7);
+            strcat(entry, ".");
+            int entry_len = strlen(entry);
+            for (long div = 1000000000000L; div > 0; div /= 10) {
+                if (seq >= div || div == 1) entry[entry_len++] = '0' + (seq / div) % 10;
+            }
+            entry[entry_len++] = ' ';
+            memcpy(entry + entry_len, cmd, cmd_len + 1);
+            entry_len += cmd_len;
+
+            // Mensagem cheia: envia e começa outra
+            if (message_cmds == MAX_COMMANDS ||
+                message_len + 1 + entry_len >= RING_SLOT_SIZE) {
+                if (exec_client_submit(&conn, message, message_len) == -1) {
+                    print_error("write");
+                    return EXIT_FAILURE;
+                }
+                message_len = 0;
+                message_cmds = 0;
+            }
+            if (message_cmds > 0) message[message_len++] = ';';
+            memcpy(message + message_len, entry, entry_len);
+            message_len += entry_len;
+            message_cmds++;
+        }
+        memmove(in, in + start, in_len - start);
+        in_len -= start;
+
+        // Não há mais itens prontos: envia o que estiver juntado
+        if (message_cmds > 0) {
+            if (exec_client_submit(&conn, message, message_len) == -1) {
+                print_error("write");
+                return EXIT_FAILURE;
+            }
+            message_len = 0;
+            message_cmds = 0;
+        }
+        if (in_eof && in_len == 0 && map_base == map_next) break;
+
+        /*
+         * Espera por resultados e (se houver lugar) por mais stdin
+         */
+        struct pollfd fds[2];
+        int nfds = 1;
+        fds[0].fd = watch_fd;
+        fds[0].events = POLLIN;
+        int want_input = !in_eof && map_next - map_base < MAP_WINDOW &&
+                         memchr(in, '\n', in_len) == NULL;
+        if (want_input) {
+            fds[1].fd = STDIN_FILENO;
+            fds[1].events = POLLIN;
+            nfds = 2;
+        }
+        if (poll(fds, nfds, -1) == -1) {
+            if (errno == EINTR) continue;
+            print_error("poll");
+            return EXIT_FAILURE;
+        }
+
+        if (fds[0].revents & (POLLIN | POLLHUP)) {
+            ssize_t n = read(watch_fd, records + records_len, sizeof(records) - 1 - records_len);
+            if (n <= 0) {
+                print_err("[CLIENT] O servidor fechou a ligação do --watch (");
+                print_int(STDERR_FILENO, (int)(map_next - map_base));
+                print_err(" item(s) sem resultado)\n");
+                return EXIT_FAILURE;
+            }
+            records_len += n;
+            records[records_len] = '\0';
+
+            char *line = records;
+            char *nl;
+            while ((nl = strchr(line, '\n')) != NULL) {
+                *nl = '\0';
+                map_record(line, tag);
+                line = nl + 1;
+            }
+            records_len -= line - records;
+            memmove(records, line, records_len);
+        }
+
+        if (nfds == 2 && (fds[1].revents & (POLLIN | POLLHUP))) {
+            if (in_len == (int)sizeof(in) - 1) {
+                print_err("[CLIENT] Linha demasiado longa no stdin; ignorada\n");
+                in_len = 0;
+            }
+            ssize_t n = read(STDIN_FILENO, in + in_len, sizeof(in) - 1 - in_len);
+            if (n <= 0) in_eof = 1;
+            else in_len += n;
+        }
+    }
+
+    exec_client_close(&conn);
+    close(watch_fd);
+    return map_failed ? EXIT_FAILURE : 0;
+}
+
+/*
+ * Mostra como se usa e termina (sem comandos ou argumento inválido)
+ */
+void print_usage(void) {
+    write(STDOUT_FILENO, "Uso: ./client \"cmd1 args\" \"cmd2 args\" ...\n", 42);
+    write(STDOUT_FILENO, "Exemplo: ./client \"ls -la\" \"pwd\" \"date\"\n", 40);
+    print_str("       ./client --coalesce \"cmd\" ...  (junta-se a um igual em curso)\n");
+    print_str("       ./client --cache[=f1,f2] \"cmd\" ...  (reutiliza o resultado guardado)\n");
+    print_str("       ./client --prepare nome \"cmd {param} ...\"  (regista um modelo)\n");
+    print_str("       ./client --invoke nome \"valor ...\" ...  (corre o modelo com estes valores)\n");
+    print_str("       ./client --name nome \"cmd\" ...  (identifica o pedido no --watch)\n");
+    print_str("       ./client --watch [cmd=texto] [client=nome] [exit=N|exit=!N]  (resultados em direto)\n");
+    print_str("       ./client --map \"gzip -9 {}\" [--order done] < lista  (um comando por linha)\n");
+    print_str("       ./client --fetch id|nome  (output guardado com --retain)\n");
+    print_str("       ./client --shard least|hash|N \"cmd\" ...  (servidor com --shards)\n");
+    exit(EXIT_FAILURE);
+}
 
 /*
  * ============================================================================
@@ -141,9 +605,86 @@ void print_error(const char *msg) {
  *   - EXIT_FAILURE se houve algum erro
  */
 int main(int argc, char *argv[]) {
-    int fd;                      // Descritor do ficheiro FIFO
+    struct exec_client conn;     // Ligação ao servidor (anel ou FIFO)
     char message[MAX_MESSAGE];   // Buffer para construir a mensagem
+    int first = 1;               // Índice do primeiro comando em argv
+    char prefix[MAX_MESSAGE];    // Diretivas postas antes de cada comando
+
+    /*
+     * Opções (antes dos comandos):
+     *   --coalesce        -> "%coalesce "
+     *   --cache[=a,b]     -> "%cache " / "%cache=a,b "
+     *   --prepare NOME    -> "%prepare NOME " (cada argumento é um modelo)
+     *   --invoke NOME     -> "%invoke NOME "  (cada argumento são os valores)
+     *   --name NOME       -> "%client=NOME "  (filtro client= do --watch)
+     *   --watch [filtros] -> não envia comandos: mostra os resultados
+     *   --fetch ID        -> não envia comandos: mostra o output guardado
+     *   --map MODELO      -> um comando por linha do stdin (ver map())
+     *   --order input|done   ordem dos resultados de --map
+     *   --shard least|hash|N -> qual FIFO usar com --shards (omissão: least)
+     */
+    const char *map_template = NULL;
+    int shard = -2;              // -2 = exec_client_open() escolhe
+    prefix[0] = '\0';
+    while (first < argc && strncmp(argv[first], "--", 2) == 0) {
+        if (strcmp(argv[first], "--coalesce") == 0) {
+            strcat(prefix, "%coalesce ");
+        } else if (strcmp(argv[first], "--cache") == 0) {
+            strcat(prefix, "%cache ");
+        } else if (strncmp(argv[first], "--cache=", 8) == 0 &&
+                   strlen(prefix) + strlen(argv[first]) + 2 < sizeof(prefix)) {
+            strcat(prefix, "%cache=");
+            strcat(prefix, argv[first] + 8);
+            strcat(prefix, " ");
+        } else if (strcmp(argv[first], "--map") == 0 && first + 1 < argc) {
+            map_template = argv[++first];
+        } else if (strcmp(argv[first], "--order") == 0 && first + 1 < argc) {
+            map_in_order = strcmp(argv[++first], "done") != 0;
+        } else if (strcmp(argv[first], "--shard") == 0 && first + 1 < argc) {
+            const char *mode = argv[++first];
+            if (strcmp(mode, "least") == 0) shard = exec_shard_pick(SHARD_PICK_LEAST);
+            else if (strcmp(mode, "hash") == 0) shard = exec_shard_pick(SHARD_PICK_HASH);
+            else {
+                // N tem de ser um dos shards do supervisor (0..K-1)
+                int count = exec_shard_count();
+                int digits = strspn(mode, "0123456789");
+                if (count == -1) {
+                    print_err("[CLIENT] Erro: --shard N precisa de um servidor com --shards\n");
+                    print_usage();
+                }
+                if (digits == 0 || digits > 2 || mode[digits] != '\0' || atoi(mode) >= count) {
+                    print_err("[CLIENT] Erro: --shard N tem de estar entre 0 e ");
+                    print_int(STDERR_FILENO, count - 1);
+                    print_err("\n");
+                    print_usage();
+                }
+                shard = atoi(mode);
+            }
+        } else if (strcmp(argv[first], "--watch") == 0) {
+            return watch(argc - first - 1, argv + first + 1);
+        } else if (strcmp(argv[first], "--fetch") == 0 && first + 1 < argc) {
+            return fetch(argv[first + 1]);
+        } else if (strcmp(argv[first], "--name") == 0 && first + 1 < argc &&
+                   strlen(prefix) + strlen(argv[first + 1]) + 12 < sizeof(prefix)) {
+            strcat(prefix, "%client=");
+            strcat(prefix, argv[++first]);
+            strcat(prefix, " ");
+        } else if ((strcmp(argv[first], "--prepare") == 0 ||
+                    strcmp(argv[first], "--invoke") == 0) && first + 1 < argc &&
+                   strlen(prefix) + strlen(argv[first + 1]) + 12 < sizeof(prefix)) {
+            strcat(prefix, strcmp(argv[first], "--prepare") == 0 ? "%prepare " : "%invoke ");
+            strcat(prefix, argv[++first]);
+            strcat(prefix, " ");
+        } else {
+            break;
+        }
+        first++;
+    }
     
+    if (map_template != NULL) {
+        return map(map_template, prefix);
+    }
+
     /*
      * ========================================================================
      * PASSO 1: Verificar se o utilizador passou comandos
@@ -151,10 +692,8 @@ int main(int argc, char *argv[]) {
      * Se argc < 2, significa que só temos argv[0] (o nome do programa)
      * e o utilizador não passou nenhum comando
      */
-    if (argc < 2) {
-        write(STDOUT_FILENO, "Uso: ./client \"cmd1 args\" \"cmd2 args\" ...\n", 42);
-        write(STDOUT_FILENO, "Exemplo: ./client \"ls -la\" \"pwd\" \"date\"\n", 40);
-        exit(EXIT_FAILURE);
+    if (argc < first + 1) {
+        print_usage();
     }
 
     /*
@@ -171,10 +710,10 @@ int main(int argc, char *argv[]) {
      */
     message[0] = '\0';  // Inicializa a mensagem vazia
     
-    for (int i = 1; i < argc; i++) {
+    for (int i = first; i < argc; i++) {
         
         // Verifica se ainda há espaço na mensagem
-        if (strlen(message) + strlen(argv[i]) + 2 > MAX_MESSAGE) {
+        if (strlen(message) + strlen(prefix) + strlen(argv[i]) + 2 > MAX_MESSAGE) {
             print_err("[CLIENT] Erro: mensagem total demasiado longa (max ");
             print_int(STDERR_FILENO, MAX_MESSAGE);
             print_err(" bytes)\n");
@@ -187,6 +726,7 @@ int main(int argc, char *argv[]) {
         }
         
         // Adiciona o comando à mensagem
+        strcat(message, prefix);
         strcat(message, argv[i]);
         
         // Adiciona ';' entre os comandos (mas não depois do último)
@@ -197,17 +737,19 @@ int main(int argc, char *argv[]) {
 
     /*
      * ========================================================================
-     * PASSO 3: Abrir o FIFO para escrita
+     * PASSO 3: Ligar ao servidor
      * ========================================================================
      * 
-     * open() com O_WRONLY abre o FIFO apenas para escrita
+     * exec_client_open() usa o anel em memória partilhada se o servidor
+     * tiver arrancado com --ring; senão abre o FIFO com O_WRONLY (com
+     * --shards, o do shard com menos jobs, ou o escolhido com --shard).
      * 
      * NOTA IMPORTANTE:
-     * Esta chamada BLOQUEIA até que o servidor abra o FIFO para leitura!
+     * Abrir o FIFO BLOQUEIA até que o servidor o abra para leitura!
      * Por isso, o servidor tem de estar a correr primeiro.
      */
-    fd = open(FIFO_PATH, O_WRONLY);
-    if (fd == -1) {
+    int opened = shard == -2 ? exec_client_open(&conn) : exec_client_open_shard(&conn, shard);
+    if (opened == -1) {
         print_error("open");  // Mostra o erro (ex: "No such file or directory")
         exit(EXIT_FAILURE);
     }
@@ -217,17 +759,14 @@ int main(int argc, char *argv[]) {
      * PASSO 4: Enviar a mensagem para o servidor
      * ========================================================================
      * 
-     * write() envia os dados através do FIFO
-     * - fd: descritor do FIFO
-     * - message: dados a enviar
-     * - strlen(message): número de bytes a enviar
-     * 
-     * IMPORTANTE: Enviamos tudo num único write() conforme o enunciado pede
+     * exec_client_submit() envia a mensagem:
+     * - FIFO: num único write() conforme o enunciado pede, terminada
+     *   em '\n' para o servidor separar mensagens de clientes diferentes
+     * - Anel: copia a mensagem para uma slot, sem syscalls
      */
-    ssize_t written = write(fd, message, strlen(message));
-    if (written == -1) {
+    if (exec_client_submit(&conn, message, strlen(message)) == -1) {
         print_error("write");
-        close(fd);
+        exec_client_close(&conn);
         exit(EXIT_FAILURE);
     }
     
@@ -237,11 +776,11 @@ int main(int argc, char *argv[]) {
      * ========================================================================
      */
     print_str("[CLIENT] Enviados ");
-    print_int(STDOUT_FILENO, argc - 1);
+    print_int(STDOUT_FILENO, argc - first);
     print_str(" comando(s):\n");
-    for (int i = 1; i < argc; i++) {
+    for (int i = first; i < argc; i++) {
         print_str("  ");
-        print_int(STDOUT_FILENO, i);
+        print_int(STDOUT_FILENO, i - first + 1);
         print_str(": ");
         print_str(argv[i]);
         print_str("\n");
@@ -249,14 +788,14 @@ int main(int argc, char *argv[]) {
 
     /*
      * ========================================================================
-     * PASSO 6: Fechar o FIFO
+     * PASSO 6: Fechar a ligação
      * ========================================================================
      * 
      * Fechar o FIFO é MUITO IMPORTANTE porque:
      * - Sinaliza ao servidor que terminámos de enviar (EOF)
      * - Liberta os recursos do sistema
      */
-    close(fd);
+    exec_client_close(&conn);
     
     return 0;
 }
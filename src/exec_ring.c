@@ -0,0 +1,470 @@
+/*
+ * ============================================================================
+ * EXEC_RING - Anel MPSC em memória partilhada - Projeto SO 25/26
+ * ============================================================================
+ *
+ * Implementação do anel descrito em exec_ring.h. É compilado no servidor
+ * (consumidor) e em build/libexecring.a (produtores).
+ *
+ * PROTOCOLO DE CADA SLOT (fila limitada de Vyukov):
+ *   seq == pos               -> slot livre para a posição pos
+ *   seq == pos + 1           -> slot com um frame publicado
+ *   seq == pos + RING_SLOTS  -> slot libertada pelo consumidor
+ *
+ * ============================================================================
+ */
+
+#include <stdlib.h>     // NULL
+#include <unistd.h>     // write(), close(), ftruncate()
+#include <fcntl.h>      // O_RDWR, O_CREAT, O_WRONLY
+#include <sys/mman.h>   // shm_open(), mmap(), munmap(), shm_unlink()
+#include <sys/syscall.h> // SYS_futex
+#include <linux/futex.h> // FUTEX_WAIT, FUTEX_WAKE
+#include <string.h>     // memcpy()
+#include <signal.h>     // kill()
+#include <sched.h>      // sched_yield()
+#include <errno.h>      // errno, EAGAIN, EMSGSIZE, EPERM, EPIPE, EEXIST
+
+#include "exec_ring.h"
+
+/*
+ * kill(pid, 0) dá EPERM se o processo existe mas é de outro utilizador
+ * (servidor a correr como root, por exemplo): também está vivo.
+ */
+static int process_alive(pid_t pid) {
+    return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+/*
+ * ============================================================================
+ * FUTEX
+ * ============================================================================
+ * Sem FUTEX_PRIVATE_FLAG porque a palavra vive em memória partilhada entre
+ * processos diferentes.
+ */
+void exec_futex_wait(_Atomic uint32_t *addr, uint32_t expected) {
+    syscall(SYS_futex, addr, FUTEX_WAIT, expected, NULL, NULL, 0);
+}
+
+void exec_futex_wake(_Atomic uint32_t *addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+
+/*
+ * ============================================================================
+ * LADO DO SERVIDOR (consumidor único)
+ * ============================================================================
+ */
+
+/*
+ * Cria (ou recria) o anel. Retorna NULL se a memória partilhada não
+ * estiver disponível - o servidor continua só com o FIFO.
+ */
+struct exec_ring *ring_create(void) {
+    int fd = shm_open(RING_NAME, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) return NULL;
+
+    if (ftruncate(fd, sizeof(struct exec_ring)) == -1) {
+        close(fd);
+        shm_unlink(RING_NAME);
+        return NULL;
+    }
+
+    struct exec_ring *ring = mmap(NULL, sizeof(struct exec_ring),
+                                  PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);  // O mapeamento continua válido depois do close()
+    if (ring == MAP_FAILED) {
+        shm_unlink(RING_NAME);
+        return NULL;
+    }
+
+    // ftruncate() deixou tudo a zero; só falta numerar as slots
+    for (uint64_t i = 0; i < RING_SLOTS; i++) {
+        atomic_store_explicit(&ring->slots[i].seq, i, memory_order_relaxed);
+    }
+    ring->server_pid = getpid();
+    atomic_store(&ring->idle, 0);
+    atomic_store(&ring->tail, 0);
+    ring->head = 0;
+
+    // magic por último: a partir daqui os clientes podem usar o anel
+    atomic_thread_fence(memory_order_release);
+    ring->magic = RING_MAGIC;
+    return ring;
+}
+
+/*
+ * Volta a abrir o anel que o servidor já tinha criado, sem o apagar
+ * (atualização do servidor por re-exec: os frames por ler e head
+ * continuam na memória partilhada). Retorna NULL se não existir.
+ */
+struct exec_ring *ring_reopen(void) {
+    int fd = shm_open(RING_NAME, O_RDWR, 0);
+    if (fd == -1) return NULL;
+
+    struct exec_ring *ring = mmap(NULL, sizeof(struct exec_ring),
+                                  PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring == MAP_FAILED) return NULL;
+
+    if (ring->magic != RING_MAGIC) {
+        munmap(ring, sizeof(struct exec_ring));
+        return NULL;
+    }
+    ring->server_pid = getpid();
+    atomic_store(&ring->idle, 0);
+    return ring;
+}
+
+void ring_destroy(struct exec_ring *ring) {
+    if (ring == NULL) return;
+    ring->magic = 0;
+    munmap(ring, sizeof(struct exec_ring));
+    shm_unlink(RING_NAME);
+}
+
+/*
+ * Retira um frame do anel para buffer (terminado em '\0').
+ * Retorna o tamanho do frame ou -1 se o anel estiver vazio.
+ */
+int ring_pop(struct exec_ring *ring, char *buffer, size_t size) {
+    uint64_t pos = ring->head;
+    struct ring_slot *slot = &ring->slots[pos & (RING_SLOTS - 1)];
+
+    if (atomic_load_explicit(&slot->seq, memory_order_acquire) != pos + 1) {
+        return -1;
+    }
+
+    size_t len = slot->len;
+    if (len > size - 1) len = size - 1;
+    memcpy(buffer, slot->data, len);
+    buffer[len] = '\0';
+
+    atomic_store_explicit(&slot->seq, pos + RING_SLOTS, memory_order_release);
+    ring->head = pos + 1;
+    return (int)len;
+}
+
+/*
+ * Bloqueia até haver pelo menos um frame no anel.
+ *
+ * Marcamos idle = 1 ANTES de voltar a ver o anel: um produtor que publique
+ * entretanto vê idle == 1 e faz FUTEX_WAKE, por isso nunca perdemos um
+ * acordar. Os fences seq_cst emparelham com os de exec_client_submit().
+ */
+void ring_wait(struct exec_ring *ring) {
+    for (;;) {
+        struct ring_slot *slot = &ring->slots[ring->head & (RING_SLOTS - 1)];
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire) == ring->head + 1) {
+            atomic_store(&ring->idle, 0);
+            return;
+        }
+
+        atomic_store(&ring->idle, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire) == ring->head + 1) {
+            atomic_store(&ring->idle, 0);
+            return;
+        }
+        exec_futex_wait(&ring->idle, 1);
+    }
+}
+
+
+/*
+ * ============================================================================
+ * PÁGINA DE ESTADO DOS SHARDS (--shards K)
+ * ============================================================================
+ * O supervisor cria a página; cada shard liga-se a ela (shards_attach) e
+ * escreve o seu pid e o número de jobs por acabar na sua entrada.
+ *
+ * Se a página já for de um supervisor vivo, não lhe toca: retorna NULL
+ * com errno = EEXIST (os FIFOs dos shards também são dele).
+ */
+struct exec_shards *shards_create(int count) {
+    struct exec_shards *old = shards_attach();
+    if (old != NULL) {
+        int alive = old->supervisor_pid != getpid() && process_alive(old->supervisor_pid);
+        munmap(old, sizeof(struct exec_shards));
+        if (alive) {
+            errno = EEXIST;
+            return NULL;
+        }
+    }
+
+    int fd = shm_open(SHARDS_NAME, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) return NULL;
+
+    if (ftruncate(fd, sizeof(struct exec_shards)) == -1) {
+        close(fd);
+        shm_unlink(SHARDS_NAME);
+        return NULL;
+    }
+
+    struct exec_shards *page = mmap(NULL, sizeof(struct exec_shards),
+                                    PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED) {
+        shm_unlink(SHARDS_NAME);
+        return NULL;
+    }
+
+    page->supervisor_pid = getpid();
+    page->count = count;
+    atomic_thread_fence(memory_order_release);
+    page->magic = SHARDS_MAGIC;
+    return page;
+}
+
+struct exec_shards *shards_attach(void) {
+    int fd = shm_open(SHARDS_NAME, O_RDWR, 0);
+    if (fd == -1) return NULL;
+
+    struct exec_shards *page = mmap(NULL, sizeof(struct exec_shards),
+                                    PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED) return NULL;
+
+    if (page->magic != SHARDS_MAGIC) {
+        munmap(page, sizeof(struct exec_shards));
+        return NULL;
+    }
+    return page;
+}
+
+void shards_destroy(struct exec_shards *page) {
+    if (page == NULL) return;
+    page->magic = 0;
+    munmap(page, sizeof(struct exec_shards));
+    shm_unlink(SHARDS_NAME);
+}
+
+
+/*
+ * ============================================================================
+ * LADO DO CLIENTE (produtores)
+ * ============================================================================
+ */
+
+/*
+ * Abre o anel se o servidor o tiver criado e ainda estiver vivo.
+ */
+static struct exec_ring *ring_attach(void) {
+    int fd = shm_open(RING_NAME, O_RDWR, 0);
+    if (fd == -1) return NULL;
+
+    struct exec_ring *ring = mmap(NULL, sizeof(struct exec_ring),
+                                  PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ring == MAP_FAILED) return NULL;
+
+    // Anel abandonado (servidor morreu sem limpar) -> usa o FIFO
+    if (ring->magic != RING_MAGIC || !process_alive(ring->server_pid)) {
+        munmap(ring, sizeof(struct exec_ring));
+        return NULL;
+    }
+    return ring;
+}
+
+/*
+ * Liga-se ao servidor. Retorna 0 em caso de sucesso, -1 com errno se nem
+ * o anel nem o FIFO estiverem disponíveis.
+ *
+ * NOTA: tal como no ./client, abrir o FIFO bloqueia até o servidor o
+ * abrir para leitura.
+ */
+int exec_client_open(struct exec_client *client) {
+    client->fifo_fd = -1;
+    client->ring = ring_attach();
+    if (client->ring != NULL) return 0;
+
+    return exec_client_open_shard(client, exec_shard_pick(SHARD_PICK_LEAST));
+}
+
+/*
+ * Liga-se ao FIFO de um shard escolhido pelo chamador (-1 = FIFO_PATH,
+ * servidor sem shards). Os shards não têm anel.
+ */
+int exec_client_open_shard(struct exec_client *client, int shard) {
+    char path[64];
+    exec_shard_fifo(shard, path, sizeof(path));
+
+    client->ring = NULL;
+    client->fifo_fd = open(path, O_WRONLY);
+    return client->fifo_fd == -1 ? -1 : 0;
+}
+
+/*
+ * FIFO de um shard: /tmp/exec_fifo.N (FIFO_PATH se shard == -1)
+ */
+void exec_shard_fifo(int shard, char *path, size_t size) {
+    char digits[12];
+    int n = 0;
+    if (shard >= 0) {
+        do {
+            digits[n++] = '0' + shard % 10;
+            shard /= 10;
+        } while (shard > 0);
+    }
+
+    size_t len = strlen(FIFO_PATH);
+    if (len + n + 2 > size) len = 0;  // path[64] chega sempre
+    memcpy(path, FIFO_PATH, len);
+    if (n > 0) path[len++] = '.';
+    while (n > 0) path[len++] = digits[--n];
+    path[len] = '\0';
+}
+
+/*
+ * Escolhe um shard (SHARD_PICK_LEAST ou SHARD_PICK_HASH).
+ * Retorna -1 se não houver um supervisor vivo (servidor sem --shards).
+ *
+ * A procura começa no shard dado pelo pid, por isso com filas iguais os
+ * clientes espalham-se. A profundidade lida pode já estar desatualizada
+ * (outro cliente pode ter escolhido o mesmo shard ao mesmo tempo) - é só
+ * um palpite, o shard aceita a mensagem de qualquer forma.
+ */
+int exec_shard_pick(int mode) {
+    int fd = shm_open(SHARDS_NAME, O_RDONLY, 0);
+    if (fd == -1) return -1;
+
+    struct exec_shards *page = mmap(NULL, sizeof(struct exec_shards),
+                                    PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED) return -1;
+
+    int best = -1;
+    uint32_t count = page->count;
+    if (page->magic == SHARDS_MAGIC && count >= 1 && count <= SHARDS_MAX &&
+        process_alive(page->supervisor_pid)) {
+        uint32_t start = ((uint32_t)getpid() * 2654435761u) % count;
+        uint32_t best_depth = UINT32_MAX;
+
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t s = (start + i) % count;
+            pid_t pid = atomic_load_explicit(&page->shards[s].pid, memory_order_relaxed);
+            if (pid == 0) continue;  // A ser relançado: vai para outro
+
+            uint32_t depth = atomic_load_explicit(&page->shards[s].depth,
+                                                  memory_order_relaxed);
+            if (depth < best_depth) {
+                best = s;
+                best_depth = depth;
+            }
+            if (mode == SHARD_PICK_HASH || depth == 0) break;
+        }
+        if (best == -1) best = start;  // Todos parados: o FIFO espera pelo shard
+    }
+
+    munmap(page, sizeof(struct exec_shards));
+    return best;
+}
+
+/*
+ * Número de shards do supervisor vivo, ou -1 se não houver (--shard N)
+ */
+int exec_shard_count(void) {
+    int fd = shm_open(SHARDS_NAME, O_RDONLY, 0);
+    if (fd == -1) return -1;
+
+    struct exec_shards *page = mmap(NULL, sizeof(struct exec_shards),
+                                    PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED) return -1;
+
+    int count = -1;
+    if (page->magic == SHARDS_MAGIC && page->count >= 1 && page->count <= SHARDS_MAX &&
+        process_alive(page->supervisor_pid)) {
+        count = page->count;
+    }
+    munmap(page, sizeof(struct exec_shards));
+    return count;
+}
+
+/*
+ * Submete uma mensagem ("cmd1;cmd2;...").
+ * Retorna 0 em caso de sucesso ou -1 com errno (EMSGSIZE se a mensagem
+ * não cabe numa slot / num write() atómico do FIFO).
+ *
+ * Se o anel estiver cheio, espera (sched_yield) até o servidor libertar
+ * uma slot - a ordem das mensagens de um cliente mantém-se. De
+ * RING_FULL_CHECK em RING_FULL_CHECK voltas vê se o servidor ainda está
+ * vivo: se não estiver, falha com EPIPE, como o write() no FIFO.
+ */
+#define RING_FULL_CHECK 1024
+
+int exec_client_submit(struct exec_client *client, const char *message, size_t len) {
+    if (len >= RING_SLOT_SIZE) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    if (client->ring == NULL) {
+        /*
+         * FIFO: uma mensagem por linha, num único write(). Mensagem + '\n'
+         * cabe em PIPE_BUF (4096), por isso nunca se mistura com outras.
+         */
+        char frame[RING_SLOT_SIZE];
+        memcpy(frame, message, len);
+        frame[len] = '\n';
+        return write(client->fifo_fd, frame, len + 1) == -1 ? -1 : 0;
+    }
+
+    struct exec_ring *ring = client->ring;
+    struct ring_slot *slot;
+    uint64_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned long yields = 0;
+
+    // Reserva uma posição
+    for (;;) {
+        slot = &ring->slots[pos & (RING_SLOTS - 1)];
+        uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        int64_t diff = (int64_t)(seq - pos);
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->tail, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // Anel cheio: o servidor ainda não consumiu esta slot
+            if (++yields % RING_FULL_CHECK == 0 && !process_alive(ring->server_pid)) {
+                errno = EPIPE;
+                return -1;
+            }
+            sched_yield();
+            pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        } else {
+            // Outro produtor ficou com esta posição
+            pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        }
+    }
+
+    // Copia e publica o frame
+    memcpy(slot->data, message, len);
+    slot->len = (uint32_t)len;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+
+    // Só faz syscall se o servidor estiver a dormir
+    atomic_thread_fence(memory_order_seq_cst);
+    uint32_t was_idle = 1;
+    if (atomic_load_explicit(&ring->idle, memory_order_relaxed) == 1 &&
+        atomic_compare_exchange_strong(&ring->idle, &was_idle, 0)) {
+        exec_futex_wake(&ring->idle);
+    }
+    return 0;
+}
+
+void exec_client_close(struct exec_client *client) {
+    if (client->ring != NULL) {
+        munmap(client->ring, sizeof(struct exec_ring));
+        client->ring = NULL;
+    }
+    if (client->fifo_fd != -1) {
+        close(client->fifo_fd);
+        client->fifo_fd = -1;
+    }
+}
@@ -0,0 +1,162 @@
+/*
+ * ============================================================================
+ * EXEC_RING - Submissão de comandos ao servidor (biblioteca) - Projeto SO 25/26
+ * ============================================================================
+ *
+ * OBJETIVO:
+ * Permitir que outros programas submetam comandos ao servidor sem lançar
+ * o ./client (um processo por submissão) e sem um write() no FIFO por
+ * mensagem.
+ *
+ * COMO FUNCIONA:
+ * O servidor, quando arranca com --ring, cria um anel em memória partilhada
+ * (shm_open("/exec_ring")). Vários produtores (clientes) escrevem frames no
+ * anel e um único consumidor (o servidor) lê-os:
+ *
+ *   Produtor:  reserva uma posição (CAS em tail) -> copia a mensagem
+ *              -> publica a slot (seq = pos + 1)
+ *   Servidor:  lê a slot em head se seq == head + 1 -> liberta a slot
+ *              (seq = head + RING_SLOTS) -> head++
+ *
+ * Sem contenção não há syscalls nenhumas. O futex só é usado quando o
+ * servidor está parado à espera (idle == 1): aí o produtor acorda-o.
+ *
+ * Se o anel não existir (servidor sem --ring ou shm indisponível) a
+ * biblioteca usa o FIFO /tmp/exec_fifo, com uma mensagem por linha.
+ *
+ * SHARDS (servidor com --shards K):
+ * Há K servidores, cada um com o seu FIFO (/tmp/exec_fifo.0 ... .K-1), e
+ * uma página de estado em memória partilhada (/dev/shm/exec_shards) onde
+ * cada shard publica quantos jobs tem por acabar. exec_client_open()
+ * escolhe o shard com menos jobs; em caso de empate, o pid do cliente
+ * decide, para clientes diferentes não irem todos para o mesmo.
+ *
+ * EXEMPLO:
+ *   struct exec_client c;
+ *   if (exec_client_open(&c) == 0) {
+ *       exec_client_submit(&c, "ls -la;pwd", 10);
+ *       exec_client_close(&c);
+ *   }
+ *
+ * Compilar com: gcc prog.c build/libexecring.a -pthread
+ * ============================================================================
+ */
+
+#ifndef EXEC_RING_H
+#define EXEC_RING_H
+
+#include <stddef.h>     // size_t
+#include <stdint.h>     // uint32_t, uint64_t
+#include <stdatomic.h>  // _Atomic, atomic_load(), atomic_store()
+#include <sys/types.h>  // pid_t
+
+/*
+ * Caminho do FIFO - tem de ser igual no cliente e no servidor
+ */
+#define FIFO_PATH "/tmp/exec_fifo"
+
+/*
+ * Socket Unix onde o servidor (--watch) publica os resultados em JSON
+ */
+#define WATCH_PATH "/tmp/exec_watch.sock"
+
+/*
+ * Nome do objeto de memória partilhada (/dev/shm/exec_ring)
+ */
+#define RING_NAME "/exec_ring"
+
+/*
+ * Número de slots (potência de 2) e tamanho máximo de cada frame.
+ * Um frame = uma mensagem completa ("cmd1;cmd2;..."), tal como no FIFO.
+ */
+#define RING_SLOTS 1024
+#define RING_SLOT_SIZE 4096
+
+/*
+ * Máximo de comandos numa mensagem (o servidor ignora os restantes)
+ */
+#define MAX_COMMANDS 32
+
+/*
+ * Página de estado dos shards (/dev/shm/exec_shards), criada pelo
+ * supervisor (--shards K)
+ */
+#define SHARDS_NAME "/exec_shards"
+#define SHARDS_MAX 64
+#define SHARDS_MAGIC 0x53485244u  // "SHRD"
+
+#define SHARD_PICK_LEAST 0  // Menos jobs por acabar (empate: pid do cliente)
+#define SHARD_PICK_HASH 1   // Só o pid do cliente
+
+/*
+ * Cada shard escreve só na sua entrada, numa linha de cache própria
+ */
+struct shard_status {
+    _Alignas(64) _Atomic pid_t pid;     // 0 = parado (a ser relançado)
+    _Atomic uint32_t depth;             // Jobs a correr ou na fila
+};
+
+struct exec_shards {
+    uint32_t magic;
+    pid_t supervisor_pid;               // Para detetar páginas abandonadas
+    uint32_t count;                     // K
+    struct shard_status shards[SHARDS_MAX];
+};
+
+#define RING_MAGIC 0x52494e47u  // "RING"
+
+struct ring_slot {
+    _Atomic uint64_t seq;       // Estado da slot (ver protocolo acima)
+    uint32_t len;               // Bytes em data[]
+    char data[RING_SLOT_SIZE];
+};
+
+/*
+ * head e tail ficam em linhas de cache diferentes para que o consumidor
+ * e os produtores não se atrapalhem.
+ */
+struct exec_ring {
+    uint32_t magic;
+    pid_t server_pid;                       // Para detetar anéis abandonados
+    _Alignas(64) _Atomic uint32_t idle;     // Futex: 1 = servidor a dormir
+    _Alignas(64) _Atomic uint64_t tail;     // Próxima posição dos produtores
+    _Alignas(64) uint64_t head;             // Próxima posição do consumidor
+    struct ring_slot slots[RING_SLOTS];
+};
+
+/*
+ * Ligação de um cliente: usa o anel se existir, senão o FIFO
+ */
+struct exec_client {
+    struct exec_ring *ring;
+    int fifo_fd;
+};
+
+/* ---------------------------- Lado do cliente ---------------------------- */
+
+int exec_client_open(struct exec_client *client);
+int exec_client_open_shard(struct exec_client *client, int shard);
+int exec_shard_pick(int mode);
+int exec_shard_count(void);
+void exec_shard_fifo(int shard, char *path, size_t size);
+int exec_client_submit(struct exec_client *client, const char *message, size_t len);
+void exec_client_close(struct exec_client *client);
+
+/* ---------------------------- Lado do servidor --------------------------- */
+
+struct exec_ring *ring_create(void);
+struct exec_ring *ring_reopen(void);
+void ring_destroy(struct exec_ring *ring);
+int ring_pop(struct exec_ring *ring, char *buffer, size_t size);
+void ring_wait(struct exec_ring *ring);
+
+struct exec_shards *shards_create(int count);
+struct exec_shards *shards_attach(void);
+void shards_destroy(struct exec_shards *page);
+
+/* ------------------------------ Futex ------------------------------------ */
+
+void exec_futex_wait(_Atomic uint32_t *addr, uint32_t expected);
+void exec_futex_wake(_Atomic uint32_t *addr);
+
+#endif
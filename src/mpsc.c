@@ -0,0 +1,110 @@
+/*
+ * ============================================================================
+ * MPSC - Implementação - Projeto SO 25/26
+ * ============================================================================
+ *
+ * Ver mpsc.h. A fila só é usada entre threads do mesmo processo, por isso
+ * o futex é privado (FUTEX_WAIT_PRIVATE), ao contrário do do anel.
+ *
+ * ============================================================================
+ */
+
+#include <stddef.h>      // NULL
+#include <unistd.h>      // syscall()
+#include <sys/syscall.h> // SYS_futex
+#include <linux/futex.h> // FUTEX_WAIT_PRIVATE, FUTEX_WAKE_PRIVATE
+
+#include "mpsc.h"
+
+void mpsc_init(struct mpsc_queue *q) {
+    atomic_store_explicit(&q->stub.next, NULL, memory_order_relaxed);
+    atomic_store_explicit(&q->head, &q->stub, memory_order_relaxed);
+    q->tail = &q->stub;
+    atomic_store(&q->waiting, 0);
+}
+
+static void mpsc_link(struct mpsc_queue *q, struct mpsc_node *node) {
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    struct mpsc_node *prev = atomic_exchange_explicit(&q->head, node,
+                                                      memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+/*
+ * Acrescenta um nó à fila. Pode ser chamada por qualquer thread.
+ * Retorna 1 se o consumidor estava parado e tem de ser acordado.
+ */
+int mpsc_push(struct mpsc_queue *q, struct mpsc_node *node) {
+    mpsc_link(q, node);
+
+    // Emparelha com o fence de mpsc_arm()/mpsc_wait()
+    atomic_thread_fence(memory_order_seq_cst);
+    uint32_t was_waiting = 1;
+    return atomic_load_explicit(&q->waiting, memory_order_relaxed) == 1 &&
+           atomic_compare_exchange_strong(&q->waiting, &was_waiting, 0);
+}
+
+/*
+ * Retira o nó mais antigo, ou NULL se a fila estiver (por agora) vazia.
+ * Só o consumidor a pode chamar.
+ */
+struct mpsc_node *mpsc_pop(struct mpsc_queue *q) {
+    struct mpsc_node *tail = q->tail;
+    struct mpsc_node *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    // Salta o stub
+    if (tail == &q->stub) {
+        if (next == NULL) return NULL;
+        q->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    }
+
+    if (next != NULL) {
+        q->tail = next;
+        return tail;
+    }
+
+    // tail é o último nó; se head já mudou, um push está a meio
+    if (tail != atomic_load_explicit(&q->head, memory_order_acquire)) return NULL;
+
+    // Volta a pôr o stub no fim para podermos entregar tail
+    mpsc_link(q, &q->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next != NULL) {
+        q->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+/*
+ * Marca o consumidor como parado. Quem espera num poll()/eventfd chama
+ * isto ANTES de esvaziar a fila: um push feito depois acorda-o de certeza.
+ */
+void mpsc_arm(struct mpsc_queue *q) {
+    atomic_store(&q->waiting, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+/*
+ * Retira um nó, dormindo no futex enquanto a fila estiver vazia
+ */
+struct mpsc_node *mpsc_wait(struct mpsc_queue *q) {
+    for (;;) {
+        struct mpsc_node *node = mpsc_pop(q);
+        if (node != NULL) return node;
+
+        mpsc_arm(q);
+        node = mpsc_pop(q);
+        if (node != NULL) {
+            atomic_store(&q->waiting, 0);
+            return node;
+        }
+        syscall(SYS_futex, &q->waiting, FUTEX_WAIT_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+void mpsc_wake(struct mpsc_queue *q) {
+    syscall(SYS_futex, &q->waiting, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
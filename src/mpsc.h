@@ -0,0 +1,60 @@
+/*
+ * ============================================================================
+ * MPSC - Fila lock-free (vários produtores, um consumidor) - Projeto SO 25/26
+ * ============================================================================
+ *
+ * OBJETIVO:
+ * Passar jobs entre as threads do servidor (--loop threads) sem mutex:
+ *
+ *   receção  --(fila de cada dispatcher)-->  dispatcher (fork/exec)
+ *   dispatcher --(fila do reaper)-->         reaper (pidfd + log)
+ *   reaper/dispatcher --(fila de fim)-->     receção (contas da batch)
+ *
+ * COMO FUNCIONA (fila intrusiva de Vyukov):
+ * Cada elemento tem um struct mpsc_node, que deve ser o PRIMEIRO campo da
+ * estrutura (assim o ponteiro do nó é o ponteiro do elemento).
+ *
+ *   push: uma troca atómica em head e uma escrita em prev->next.
+ *         Nunca espera, nem por outros produtores nem pelo consumidor.
+ *   pop:  só o consumidor mexe em tail. Pode retornar NULL por instantes
+ *         se um produtor estiver entre as duas operações do push - esse
+ *         produtor ainda vai ver o consumidor à espera e acordá-lo.
+ *
+ * ESPERA:
+ * waiting = 1 quer dizer "o consumidor vai dormir". mpsc_push() retorna 1
+ * se foi ele que limpou a flag: nesse caso o produtor tem de acordar o
+ * consumidor (mpsc_wake() para quem espera em mpsc_wait(), ou um eventfd
+ * para quem espera num poll()). Sem consumidor parado não há syscalls.
+ *
+ * ============================================================================
+ */
+
+#ifndef MPSC_H
+#define MPSC_H
+
+#include <stdint.h>     // uint32_t
+#include <stdatomic.h>  // _Atomic
+
+struct mpsc_node {
+    struct mpsc_node *_Atomic next;
+};
+
+/*
+ * head (produtores) e tail (consumidor) em linhas de cache diferentes
+ */
+struct mpsc_queue {
+    _Alignas(64) struct mpsc_node *_Atomic head;
+    _Alignas(64) struct mpsc_node *tail;
+    struct mpsc_node stub;                  // Nó vazio: a fila nunca fica sem nós
+    _Alignas(64) _Atomic uint32_t waiting;  // Futex: 1 = consumidor parado
+};
+
+void mpsc_init(struct mpsc_queue *q);
+int mpsc_push(struct mpsc_queue *q, struct mpsc_node *node);
+struct mpsc_node *mpsc_pop(struct mpsc_queue *q);
+
+void mpsc_arm(struct mpsc_queue *q);
+struct mpsc_node *mpsc_wait(struct mpsc_queue *q);
+void mpsc_wake(struct mpsc_queue *q);
+
+#endif
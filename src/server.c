@@ -27,7 +27,10 @@
  * ============================================================================
  */
 
+#define _GNU_SOURCE     // sched_setaffinity(), CPU_SET() (extensões GNU)
+
 #include <stdlib.h>     // exit(), EXIT_FAILURE
+#include <stdio.h>      // rename() (só isto - o I/O continua sem stdio)
 #include <unistd.h>     // read(), write(), close(), fork(), _exit()
 #include <fcntl.h>      // open(), O_RDONLY, O_WRONLY, O_CREAT, O_APPEND
 #include <sys/stat.h>   // mkdir(), mkfifo()
@@ -36,17 +39,38 @@
 #include <sys/wait.h>   // waitpid(), WIFEXITED(), WEXITSTATUS()
 #include <signal.h>     // signal(), SIGINT, SIGTERM
 #include <time.h>       // time(), localtime()
+#include <sched.h>      // sched_setaffinity(), cpu_set_t
+#include <dirent.h>     // opendir(), readdir() (nós NUMA em /sys)
+#include <sys/syscall.h> // syscall(SYS_set_mempolicy)
+#include <poll.h>       // poll(), POLLIN
+#include <pthread.h>    // pthread_create() (vigia do anel, --loop threads)
+#include <sys/eventfd.h> // eventfd()
+#include <sys/mman.h>   // shm_unlink()
+#include <sys/time.h>   // futimens() (builtin touch)
+#include <sys/socket.h> // socket(), accept4(), send() (--executor / --nodes)
+#include <sys/epoll.h>  // epoll_create1() (sockets dos nós)
+#include <netinet/in.h> // struct sockaddr_in
+#include <netinet/tcp.h> // TCP_NODELAY
+#include <arpa/inet.h>  // inet_ntop(), htons()
+#include <netdb.h>      // getaddrinfo()
+#include <sys/un.h>     // struct sockaddr_un (--watch)
+#include <sys/sendfile.h> // sendfile() (--fetch)
 
-/* 
- * Caminho do FIFO - tem de ser igual no cliente e no servidor
- */
-#define FIFO_PATH "/tmp/exec_fifo"
+#include "exec_ring.h"  // FIFO_PATH, anel em memória partilhada (--ring)
+#include "uring.h"      // io_uring sem liburing (--loop uring)
+#include "mpsc.h"       // filas lock-free entre threads (--loop threads)
+#include "trace.h"      // trace do ciclo de vida dos jobs (SIGUSR1)
 
 /* 
  * Caminho do ficheiro de log onde guardamos os resultados
  */
 #define LOG_FILE "logs/server.log"
 
+/*
+ * Ficheiro de métricas (contadores "chave=valor", ver secção MÉTRICAS)
+ */
+#define METRICS_FILE "logs/metrics"
+
 /* 
  * Tamanho máximo do buffer de leitura
  */
@@ -60,7 +84,34 @@
  * volatile sig_atomic_t garante que as operações são atómicas e seguras.
  */
 volatile sig_atomic_t should_exit = 0;  // Flag para terminar o loop principal
+volatile sig_atomic_t upgrade_requested = 0;  // SIGHUP/SIGUSR2: re-exec sem parar
+volatile sig_atomic_t trace_dump_requested = 0;  // SIGUSR1: trace desligado, gravar
 int server_fd = -1;                      // File descriptor do FIFO (para fechar)
+char fifo_path[64] = FIFO_PATH;          // --shard N: FIFO_PATH.N
+int use_ring = 0;                        // --ring: anel em memória partilhada
+const char *log_path = LOG_FILE;         // --log: ficheiro de log
+const char *metrics_path = METRICS_FILE; // --metrics: ficheiro de métricas
+int log_fd = -1;                         // Log aberto (O_APPEND) durante toda a execução
+int log_millis = 0;                      // --shard: milissegundos no timestamp do log
+int watch_fd = -1;                       // --watch: socket dos subscritores (para apagar)
+
+/*
+ * Ciclo de eventos (--loop):
+ * - classic: poll() + SIGCHLD + waitpid() + write()
+ * - uring: io_uring (uma syscall io_uring_enter() por iteração)
+ * - threads: receção, dispatchers (fork/exec) e reaper (waitid + log)
+ *   em threads separadas, ligadas por filas lock-free
+ */
+#define BACKEND_CLASSIC 0
+#define BACKEND_URING   1
+#define BACKEND_THREADS 2
+int loop_backend = BACKEND_CLASSIC;
+
+void log_write(const char *record, int len);  // Definida na secção do io_uring
+void metrics_changed(void);                   // Definida na secção das métricas
+void do_upgrade(void);                        // Definida na secção da atualização
+void trace_save(void);                        // Definida na secção do trace
+void shard_count(int delta);                  // Definida na secção dos shards
 
 /*
  * ============================================================================
@@ -92,7 +143,17 @@ void signal_handler(int sig) {
     }
     
     // Remove o ficheiro FIFO
-    unlink(FIFO_PATH);
+    unlink(fifo_path);
+
+    // Remove o anel (os clientes voltam a usar o FIFO)
+    if (use_ring) {
+        shm_unlink(RING_NAME);
+    }
+
+    // Remove o socket dos subscritores (--watch)
+    if (watch_fd != -1) {
+        unlink(WATCH_PATH);
+    }
     
     // Termina o processo (usa _exit em vez de exit em signal handlers)
     _exit(0);
@@ -100,46 +161,70 @@ void signal_handler(int sig) {
 
 /*
  * ============================================================================
- * SIGCHLD HANDLER - Prevenção de Processos Zombie
+ * SIGCHLD HANDLER - Acordar o ciclo principal ("self-pipe")
  * ============================================================================
  * 
  * OBJETIVO:
  * Quando um processo filho termina, o kernel envia SIGCHLD ao pai.
  * Se o pai não fizer waitpid(), o filho fica "zombie" (consome recursos).
  * 
- * Este handler garante que TODOS os filhos terminados são "recolhidos"
- * (reaped) automaticamente, mesmo em situações de erro.
- * 
  * IMPORTANTE:
- * - Usamos WNOHANG para não bloquear (não-blocking wait)
- * - Loop while() porque podem terminar vários filhos ao mesmo tempo
- * - Este é um "safety net" - o main() já faz waitpid() normalmente
+ * O handler NÃO faz waitpid(). Se o fizesse, "roubava" o estado de saída
+ * ao ciclo principal e o comando ficava sem registo no log. Em vez disso
+ * escreve um byte num pipe que o poll() do ciclo principal vigia; é o
+ * ciclo principal que faz waitpid(-1, ..., WNOHANG) e regista cada filho.
  * 
- * POR QUE É ÚTIL:
- * Se houver um crash ou erro no main() entre fork() e waitpid(),
- * este handler garante que não ficam zombies no sistema.
+ * - O pipe é não-bloqueante: se estiver cheio, já há um aviso pendente
+ * - Guardamos errno porque write() pode alterá-lo no código interrompido
  * 
- * NOTA ACADÉMICA:
- * No fluxo normal do nosso servidor, o main() já faz waitpid(-1, ...)
- * corretamente. Este handler é uma camada extra de segurança que
- * demonstra conhecimento avançado de gestão de processos.
+ * Só é instalado no ciclo clássico; com --loop uring os filhos são
+ * recolhidos por pedidos waitid no próprio io_uring.
  */
+int sigchld_pipe[2] = {-1, -1};
+
 void sigchld_handler(int sig) {
     (void)sig;  // Suprime warning
     
-    /*
-     * WNOHANG: retorna imediatamente se não houver filhos terminados
-     * Loop while: processa todos os filhos que terminaram
-     * 
-     * waitpid(-1, NULL, WNOHANG) retorna:
-     *   > 0: PID do filho que terminou
-     *   0: nenhum filho terminou ainda
-     *   -1: erro (ex: não há mais filhos)
-     */
-    while (waitpid(-1, NULL, WNOHANG) > 0) {
-        // Filho "recolhido" com sucesso
-        // Não fazemos nada aqui porque o main() já trata o logging
+    int saved_errno = errno;
+    write(sigchld_pipe[1], "c", 1);
+    errno = saved_errno;
+}
+
+/*
+ * ============================================================================
+ * UPGRADE HANDLER - Atualização sem parar o serviço (SIGHUP, SIGUSR2)
+ * ============================================================================
+ * Tal como o SIGCHLD, só marca o pedido e acorda o ciclo de eventos por um
+ * pipe; a atualização (do_upgrade) é feita pelo ciclo principal, entre
+ * iterações, quando o estado está consistente.
+ */
+int upgrade_pipe[2] = {-1, -1};
+
+void upgrade_handler(int sig) {
+    (void)sig;
+
+    int saved_errno = errno;
+    upgrade_requested = 1;
+    write(upgrade_pipe[1], "u", 1);
+    errno = saved_errno;
+}
+
+/*
+ * ============================================================================
+ * TRACE HANDLER - Liga/desliga o trace dos jobs (SIGUSR1)
+ * ============================================================================
+ * Ligar é só mudar a flag. Ao desligar, o ficheiro é gravado pelo ciclo
+ * de eventos (trace_save), acordado pelo mesmo pipe da atualização.
+ */
+void trace_handler(int sig) {
+    (void)sig;
+
+    int saved_errno = errno;
+    if (atomic_exchange(&trace_enabled, !atomic_load(&trace_enabled))) {
+        trace_dump_requested = 1;
+        write(upgrade_pipe[1], "t", 1);
     }
+    errno = saved_errno;
 }
 
 /*
@@ -200,6 +285,35 @@ int print_int(int fd, int num) {
     return i;
 }
 
+/*
+ * Descrição básica de um errno (NULL se não a conhecermos)
+ */
+const char *errno_text(int err) {
+    switch (err) {
+        case EACCES: return "Permission denied";
+        case EEXIST: return "File exists";
+        case ENOENT: return "No such file or directory";
+        case ENOMEM: return "Out of memory";
+        case EISDIR: return "Is a directory";
+        case ENOTDIR: return "Not a directory";
+        case EROFS: return "Read-only file system";
+        default: return NULL;
+    }
+}
+
+/*
+ * Escreve a descrição de um errno no stderr
+ */
+void print_errno_text(int err) {
+    const char *text = errno_text(err);
+    if (text != NULL) {
+        print_err(text);
+    } else {
+        print_err("Error code ");
+        print_int(STDERR_FILENO, err);
+    }
+}
+
 /*
  * Substitui perror() - escreve mensagem de erro com descrição do errno
  */
@@ -207,26 +321,7 @@ void print_error(const char *msg) {
     print_err("[SERVER] ");
     print_err(msg);
     print_err(": ");
-    
-    // Escreve descrição básica do erro
-    switch (errno) {
-        case EACCES:
-            print_err("Permission denied");
-            break;
-        case EEXIST:
-            print_err("File exists");
-            break;
-        case ENOENT:
-            print_err("No such file or directory");
-            break;
-        case ENOMEM:
-            print_err("Out of memory");
-            break;
-        default:
-            print_err("Error code ");
-            print_int(STDERR_FILENO, errno);
-            break;
-    }
+    print_errno_text(errno);
     print_err("\n");
 }
 
@@ -253,12 +348,18 @@ void print_error(const char *msg) {
  *   "2026-01-09 11:30:45"
  *    0123456789012345678
  *    (19 caracteres + \0)
+ *
+ * Os shards (--shards) acrescentam os milissegundos ("11:30:45.123"),
+ * para os logs de todos poderem ser juntados pela ordem certa.
  */
 int format_timestamp(char *buffer, int size) {
-    if (size < 20) return 0;  // Buffer muito pequeno
+    if (size < 24) return 0;  // Buffer muito pequeno
     
-    time_t now = time(NULL);
-    struct tm *t = localtime(&now);
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    time_t now = ts.tv_sec;
+    struct tm tm_now;
+    struct tm *t = localtime_r(&now, &tm_now);  // _r: o reaper também escreve no log
     
     // Formata manualmente: YYYY-MM-DD HH:MM:SS
     int pos = 0;
@@ -295,6 +396,14 @@ int format_timestamp(char *buffer, int size) {
     // Segundo (2 dígitos)
     buffer[pos++] = '0' + (t->tm_sec / 10);
     buffer[pos++] = '0' + (t->tm_sec % 10);
+
+    if (log_millis) {
+        int ms = ts.tv_nsec / 1000000;
+        buffer[pos++] = '.';
+        buffer[pos++] = '0' + ms / 100;
+        buffer[pos++] = '0' + ms / 10 % 10;
+        buffer[pos++] = '0' + ms % 10;
+    }
     
     buffer[pos] = '\0';
     return pos;
@@ -313,50 +422,548 @@ int format_timestamp(char *buffer, int size) {
  *   - line: texto a escrever no log
  * 
  * COMO FUNCIONA:
- * 1. Abre o ficheiro de log (cria se não existir)
- * 2. Formata o timestamp atual
- * 3. Escreve "[TIMESTAMP] linha" no final do ficheiro (append)
- * 4. Fecha o ficheiro
+ * 1. Formata o timestamp atual
+ * 2. Junta "[TIMESTAMP] linha" num único buffer
+ * 3. Entrega o registo a log_write(), que o escreve com um write()
+ *    (ciclo clássico) ou o junta às escritas do io_uring (--loop uring)
  * 
  * FORMATO:
  *   [2026-01-09 11:30:45] ls -la; exit status: 0
  * 
- * NOTA: Abrimos e fechamos o ficheiro em cada escrita para garantir
- * que os dados são guardados mesmo se o servidor crashar.
+ * NOTA: O ficheiro fica aberto com O_APPEND durante toda a execução.
+ * Cada registo é um único write(), que vai logo para o kernel, por isso
+ * os dados não se perdem mesmo se o servidor crashar.
  */
 void append_log(const char *line) {
-    /*
-     * Abre o ficheiro de log:
-     * - O_WRONLY: apenas para escrita
-     * - O_CREAT: cria o ficheiro se não existir
-     * - O_APPEND: escreve sempre no final do ficheiro
-     * - 0644: permissões (rw-r--r--)
-     */
-    int log_fd = open(LOG_FILE, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    char record[1024];
+    int pos = 0;
+
+    record[pos++] = '[';
+    pos += format_timestamp(record + pos, sizeof(record) - pos);
+    record[pos++] = ']';
+    record[pos++] = ' ';
+
+    int len = strlen(line);
+    if (len > (int)sizeof(record) - pos) {
+        len = sizeof(record) - pos;
+    }
+    memcpy(record + pos, line, len);
+    log_write(record, pos + len);
+}
+
+/*
+ * Abre o ficheiro de log:
+ * - O_WRONLY: apenas para escrita
+ * - O_CREAT: cria o ficheiro se não existir
+ * - O_APPEND: escreve sempre no final do ficheiro
+ * - O_CLOEXEC: os filhos não herdam o descritor
+ * - 0644: permissões (rw-r--r--)
+ */
+void log_open(void) {
+    log_fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
     if (log_fd == -1) {
         print_error("Erro ao abrir o ficheiro de log");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+/*
+ * ============================================================================
+ * FUNÇÕES AUXILIARES PARA CONSTRUIR STRINGS NUM BUFFER
+ * ============================================================================
+ * Substituem snprintf(): acrescentam texto/inteiros a partir da posição pos
+ * sem nunca passar do tamanho do buffer. Retornam a nova posição.
+ */
+int append_str(char *buf, int pos, int size, const char *str) {
+    while (*str != '\0' && pos < size - 1) {
+        buf[pos++] = *str++;
+    }
+    buf[pos] = '\0';
+    return pos;
+}
+
+int append_int(char *buf, int pos, int size, long num) {
+    char digits[24];
+    int n = 0;
+    int is_negative = num < 0;
+
+    if (is_negative) num = -num;
+    do {
+        digits[n++] = '0' + (num % 10);
+        num /= 10;
+    } while (num > 0);
+    if (is_negative) digits[n++] = '-';
+
+    while (n > 0 && pos < size - 1) {
+        buf[pos++] = digits[--n];
+    }
+    buf[pos] = '\0';
+    return pos;
+}
+
+/*
+ * Lê um ficheiro pequeno (ex: em /sys) para um buffer terminado em '\0'.
+ * Retorna o número de bytes lidos ou -1 em caso de erro.
+ */
+int read_small_file(const char *path, char *buf, int size) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return -1;
+    ssize_t n = read(fd, buf, size - 1);
+    close(fd);
+    if (n < 0) return -1;
+    buf[n] = '\0';
+    return (int)n;
+}
+
+
+/*
+ * ============================================================================
+ * COLOCAÇÃO DOS FILHOS (AFINIDADE DE CPU / NUMA)
+ * ============================================================================
+ *
+ * OBJETIVO:
+ * Por omissão os filhos herdam a máscara de CPUs do servidor e o kernel
+ * coloca-os onde quiser. Em máquinas grandes, jobs pesados em CPU saltam
+ * entre cores e perdem a cache. Com --placement escolhemos uma política:
+ *
+ *   none  - comportamento original (sem afinidade)
+ *   rr    - round-robin: cada job fica preso ao próximo core da lista
+ *   least - o core com menos jobs em execução (contamos jobs por core)
+ *   numa  - o nó NUMA com menos jobs por core; o filho fica preso aos
+ *           cores desse nó e a memória é pedida preferencialmente a ele
+ *
+ * Os primeiros --reserve-cores cores permitidos ficam para o servidor
+ * (o próprio servidor é preso a eles) e os jobs nunca os usam.
+ * --job-cores limita quantos cores, no total, os jobs podem usar.
+ *
+ * A decisão é um inteiro ("place"):
+ *   - rr/least: índice em job_cpus[]
+ *   - numa: número do nó
+ *   - -1: sem colocação
+ */
+#define MAX_CPUS 1024
+#define MAX_NODES 64
+
+#define PLACEMENT_NONE  0
+#define PLACEMENT_RR    1
+#define PLACEMENT_LEAST 2
+#define PLACEMENT_NUMA  3
+
+/* set_mempolicy(2) - definido aqui para não depender do libnuma */
+#define MPOL_PREFERRED 1
+
+int placement_policy = PLACEMENT_NONE;
+int reserve_cores = 1;          // Cores reservados para o ciclo do servidor
+int max_job_cores = 0;          // 0 = sem limite
+
+int job_cpus[MAX_CPUS];         // Cores que os jobs podem usar
+int num_job_cpus = 0;
+int cpu_inflight[MAX_CPUS];     // Jobs em execução por core (índice em job_cpus)
+int cpu_node[MAX_CPUS];         // Nó NUMA de cada core (índice = nº do core)
+int node_inflight[MAX_NODES];   // Jobs em execução por nó
+int node_cpus[MAX_NODES];       // Quantos job_cpus pertencem a cada nó
+int rr_next = 0;                // Próximo core no round-robin
+
+/*
+ * Converte uma lista de CPUs do kernel ("0-3,8,10-11") e marca cada CPU
+ * em cpu_node[] como pertencendo ao nó indicado.
+ */
+void parse_node_cpulist(const char *list, int node) {
+    const char *p = list;
+    while (*p >= '0' && *p <= '9') {
+        int first = 0;
+        while (*p >= '0' && *p <= '9') first = first * 10 + (*p++ - '0');
+        int last = first;
+        if (*p == '-') {
+            p++;
+            last = 0;
+            while (*p >= '0' && *p <= '9') last = last * 10 + (*p++ - '0');
+        }
+        for (int c = first; c <= last && c < MAX_CPUS; c++) {
+            cpu_node[c] = node;
+        }
+        if (*p == ',') p++;
+    }
+}
+
+/*
+ * Descobre a topologia NUMA em /sys/devices/system/node/nodeN/cpulist.
+ * Se não existir (kernel sem NUMA), fica tudo no nó 0.
+ */
+void load_numa_topology(void) {
+    DIR *dir = opendir("/sys/devices/system/node");
+    if (dir == NULL) return;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "node", 4) != 0) continue;
+        if (entry->d_name[4] < '0' || entry->d_name[4] > '9') continue;
+
+        int node = atoi(entry->d_name + 4);
+        if (node >= MAX_NODES) continue;
+
+        char path[128];
+        char list[1024];
+        int pos = append_str(path, 0, sizeof(path), "/sys/devices/system/node/");
+        pos = append_str(path, pos, sizeof(path), entry->d_name);
+        append_str(path, pos, sizeof(path), "/cpulist");
+        if (read_small_file(path, list, sizeof(list)) > 0) {
+            parse_node_cpulist(list, node);
+        }
+    }
+    closedir(dir);
+}
+
+/*
+ * Calcula os cores disponíveis para jobs e prende o servidor aos
+ * cores reservados. Chamada uma vez no arranque.
+ */
+void placement_init(void) {
+    if (placement_policy == PLACEMENT_NONE) return;
+
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+        print_error("sched_getaffinity");
+        placement_policy = PLACEMENT_NONE;
         return;
     }
 
-    // Formata e escreve o timestamp
-    char timestamp[32];
-    write(log_fd, "[", 1);
-    int ts_len = format_timestamp(timestamp, sizeof(timestamp));
-    if (ts_len > 0) {
-        write(log_fd, timestamp, ts_len);
+    int allowed_cpus[MAX_CPUS];
+    int num_allowed = 0;
+    for (int c = 0; c < CPU_SETSIZE && c < MAX_CPUS; c++) {
+        if (CPU_ISSET(c, &allowed)) allowed_cpus[num_allowed++] = c;
+    }
+
+    // Garante que fica pelo menos um core para os jobs
+    int reserved = reserve_cores;
+    if (reserved > num_allowed - 1) reserved = num_allowed - 1;
+    if (reserved < 0) reserved = 0;
+
+    if (reserved > 0) {
+        cpu_set_t server_set;
+        CPU_ZERO(&server_set);
+        for (int i = 0; i < reserved; i++) CPU_SET(allowed_cpus[i], &server_set);
+        if (sched_setaffinity(0, sizeof(server_set), &server_set) == -1) {
+            print_error("sched_setaffinity (servidor)");
+        }
+    }
+
+    for (int i = reserved; i < num_allowed; i++) {
+        if (max_job_cores > 0 && num_job_cpus >= max_job_cores) break;
+        job_cpus[num_job_cpus++] = allowed_cpus[i];
+    }
+
+    load_numa_topology();
+    for (int i = 0; i < num_job_cpus; i++) {
+        node_cpus[cpu_node[job_cpus[i]]]++;
+    }
+
+    print_str("[Servidor] Colocação de jobs em ");
+    print_int(STDOUT_FILENO, num_job_cpus);
+    print_str(" core(s), ");
+    print_int(STDOUT_FILENO, reserved);
+    print_str(" reservado(s) para o servidor.\n");
+}
+
+/*
+ * Escolhe onde colocar o próximo job e conta-o como "em execução".
+ * Retorna o place (ver acima) ou -1 se não há colocação.
+ */
+int placement_choose(void) {
+    if (placement_policy == PLACEMENT_NONE || num_job_cpus == 0) return -1;
+
+    if (placement_policy == PLACEMENT_RR) {
+        int idx = rr_next;
+        rr_next = (rr_next + 1) % num_job_cpus;
+        cpu_inflight[idx]++;
+        return idx;
+    }
+
+    if (placement_policy == PLACEMENT_LEAST) {
+        /*
+         * Começamos a procura em rr_next para que, em caso de empate,
+         * os jobs não caiam sempre no primeiro core.
+         */
+        int best = rr_next;
+        for (int k = 1; k < num_job_cpus; k++) {
+            int idx = (rr_next + k) % num_job_cpus;
+            if (cpu_inflight[idx] < cpu_inflight[best]) best = idx;
+        }
+        rr_next = (best + 1) % num_job_cpus;
+        cpu_inflight[best]++;
+        return best;
+    }
+
+    /*
+     * NUMA: compara jobs por core em cada nó sem usar divisões
+     * (a/b < c/d  <=>  a*d < c*b)
+     */
+    int best = -1;
+    for (int node = 0; node < MAX_NODES; node++) {
+        if (node_cpus[node] == 0) continue;
+        if (best == -1 ||
+            node_inflight[node] * node_cpus[best] < node_inflight[best] * node_cpus[node]) {
+            best = node;
+        }
+    }
+    if (best != -1) node_inflight[best]++;
+    return best;
+}
+
+/*
+ * Liberta o lugar ocupado por um job que terminou
+ */
+void placement_release(int place) {
+    if (place < 0) return;
+    if (placement_policy == PLACEMENT_NUMA) {
+        node_inflight[place]--;
+    } else {
+        cpu_inflight[place]--;
+    }
+}
+
+/*
+ * Volta a contar um lugar herdado de uma atualização (re-exec).
+ * Retorna o place ou -1 se já não for válido (ex: menos cores).
+ */
+int placement_claim(int place) {
+    if (place < 0 || placement_policy == PLACEMENT_NONE) return -1;
+    if (placement_policy == PLACEMENT_NUMA) {
+        if (place >= MAX_NODES || node_cpus[place] == 0) return -1;
+        node_inflight[place]++;
+    } else {
+        if (place >= num_job_cpus) return -1;
+        cpu_inflight[place]++;
+    }
+    return place;
+}
+
+/*
+ * Aplica a colocação no processo FILHO, antes do execvp().
+ * Só usa syscalls (sched_setaffinity, set_mempolicy), por isso é seguro
+ * depois do fork(). Se falhar, o comando corre na mesma sem afinidade.
+ */
+void placement_apply(int place) {
+    if (place < 0) return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+
+    if (placement_policy == PLACEMENT_NUMA) {
+        for (int i = 0; i < num_job_cpus; i++) {
+            if (cpu_node[job_cpus[i]] == place) CPU_SET(job_cpus[i], &set);
+        }
+        /*
+         * MPOL_PREFERRED em vez de MPOL_BIND: a memória vem do nó local,
+         * mas se este esgotar o kernel usa outro nó em vez de matar o job.
+         */
+        unsigned long nodemask = 1UL << place;
+        if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, &nodemask, MAX_NODES + 1) == -1) {
+            print_error("set_mempolicy");
+        }
+    } else {
+        CPU_SET(job_cpus[place], &set);
+    }
+
+    if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+        print_error("sched_setaffinity");
+    }
+}
+
+/*
+ * Acrescenta a decisão de colocação ao registo do log
+ * (ex: "; cpu: 3" ou "; node: 1"). Sem colocação não escreve nada,
+ * para o formato original do log não mudar.
+ */
+int append_placement(char *buf, int pos, int size, int place) {
+    if (place < 0) return pos;
+    if (placement_policy == PLACEMENT_NUMA) {
+        pos = append_str(buf, pos, size, "; node: ");
+        return append_int(buf, pos, size, place);
+    }
+    pos = append_str(buf, pos, size, "; cpu: ");
+    return append_int(buf, pos, size, job_cpus[place]);
+}
+
+
+/*
+ * ============================================================================
+ * TEMPORIZADORES
+ * ============================================================================
+ *
+ * OBJETIVO:
+ * Agendar trabalho para daqui a X ms sem bloquear o ciclo de eventos
+ * (ex: o builtin "sleep", a escrita periódica das métricas).
+ *
+ * Os temporizadores ficam numa lista ordenada pelo prazo. Os ciclos de
+ * eventos usam timer_timeout_ms() como timeout do poll() (ou do
+ * io_uring_enter()) e chamam run_timers() em cada iteração.
+ *
+ * Só a thread principal usa os temporizadores.
+ */
+struct timer {
+    long deadline;            // Em ms (CLOCK_MONOTONIC)
+    void (*fn)(void *arg);
+    void *arg;
+    struct timer *next;
+};
+
+struct timer *timers = NULL;
+
+long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/*
+ * Agenda fn(arg) para daqui a delay_ms. Retorna 0 ou -1 (sem memória).
+ */
+int timer_add(long delay_ms, void (*fn)(void *arg), void *arg) {
+    struct timer *t = malloc(sizeof(struct timer));
+    if (t == NULL) return -1;
+    t->deadline = now_ms() + delay_ms;
+    t->fn = fn;
+    t->arg = arg;
+
+    // Insere por ordem de prazo (a ordem de chegada desempata)
+    struct timer **p = &timers;
+    while (*p != NULL && (*p)->deadline <= t->deadline) p = &(*p)->next;
+    t->next = *p;
+    *p = t;
+    return 0;
+}
+
+/*
+ * Timeout para o poll(): ms até ao próximo prazo, -1 se não há nenhum
+ */
+int timer_timeout_ms(void) {
+    if (timers == NULL) return -1;
+    long wait = timers->deadline - now_ms();
+    return wait > 0 ? (int)wait : 0;
+}
+
+/*
+ * Corre os temporizadores cujo prazo já passou
+ */
+void run_timers(void) {
+    long now = now_ms();
+    while (timers != NULL && timers->deadline <= now) {
+        struct timer *t = timers;
+        timers = t->next;
+        t->fn(t->arg);
+        free(t);
+    }
+}
+
+
+/*
+ * ============================================================================
+ * FUNÇÃO: format_log_entry
+ * ============================================================================
+ *
+ * OBJETIVO:
+ * Constrói a linha do log para um comando que terminou.
+ *
+ * FORMATO:
+ *   "ls -la; exit status: 0\n"
+ *   "sleep 100; terminou de forma anormal\n"
+ *   "make; exit status: 0; cpu: 3\n"        (com --placement)
+ *
+ * RETORNO:
+ *   - Número de caracteres escritos em buf
+ */
+int format_log_entry(char *buf, int size, const char *cmd, int status, int place) {
+    int pos = append_str(buf, 0, size - 1, cmd);
+
+    if (WIFEXITED(status)) {
+        // O filho terminou normalmente
+        pos = append_str(buf, pos, size - 1, "; exit status: ");
+        pos = append_int(buf, pos, size - 1, WEXITSTATUS(status));
+    } else {
+        // O filho terminou de forma anormal (ex: signal)
+        pos = append_str(buf, pos, size - 1, "; terminou de forma anormal");
     }
-    write(log_fd, "] ", 2);
+    pos = append_placement(buf, pos, size - 1, place);
+
+    // size - 1 acima garante que há sempre espaço para o '\n'
+    buf[pos++] = '\n';
+    buf[pos] = '\0';
+    return pos;
+}
+
+
+/*
+ * ========================================================================
+ * PARSING NÍVEL 2: Separar o comando em programa + argumentos
+ * ========================================================================
+ * 
+ * Exemplo: "ls -la /tmp" é separado em:
+ *   args[0] = "ls"      (o programa)
+ *   args[1] = "-la"     (primeiro argumento)
+ *   args[2] = "/tmp"    (segundo argumento)
+ *   args[3] = NULL      (marca o fim do array)
+ * 
+ * LIMITAÇÃO CONHECIDA:
+ * Este parser simples separa apenas por espaços e NÃO respeita aspas.
+ * Comandos como: echo 'hello world'
+ * Serão parseados como: ["echo", "'hello", "world'"]
+ * 
+ * Esta é uma simplificação aceitável dado o âmbito académico do projeto.
+ * Para suportar argumentos com espaços, seria necessário um parser mais
+ * complexo que implemente uma máquina de estados para processar aspas.
+ *
+ * cmd é modificado; args tem de ter lugar para 32 ponteiros.
+ * Retorna o número de argumentos.
+ */
+int split_command(char *cmd, char **args) {
+    int i = 0;
     
-    // Escreve a linha no ficheiro
-    ssize_t written = write(log_fd, line, strlen(line));
-    if (written == -1) {
-        print_error("Erro ao escrever no ficheiro de log");
+    char *saveptr;  // strtok_r(): os dispatchers podem correr isto em paralelo
+    char *token = strtok_r(cmd, " ", &saveptr);  // Primeiro token
+    while (token != NULL && i < 31) {
+        args[i++] = token;
+        token = strtok_r(NULL, " ", &saveptr);  // Próximo token
     }
+    args[i] = NULL;  // execvp() precisa que o array termine com NULL
+    return i;
+}
+
+/*
+ * argv de cmd com os argumentos separados por um só espaço (chave de
+ * %coalesce e %cache). Retorna o comprimento.
+ */
+int normalize_argv(const char *cmd, char *key, int size) {
+    char copy[MAX_BUFFER];
+    char *args[32];
+
+    append_str(copy, 0, sizeof(copy), cmd);
+    int argc = split_command(copy, args);
+    int pos = append_str(key, 0, size, "");
+    for (int i = 0; i < argc; i++) {
+        if (i > 0) pos = append_str(key, pos, size, " ");
+        pos = append_str(key, pos, size, args[i]);
+    }
+    return pos;
+}
 
-    // Fecha o ficheiro
-    close(log_fd);
+unsigned long str_hash(const char *str) {
+    unsigned long hash = 14695981039346656037UL;  // FNV-1a (64 bits)
+    while (*str != '\0') {
+        hash ^= (unsigned char)*str++;
+        hash *= 1099511628211UL;
+    }
+    return hash;
 }
 
+pid_t execute_argv(const char *cmd, char **args, const char *path, int place, int out_fd);
 
 /*
  * ============================================================================
@@ -368,6 +975,8 @@ void append_log(const char *line) {
  * 
  * PARÂMETROS:
  *   - cmd: o comando a executar (ex: "ls -la")
+ *   - place: colocação escolhida por placement_choose() (-1 = nenhuma)
+ *   - out_fd: para onde vai o stdout do filho (-1 = o do servidor)
  * 
  * RETORNO:
  *   - PID do processo filho criado (se sucesso)
@@ -388,7 +997,7 @@ void append_log(const char *line) {
  *     args[2] = "/tmp"
  *     args[3] = NULL
  */
-pid_t execute_command(char *cmd) {
+pid_t execute_command(char *cmd, int place, int out_fd) {
     
     // Remove espaços no início do comando
     while (*cmd == ' ') cmd++;
@@ -426,41 +1035,21 @@ pid_t execute_command(char *cmd) {
     strncpy(cmd_copy, cmd, sizeof(cmd_copy) - 1);
     cmd_copy[sizeof(cmd_copy) - 1] = '\0';
 
-    /*
-     * ========================================================================
-     * PARSING NÍVEL 2: Separar o comando em programa + argumentos
-     * ========================================================================
-     * 
-     * Exemplo: "ls -la /tmp" é separado em:
-     *   args[0] = "ls"      (o programa)
-     *   args[1] = "-la"     (primeiro argumento)
-     *   args[2] = "/tmp"    (segundo argumento)
-     *   args[3] = NULL      (marca o fim do array)
-     * 
-     * LIMITAÇÃO CONHECIDA:
-     * Este parser simples separa apenas por espaços e NÃO respeita aspas.
-     * Comandos como: echo 'hello world'
-     * Serão parseados como: ["echo", "'hello", "world'"]
-     * 
-     * Esta é uma simplificação aceitável dado o âmbito académico do projeto.
-     * Para suportar argumentos com espaços, seria necessário um parser mais
-     * complexo que implemente uma máquina de estados para processar aspas.
-     */
     char *args[32];  // Array para guardar os argumentos
-    int i = 0;
-    
-    char *token = strtok(cmd_copy, " ");  // Primeiro token
-    while (token != NULL && i < 31) {
-        args[i++] = token;
-        token = strtok(NULL, " ");  // Próximo token
-    }
-    args[i] = NULL;  // execvp() precisa que o array termine com NULL
 
     // Se não há argumentos, o comando é inválido
-    if (args[0] == NULL) {
+    if (split_command(cmd_copy, args) == 0) {
         return -1;
     }
 
+    return execute_argv(cmd, args, NULL, place, out_fd);
+}
+
+/*
+ * Lança args (já separados). path: executável já resolvido (%invoke), ou
+ * NULL para o execvp() o procurar no PATH. cmd só serve para a mensagem.
+ */
+pid_t execute_argv(const char *cmd, char **args, const char *path, int place, int out_fd) {
     /*
      * ========================================================================
      * Criar processo filho com fork()
@@ -497,7 +1086,10 @@ pid_t execute_command(char *cmd) {
         print_str("[Servidor:Filho] A executar '");
         print_str(cmd);
         print_str("'...\n");
-        execvp(args[0], args);
+        placement_apply(place);  // Afinidade de CPU / NUMA (se ativa)
+        if (out_fd != -1) dup2(out_fd, STDOUT_FILENO);  // %cache: captura
+        if (path != NULL) execv(path, args);
+        else execvp(args[0], args);
         
         // Só chega aqui se execvp() falhar
         print_error("Erro no execvp");
@@ -517,15 +1109,5920 @@ pid_t execute_command(char *cmd) {
 
 /*
  * ============================================================================
- * FUNÇÃO PRINCIPAL (main)
+ * COMANDOS INTERNOS (BUILTINS)
  * ============================================================================
- * 
- * Esta é a função que controla todo o servidor.
- * Cria o FIFO, fica à espera de mensagens, e processa-as.
+ *
+ * OBJETIVO:
+ * Para comandos baratos (echo, true, pwd, date, sleep N, touch...), o
+ * fork() + execvp() custa muito mais do que o trabalho em si. Com
+ * --builtins, estes comandos correm dentro do servidor, sem criar
+ * processos. O resultado vai para o log exatamente como o de um filho.
+ *
+ * Só é usado o builtin quando o comportamento é IGUAL ao do programa:
+ * com opções ou argumentos que não suportamos, a função retorna
+ * BUILTIN_INCOMPATIBLE e o comando segue o caminho normal (fork/exec).
+ *
+ * Cada builtin recebe os argumentos e o fd para onde escrever o output
+ * (o stdout do servidor, o mesmo que os filhos herdam) e retorna o
+ * código de saída. O "sleep" não bloqueia: pede um atraso em *delay_ms
+ * e o job só termina quando o temporizador disparar.
+ *
+ * CONTADORES (no ficheiro de métricas):
+ *   runs      - vezes que correu sem fork()
+ *   fallbacks - vezes que teve de usar fork()/execvp()
+ */
+#define BUILTIN_INCOMPATIBLE -1
+
+/*
+ * Opções de ajuda comuns a todos os programas do coreutils
+ */
+int is_help_or_version(char **args) {
+    return args[1] != NULL && args[2] == NULL &&
+           (strcmp(args[1], "--help") == 0 || strcmp(args[1], "--version") == 0);
+}
+
+int builtin_true(char **args, int out_fd, long *delay_ms) {
+    (void)out_fd;
+    (void)delay_ms;
+    return is_help_or_version(args) ? BUILTIN_INCOMPATIBLE : 0;
+}
+
+int builtin_false(char **args, int out_fd, long *delay_ms) {
+    (void)out_fd;
+    (void)delay_ms;
+    return is_help_or_version(args) ? BUILTIN_INCOMPATIBLE : 1;
+}
+
+/*
+ * echo sem opções: os argumentos separados por espaços e um '\n'
+ * (o /bin/echo só interpreta '\' com -e, por isso não há escapes)
+ */
+int builtin_echo(char **args, int out_fd, long *delay_ms) {
+    (void)delay_ms;
+    if (args[1] != NULL && args[1][0] == '-') return BUILTIN_INCOMPATIBLE;
+
+    char line[MAX_BUFFER];
+    int pos = 0;
+    for (int i = 1; args[i] != NULL; i++) {
+        if (i > 1) pos = append_str(line, pos, sizeof(line), " ");
+        pos = append_str(line, pos, sizeof(line), args[i]);
+    }
+    line[pos++] = '\n';
+    write(out_fd, line, pos);
+    return 0;
+}
+
+int builtin_pwd(char **args, int out_fd, long *delay_ms) {
+    (void)delay_ms;
+    if (args[1] != NULL) return BUILTIN_INCOMPATIBLE;
+
+    char cwd[MAX_BUFFER];
+    if (getcwd(cwd, sizeof(cwd) - 1) == NULL) return BUILTIN_INCOMPATIBLE;
+    int len = strlen(cwd);
+    cwd[len++] = '\n';
+    write(out_fd, cwd, len);
+    return 0;
+}
+
+/*
+ * date sem argumentos, no formato do locale "C":
+ *   "Sun Oct 18 07:38:27 UTC 2026"  (%a %b %e %H:%M:%S %Z %Y)
+ * Com outro locale o /bin/date traduz os nomes, por isso não o imitamos.
+ */
+int builtin_date(char **args, int out_fd, long *delay_ms) {
+    (void)delay_ms;
+    if (args[1] != NULL) return BUILTIN_INCOMPATIBLE;
+
+    const char *locale = getenv("LC_ALL");
+    if (locale == NULL || locale[0] == '\0') locale = getenv("LC_TIME");
+    if (locale == NULL || locale[0] == '\0') locale = getenv("LANG");
+    if (locale != NULL && locale[0] != '\0' &&
+        strcmp(locale, "C") != 0 && strcmp(locale, "POSIX") != 0) {
+        return BUILTIN_INCOMPATIBLE;
+    }
+
+    static const char *days[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+    static const char *months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                    "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+    time_t now = time(NULL);
+    struct tm t;
+    localtime_r(&now, &t);
+
+    char line[64];
+    int pos = append_str(line, 0, sizeof(line), days[t.tm_wday]);
+    pos = append_str(line, pos, sizeof(line), " ");
+    pos = append_str(line, pos, sizeof(line), months[t.tm_mon]);
+    pos = append_str(line, pos, sizeof(line), t.tm_mday < 10 ? "  " : " ");
+    pos = append_int(line, pos, sizeof(line), t.tm_mday);
+    pos = append_str(line, pos, sizeof(line), t.tm_hour < 10 ? " 0" : " ");
+    pos = append_int(line, pos, sizeof(line), t.tm_hour);
+    pos = append_str(line, pos, sizeof(line), t.tm_min < 10 ? ":0" : ":");
+    pos = append_int(line, pos, sizeof(line), t.tm_min);
+    pos = append_str(line, pos, sizeof(line), t.tm_sec < 10 ? ":0" : ":");
+    pos = append_int(line, pos, sizeof(line), t.tm_sec);
+    pos = append_str(line, pos, sizeof(line), " ");
+    pos = append_str(line, pos, sizeof(line), t.tm_zone);
+    pos = append_str(line, pos, sizeof(line), " ");
+    pos = append_int(line, pos, sizeof(line), 1900 + t.tm_year);
+    line[pos++] = '\n';
+    write(out_fd, line, pos);
+    return 0;
+}
+
+/*
+ * sleep N ou sleep N.M (segundos, sem sufixos s/m/h/d)
+ */
+int builtin_sleep(char **args, int out_fd, long *delay_ms) {
+    (void)out_fd;
+    if (args[1] == NULL || args[2] != NULL) return BUILTIN_INCOMPATIBLE;
+
+    const char *p = args[1];
+    long ms = 0;
+    if (*p < '0' || *p > '9') return BUILTIN_INCOMPATIBLE;
+    while (*p >= '0' && *p <= '9') {
+        ms = ms * 10 + (*p++ - '0');
+        if (ms > 86400L * 365) return BUILTIN_INCOMPATIBLE;  // Não vale a pena
+    }
+    ms *= 1000;
+
+    if (*p == '.') {
+        p++;
+        long scale = 100;     // Décimas, centésimas, milésimas
+        int rest = 0;         // Há dígitos não nulos para lá dos ms
+        while (*p >= '0' && *p <= '9') {
+            if (scale > 0) ms += (*p - '0') * scale;
+            else if (*p != '0') rest = 1;
+            scale /= 10;
+            p++;
+        }
+        ms += rest;           // Arredonda para cima, como o /bin/sleep
+    }
+    if (*p != '\0') return BUILTIN_INCOMPATIBLE;
+
+    *delay_ms = ms;
+    return 0;
+}
+
+/*
+ * touch FICHEIRO... sem opções: cria o ficheiro ou atualiza as datas
+ */
+int builtin_touch(char **args, int out_fd, long *delay_ms) {
+    (void)out_fd;
+    (void)delay_ms;
+    if (args[1] == NULL) return BUILTIN_INCOMPATIBLE;
+    for (int i = 1; args[i] != NULL; i++) {
+        if (args[i][0] == '-') return BUILTIN_INCOMPATIBLE;
+    }
+
+    int status = 0;
+    for (int i = 1; args[i] != NULL; i++) {
+        int fd = open(args[i], O_WRONLY | O_CREAT | O_NOCTTY | O_NONBLOCK | O_CLOEXEC, 0666);
+        int ok;
+        if (fd != -1) {
+            ok = futimens(fd, NULL) == 0;
+            close(fd);
+        } else {
+            // Ex: diretórios, ou ficheiros sem permissão de escrita
+            ok = utimensat(AT_FDCWD, args[i], NULL, 0) == 0;
+        }
+
+        if (!ok) {
+            print_err("touch: cannot touch '");
+            print_err(args[i]);
+            print_err("': ");
+            print_errno_text(errno);
+            print_err("\n");
+            status = 1;
+        }
+    }
+    return status;
+}
+
+struct builtin {
+    const char *name;
+    int (*run)(char **args, int out_fd, long *delay_ms);
+    int enabled;          // Está na lista de --builtins
+    long runs;            // Executado sem fork()
+    long fallbacks;       // Argumentos incompatíveis -> fork()/execvp()
+};
+
+struct builtin builtins[] = {
+    { "echo",  builtin_echo,  0, 0, 0 },
+    { "true",  builtin_true,  0, 0, 0 },
+    { "false", builtin_false, 0, 0, 0 },
+    { "pwd",   builtin_pwd,   0, 0, 0 },
+    { "date",  builtin_date,  0, 0, 0 },
+    { "sleep", builtin_sleep, 0, 0, 0 },
+    { "touch", builtin_touch, 0, 0, 0 },
+};
+#define NUM_BUILTINS (int)(sizeof(builtins) / sizeof(builtins[0]))
+
+int builtins_active = 0;    // Há pelo menos um builtin ativo
+
+/*
+ * Ativa os builtins de uma lista ("all" ou "echo,true,sleep").
+ * Retorna -1 se a lista tiver um nome desconhecido.
+ */
+int builtins_enable(const char *list) {
+    char copy[256];
+    strncpy(copy, list, sizeof(copy) - 1);
+    copy[sizeof(copy) - 1] = '\0';
+
+    char *saveptr;
+    for (char *name = strtok_r(copy, ",", &saveptr); name != NULL;
+         name = strtok_r(NULL, ",", &saveptr)) {
+        int found = 0;
+        for (int i = 0; i < NUM_BUILTINS; i++) {
+            if (strcmp(name, "all") == 0 || strcmp(name, builtins[i].name) == 0) {
+                builtins[i].enabled = 1;
+                found = 1;
+            }
+        }
+        if (!found) return -1;
+        builtins_active = 1;
+    }
+    return 0;
+}
+
+struct builtin *builtin_lookup(const char *name) {
+    for (int i = 0; i < NUM_BUILTINS; i++) {
+        if (builtins[i].enabled && strcmp(name, builtins[i].name) == 0) {
+            return &builtins[i];
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * ============================================================================
+ * MÉTRICAS
+ * ============================================================================
+ *
+ * Contadores do servidor no ficheiro --metrics (omissão: logs/metrics),
+ * um por linha no formato "chave=valor":
+ *
+ *   builtin.echo.runs=120
+ *   builtin.echo.fallbacks=3
+ *   coalesce.leaders=10          (só depois do primeiro %coalesce)
+ *   coalesce.attached=95
+ *   cache.hits=40                (só depois do primeiro %cache)
+ *   cache.misses=5
+ *   cache.stores=5
+ *   cache.evictions=0
+ *   cache.bytes=81920
+ *   templates.count=3            (só depois do primeiro %prepare)
+ *   templates.invokes=1200
+ *   watch.subscribers=2          (com --watch)
+ *   watch.published=5000
+ *   watch.dropped=12
+ *   concurrency.limit=6          (com --adaptive ou --max-inflight)
+ *   concurrency.pressure=4       (% , com --adaptive)
+ *   concurrency.source=psi
+ *
+ * Quando um contador muda, o ficheiro é reescrito no máximo uma vez por
+ * METRICS_INTERVAL_MS (temporizador), para não custar um write() por
+ * comando. Escrevemos num ficheiro temporário e fazemos rename(): quem
+ * o lê nunca vê um ficheiro a meio.
+ */
+#define METRICS_INTERVAL_MS 1000
+
+int metrics_scheduled = 0;
+int concurrency_metrics(char *buf, int pos, int size);  // Secção CONCORRÊNCIA
+long coalesce_leaders = 0;    // Jobs lançados com %coalesce (secção JOBS)
+long coalesce_attached = 0;   // Pedidos que se juntaram a um líder
+long cache_hits = 0;          // %cache (secção JOBS)
+int num_templates = 0;        // %prepare (secção JOBS)
+long template_invokes = 0;
+extern int watch_enabled;     // --watch (definida na secção do --watch)
+int num_subscribers = 0;
+long watch_published = 0;
+long watch_dropped = 0;
+long retain_budget = 0;       // --retain em bytes, 0 = desligado (secção JOBS)
+long retain_count = 0;
+long retain_mem = 0;          // Bytes em uso (registos + pedaços)
+long retain_disk = 0;
+long retain_evictions = 0;
+long retain_fetches = 0;
+long cache_misses = 0;
+long cache_stores = 0;
+long cache_evictions = 0;
+long cache_bytes = -1;        // Bytes ocupados no ficheiro (-1 = ainda fechado)
+
+void metrics_flush(void *arg) {
+    (void)arg;
+    metrics_scheduled = 0;
+
+    char buf[MAX_BUFFER];
+    int pos = 0;
+    for (int i = 0; i < NUM_BUILTINS; i++) {
+        if (!builtins[i].enabled) continue;
+        pos = append_str(buf, pos, sizeof(buf), "builtin.");
+        pos = append_str(buf, pos, sizeof(buf), builtins[i].name);
+        pos = append_str(buf, pos, sizeof(buf), ".runs=");
+        pos = append_int(buf, pos, sizeof(buf), builtins[i].runs);
+        pos = append_str(buf, pos, sizeof(buf), "\nbuiltin.");
+        pos = append_str(buf, pos, sizeof(buf), builtins[i].name);
+        pos = append_str(buf, pos, sizeof(buf), ".fallbacks=");
+        pos = append_int(buf, pos, sizeof(buf), builtins[i].fallbacks);
+        pos = append_str(buf, pos, sizeof(buf), "\n");
+    }
+    if (coalesce_leaders > 0) {
+        pos = append_str(buf, pos, sizeof(buf), "coalesce.leaders=");
+        pos = append_int(buf, pos, sizeof(buf), coalesce_leaders);
+        pos = append_str(buf, pos, sizeof(buf), "\ncoalesce.attached=");
+        pos = append_int(buf, pos, sizeof(buf), coalesce_attached);
+        pos = append_str(buf, pos, sizeof(buf), "\n");
+    }
+    if (num_templates > 0) {
+        pos = append_str(buf, pos, sizeof(buf), "templates.count=");
+        pos = append_int(buf, pos, sizeof(buf), num_templates);
+        pos = append_str(buf, pos, sizeof(buf), "\ntemplates.invokes=");
+        pos = append_int(buf, pos, sizeof(buf), template_invokes);
+        pos = append_str(buf, pos, sizeof(buf), "\n");
+    }
+    if (watch_enabled) {
+        pos = append_str(buf, pos, sizeof(buf), "watch.subscribers=");
+        pos = append_int(buf, pos, sizeof(buf), num_subscribers);
+        pos = append_str(buf, pos, sizeof(buf), "\nwatch.published=");
+        pos = append_int(buf, pos, sizeof(buf), watch_published);
+        pos = append_str(buf, pos, sizeof(buf), "\nwatch.dropped=");
+        pos = append_int(buf, pos, sizeof(buf), watch_dropped);
+        pos = append_str(buf, pos, sizeof(buf), "\n");
+    }
+    if (retain_budget > 0) {
+        pos = append_str(buf, pos, sizeof(buf), "retain.entries=");
+        pos = append_int(buf, pos, sizeof(buf), retain_count);
+        pos = append_str(buf, pos, sizeof(buf), "\nretain.bytes=");
+        pos = append_int(buf, pos, sizeof(buf), retain_mem);
+        pos = append_str(buf, pos, sizeof(buf), "\nretain.disk_bytes=");
+        pos = append_int(buf, pos, sizeof(buf), retain_disk);
+        pos = append_str(buf, pos, sizeof(buf), "\nretain.evictions=");
+        pos = append_int(buf, pos, sizeof(buf), retain_evictions);
+        pos = append_str(buf, pos, sizeof(buf), "\nretain.fetches=");
+        pos = append_int(buf, pos, sizeof(buf), retain_fetches);
+        pos = append_str(buf, pos, sizeof(buf), "\n");
+    }
+    pos = concurrency_metrics(buf, pos, sizeof(buf));
+    if (cache_bytes >= 0) {
+        pos = append_str(buf, pos, sizeof(buf), "cache.hits=");
+        pos = append_int(buf, pos, sizeof(buf), cache_hits);
+        pos = append_str(buf, pos, sizeof(buf), "\ncache.misses=");
+        pos = append_int(buf, pos, sizeof(buf), cache_misses);
+        pos = append_str(buf, pos, sizeof(buf), "\ncache.stores=");
+        pos = append_int(buf, pos, sizeof(buf), cache_stores);
+        pos = append_str(buf, pos, sizeof(buf), "\ncache.evictions=");
+        pos = append_int(buf, pos, sizeof(buf), cache_evictions);
+        pos = append_str(buf, pos, sizeof(buf), "\ncache.bytes=");
+        pos = append_int(buf, pos, sizeof(buf), cache_bytes);
+        pos = append_str(buf, pos, sizeof(buf), "\n");
+    }
+
+    char tmp_path[512];
+    int tpos = append_str(tmp_path, 0, sizeof(tmp_path), metrics_path);
+    append_str(tmp_path, tpos, sizeof(tmp_path), ".tmp");
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        print_error("Erro ao escrever as métricas");
+        return;
+    }
+    write(fd, buf, pos);
+    close(fd);
+    rename(tmp_path, metrics_path);
+}
+
+/*
+ * Um contador mudou: agenda a reescrita do ficheiro (se ainda não estiver)
+ */
+void metrics_changed(void) {
+    if (metrics_scheduled) return;
+    if (timer_add(METRICS_INTERVAL_MS, metrics_flush, NULL) == 0) {
+        metrics_scheduled = 1;
+    }
+}
+
+
+/*
+ * ============================================================================
+ * JOBS (COMANDOS EM EXECUÇÃO)
+ * ============================================================================
+ *
+ * OBJETIVO:
+ * Cada comando lançado é um "job". O servidor já não fica parado à espera
+ * que todos os comandos de uma mensagem terminem antes de ler a próxima:
+ * os jobs ficam na tabela running[] e são registados no log à medida que
+ * terminam, venham de que mensagem vierem.
+ *
+ * - Uma "batch" agrupa os jobs de uma mensagem (para sabermos quando
+ *   "Todos os N comando(s) terminaram")
+ * - Se a tabela estiver cheia, os jobs ficam numa fila e são lançados
+ *   quando outros terminarem
+ */
+#define MAX_JOBS 1024     // MAX_COMMANDS (comandos por mensagem) está em exec_ring.h
+
+struct batch {
+    int total;        // Comandos aceites
+    int remaining;    // Ainda por terminar
+    int origin;       // --executor: ligação que pediu o job (0 = FIFO/anel)
+    long origin_id;   // Id do job nessa ligação
+    int status;       // Último estado registado (resposta ao dispatcher)
+    struct dag *dag;  // %after: dependências entre os comandos (NULL = nenhuma)
+};
+
+struct job {
+    struct mpsc_node node; // Tem de ser o primeiro campo (filas do --loop threads)
+    pid_t pid;
+    char *cmd;            // Cópia do comando (para o log)
+    char *client;         // %client=NOME: quem pediu (NULL = desconhecido)
+    long submit_ms;       // Quando chegou (duração em --watch)
+    long queue_ms;        // Tempo na fila até ser lançado (--watch)
+    long spawn_us;        // Quanto demorou o fork() + exec (0 = sem fork)
+    char **argv;          // %invoke: argv já montado (NULL = separar cmd)
+    const char *exec_path;// %invoke: executável resolvido (no bloco de argv)
+    int place;            // Colocação (core/nó), -1 = nenhuma
+    int slot;             // Índice em running[]
+    struct batch *batch;
+    siginfo_t info;       // Preenchido pelo waitid do io_uring
+    int watch_pending;    // io_uring: waitid por pedir (sem SQE livre)
+    int status;           // Estado de saída (formato do waitpid)
+    long id;              // Número do job (--watch, ./client --fetch)
+    struct job *next;     // Fila de espera (ou lista de seguidores)
+    int pidfd;            // Reaper (--loop threads): vigia o filho no epoll
+    struct job *hnext;    // Reaper: jobs sem pidfd (vistos com WNOHANG)
+    char *key;            // %coalesce: argv normalizado (NULL = líder nenhum)
+    unsigned long hash;
+    struct job *cnext;    // Tabela de coalescência
+    struct job *followers;// Pedidos iguais à espera deste job
+    int shared;           // Seguidor: o estado veio de outro job
+    pid_t shared_pid;     // PID do job que correu por ele (0 = builtin)
+    int remote;           // --nodes: nó onde corre (índice + 1, 0 = local)
+    long remote_id;       // Id do job nesse nó
+    char *cache_inputs;   // %cache=a,b: ficheiros de entrada declarados
+    char *cache_key;      // %cache: chave (NULL = sem cache)
+    unsigned long cache_hash;
+    int cached;           // Respondido pela cache, sem correr
+    int out_fd;           // memfd com o stdout do filho (-1 = sem captura)
+    char *output;         // Output capturado (cache, --retain)
+    int out_len;
+    int spilled;          // --retain: output grande, escrito em RETAIN_DIR
+    int want_cache;       // %cache / %coalesce: aplicados só em job_start()
+    int want_coalesce;
+    char *step;           // %step=NOME: nome no grafo da mensagem
+    char *after;          // %after=a,b: pré-requisitos (NULL = nenhum)
+};
+
+struct job *running[MAX_JOBS];
+int num_running = 0;
+struct job *queue_head = NULL;
+struct job *queue_tail = NULL;
+int launch_paused = 0;    // Durante uma atualização os jobs novos ficam na fila
+int job_limit = MAX_JOBS; // Jobs a correr em simultâneo (--max-inflight, --adaptive)
+long next_job_id = 0;     // Último id dado (continua depois de uma atualização)
+
+#define CLIENT_PREFIX "%client="  // Quem pediu (./client --name), para --watch
+#define STEP_PREFIX "%step="      // Nome do comando no grafo (%after)
+#define AFTER_PREFIX "%after="    // Só corre depois destes comandos
+
+void uring_watch_child(struct job *job);  // Definida na secção do io_uring
+void threads_dispatch(struct job *job);   // Definida na secção das threads
+int node_better(void);                    // Definidas na secção dos nós (TCP)
+const char *node_name(int node);
+void remote_submit(struct job *job, int node);
+void executor_reply(struct batch *batch);
+int job_run_builtin(struct job *job);     // Definida depois de job_finished()
+void watch_publish(struct job *job, int status);  // Secção --watch
+void retain_share(struct job *job, struct job *from);  // Secção --retain
+void dag_job_done(struct job *job, int launched);      // Secção %after
+void dag_report(struct batch *batch);
+
+/*
+ * Um job da batch terminou (ou não chegou a arrancar)
+ */
+void batch_finish(struct batch *batch) {
+    if (batch->dag != NULL) {
+        dag_report(batch);  // Caminho crítico no log
+    }
+    if (batch->total > 0) {
+        print_str("[Servidor] Todos os ");
+        print_int(STDOUT_FILENO, batch->total);
+        print_str(" comando(s) terminaram.\n");
+    }
+    if (batch->origin != 0) {
+        executor_reply(batch);  // --executor: devolve o estado ao dispatcher
+    }
+    free(batch);
+}
+
+void batch_job_done(struct job *job, int launched) {
+    struct batch *batch = job->batch;
+
+    // %after: liberta os dependentes (ou ignora-os) antes de descontar
+    // este job, para a batch não acabar a meio
+    if (batch->dag != NULL) {
+        dag_job_done(job, launched);
+    }
+
+    batch->remaining--;
+    if (!launched) batch->total--;
+
+    if (batch->remaining > 0) return;
+    batch_finish(batch);
+}
+
+void job_free(struct job *job) {
+    TRACE(TRACE_JOB, 'e', job->id, NULL);
+    shard_count(-1);
+    if (job->out_fd != -1) close(job->out_fd);
+    free(job->cmd);
+    free(job->client);
+    free(job->argv);
+    free(job->key);
+    free(job->cache_inputs);
+    free(job->cache_key);
+    free(job->output);
+    free(job->step);
+    free(job->after);
+    free(job);
+}
+
+/*
+ * ============================================================================
+ * COALESCÊNCIA DE COMANDOS IGUAIS (%coalesce)
+ * ============================================================================
+ *
+ * OBJETIVO:
+ * O mesmo comando idempotente (ex: aquecer uma cache) chega muitas vezes
+ * em poucos segundos. Com o prefixo "%coalesce " (./client --coalesce),
+ * um comando com o mesmo argv que outro job ainda por terminar não é
+ * lançado: junta-se a esse job (o "líder") e é registado com o estado de
+ * saída dele quando terminar.
+ *
+ *   %coalesce ./warm-cache.sh    <- lançado (líder)
+ *   %coalesce ./warm-cache.sh    <- seguidor: não faz fork()
+ *
+ * A chave é o argv normalizado (argumentos separados por um só espaço,
+ * tal como o split_command() os vê) e o seu hash FNV-1a. Um líder está na
+ * tabela desde que é aceite (na fila ou a correr) até terminar. Comandos
+ * sem o prefixo nunca entram na tabela.
+ *
+ * O output é só o do líder; no log, o seguidor aparece com
+ * "; partilhado (pid N)", o PID do líder.
+ */
+#define COALESCE_PREFIX "%coalesce "
+#define COALESCE_BUCKETS 256  // Potência de 2
+
+struct job *coalesce_table[COALESCE_BUCKETS];
+
+void job_log(struct job *job, int status);  // Definida mais abaixo
+
+/*
+ * Junta o job ao líder com o mesmo argv, ou regista-o como líder.
+ * Retorna 1 se se juntou (não é para lançar), 0 se é o líder.
+ */
+int coalesce_attach(struct job *job) {
+    char key[MAX_BUFFER];
+    normalize_argv(job->cmd, key, sizeof(key));
+    unsigned long hash = str_hash(key);
+
+    struct job **bucket = &coalesce_table[hash & (COALESCE_BUCKETS - 1)];
+    for (struct job *leader = *bucket; leader != NULL; leader = leader->cnext) {
+        if (leader->hash == hash && strcmp(leader->key, key) == 0) {
+            job->next = leader->followers;
+            leader->followers = job;
+            return 1;
+        }
+    }
+
+    job->key = strdup(key);
+    if (job->key == NULL) return 0;  // Sem memória: corre sem coalescência
+    job->hash = hash;
+    job->cnext = *bucket;
+    *bucket = job;
+    return 0;
+}
+
+/*
+ * O líder terminou (launched = 1) ou não chegou a arrancar: sai da
+ * tabela e os seguidores terminam com ele
+ */
+void coalesce_release(struct job *leader, int launched) {
+    if (leader->key == NULL) return;
+
+    struct job **p = &coalesce_table[leader->hash & (COALESCE_BUCKETS - 1)];
+    while (*p != leader) p = &(*p)->cnext;
+    *p = leader->cnext;
+
+    struct job *follower = leader->followers;
+    leader->followers = NULL;
+    while (follower != NULL) {
+        struct job *next = follower->next;
+        if (launched) {
+            follower->shared = 1;
+            follower->shared_pid = leader->pid;
+            follower->status = leader->status;
+            job_log(follower, leader->status);
+            retain_share(follower, leader);
+        }
+        batch_job_done(follower, launched);
+        job_free(follower);
+        follower = next;
+    }
+}
+
+/*
+ * ============================================================================
+ * COMANDOS PREPARADOS (%prepare / %invoke)
+ * ============================================================================
+ *
+ * OBJETIVO:
+ * Muitos clientes mandam sempre a mesma linha comprida com um ou dois
+ * argumentos diferentes. Em vez de a enviar (e separar) de cada vez, o
+ * cliente regista-a uma vez como modelo e depois manda só o nome e os
+ * valores:
+ *
+ *   %prepare resize convert {in} -resize 50% out_{n}.png
+ *   %invoke resize a.png 1          ->  convert a.png -resize 50% out_1.png
+ *   %invoke resize b.png 2          ->  convert b.png -resize 50% out_2.png
+ *
+ * - O nome é escolhido pelo cliente (o FIFO não tem caminho de volta para
+ *   o servidor responder com um id). Um %prepare com um nome que já existe
+ *   substitui o modelo.
+ * - Os valores vão pela ordem em que os {nomes} aparecem pela primeira vez
+ *   no modelo. Um {nome} repetido usa o mesmo valor.
+ * - O modelo é separado em argumentos uma só vez, no %prepare, e o
+ *   executável é procurado no PATH nessa altura: cada %invoke só copia
+ *   os argumentos fixos, põe os valores e faz execv() direto.
+ *
+ * LIMITAÇÕES: um {nome} por argumento (ex: "out_{n}.png", mas não
+ * "{a}_{b}"), e os valores não podem ter espaços (como no resto do parser).
+ * %invoke tem de ser a última diretiva ("%cache %invoke resize ...").
+ */
+#define PREPARE_PREFIX "%prepare "
+#define INVOKE_PREFIX "%invoke "
+#define MAX_TEMPLATES 64
+#define MAX_TEMPLATE_PARAMS 8
+
+struct template_arg {
+    char *prefix;         // Texto antes do {nome} (ou o argumento inteiro)
+    char *suffix;         // Texto depois do {nome}
+    int param;            // Índice do parâmetro, -1 = argumento fixo
+};
+
+struct template {
+    char name[32];
+    char *source;         // Texto do %prepare (para a atualização)
+    char *path;           // Executável resolvido (NULL = execvp no arranque)
+    int argc;
+    struct template_arg args[32];
+    int num_params;
+    char params[MAX_TEMPLATE_PARAMS][32];
+};
+
+struct template templates[MAX_TEMPLATES];
+
+/*
+ * Procura o programa como o execvp() faria. Retorna uma cópia do caminho
+ * ou NULL (fica para o execvp() dar o erro quando o job correr).
+ */
+char *resolve_path(const char *prog) {
+    if (strchr(prog, '/') != NULL) return strdup(prog);
+
+    const char *env = getenv("PATH");
+    char dirs[MAX_BUFFER];
+    append_str(dirs, 0, sizeof(dirs), env != NULL ? env : "/usr/local/bin:/usr/bin:/bin");
+
+    char *saveptr;
+    for (char *dir = strtok_r(dirs, ":", &saveptr); dir != NULL;
+         dir = strtok_r(NULL, ":", &saveptr)) {
+        char path[512];
+        int len = append_str(path, 0, sizeof(path), dir);
+        len = append_str(path, len, sizeof(path), "/");
+        append_str(path, len, sizeof(path), prog);
+        if (access(path, X_OK) == 0) return strdup(path);
+    }
+    return NULL;
+}
+
+void template_clear(struct template *t) {
+    free(t->source);
+    free(t->path);
+    for (int i = 0; i < t->argc; i++) {
+        free(t->args[i].prefix);
+        free(t->args[i].suffix);
+    }
+    memset(t, 0, sizeof(*t));
+}
+
+struct template *template_find(const char *name, int len) {
+    for (int i = 0; i < num_templates; i++) {
+        if ((int)strlen(templates[i].name) == len &&
+            strncmp(templates[i].name, name, len) == 0) {
+            return &templates[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * "nome modelo..." -> regista o modelo. Retorna 0 ou -1.
+ * O modelo novo é montado à parte: se for inválido, um modelo com o
+ * mesmo nome continua como estava.
+ */
+int template_prepare(const char *text) {
+    int name_len = strcspn(text, " ");
+    const char *body = text + name_len;
+    while (*body == ' ') body++;
+
+    if (name_len == 0 || name_len >= 32 || *body == '\0') {
+        print_err("[Servidor] Erro: uso: %prepare NOME COMANDO {parâmetro} ...\n");
+        return -1;
+    }
+
+    struct template *old = template_find(text, name_len);
+    if (old == NULL && num_templates == MAX_TEMPLATES) {
+        print_err("[Servidor] Erro: demasiados modelos (%prepare)\n");
+        return -1;
+    }
+
+    static struct template new_template;
+    struct template *t = &new_template;
+    memset(t, 0, sizeof(*t));
+    memcpy(t->name, text, name_len);
+    t->source = strdup(text);
+
+    char copy[MAX_BUFFER];
+    char *args[32];
+    append_str(copy, 0, sizeof(copy), body);
+    t->argc = split_command(copy, args);
+
+    for (int i = 0; i < t->argc; i++) {
+        struct template_arg *arg = &t->args[i];
+        char *open = strchr(args[i], '{');
+        char *close = open != NULL ? strchr(open, '}') : NULL;
+        arg->param = -1;
+
+        if (close == NULL || close - open - 1 <= 0 || close - open - 1 >= 32) {
+            arg->prefix = strdup(args[i]);
+            continue;
+        }
+
+        // Parâmetro novo ou repetido
+        int plen = close - open - 1;
+        for (int p = 0; p < t->num_params && arg->param == -1; p++) {
+            if ((int)strlen(t->params[p]) == plen && strncmp(t->params[p], open + 1, plen) == 0) {
+                arg->param = p;
+            }
+        }
+        if (arg->param == -1) {
+            if (t->num_params == MAX_TEMPLATE_PARAMS) {
+                print_err("[Servidor] Erro: demasiados parâmetros no modelo '");
+                print_err(t->name);
+                print_err("'\n");
+                template_clear(t);
+                return -1;
+            }
+            memcpy(t->params[t->num_params], open + 1, plen);
+            arg->param = t->num_params++;
+        }
+        arg->prefix = strndup(args[i], open - args[i]);
+        arg->suffix = strdup(close + 1);
+    }
+
+    // Um {nome} no programa só se resolve em cada %invoke
+    if (t->argc > 0 && t->args[0].param == -1) {
+        t->path = resolve_path(t->args[0].prefix);
+    }
+
+    // Válido: substitui o antigo (ou ocupa um lugar novo)
+    if (old != NULL) template_clear(old);
+    else old = &templates[num_templates++];
+    *old = *t;
+    t = old;
+
+    print_str("[Servidor] Modelo '");
+    print_str(t->name);
+    print_str("' registado (");
+    print_int(STDOUT_FILENO, t->num_params);
+    print_str(" parâmetro(s)).\n");
+    metrics_changed();
+    return 0;
+}
+
+/*
+ * "nome valor1 valor2..." -> job->argv (um só bloco: ponteiros, textos
+ * e caminho) e job->cmd (para o log). Retorna 0 ou -1.
+ */
+int template_invoke(struct job *job, const char *text) {
+    int name_len = strcspn(text, " ");
+    struct template *t = template_find(text, name_len);
+    if (t == NULL) {
+        print_err("[Servidor] Erro: modelo desconhecido em '");
+        print_err(text);
+        print_err("'\n");
+        return -1;
+    }
+
+    // Valores (apontam para text)
+    const char *values[MAX_TEMPLATE_PARAMS];
+    int value_lens[MAX_TEMPLATE_PARAMS];
+    int num_values = 0;
+    const char *p = text + name_len;
+    for (;;) {
+        while (*p == ' ') p++;
+        if (*p == '\0') break;
+        if (num_values == MAX_TEMPLATE_PARAMS) {
+            num_values++;
+            break;
+        }
+        values[num_values] = p;
+        value_lens[num_values] = strcspn(p, " ");
+        p += value_lens[num_values++];
+    }
+    if (num_values != t->num_params) {
+        print_err("[Servidor] Erro: o modelo '");
+        print_err(t->name);
+        print_err("' precisa de ");
+        print_int(STDERR_FILENO, t->num_params);
+        print_err(" valor(es)\n");
+        return -1;
+    }
+
+    // Tamanho do bloco
+    size_t bytes = (t->argc + 1) * sizeof(char *);
+    for (int i = 0; i < t->argc; i++) {
+        struct template_arg *arg = &t->args[i];
+        bytes += strlen(arg->prefix) + 1;
+        if (arg->param != -1) bytes += value_lens[arg->param] + strlen(arg->suffix);
+    }
+    size_t text_bytes = bytes - (t->argc + 1) * sizeof(char *);
+    if (t->path != NULL) bytes += strlen(t->path) + 1;
+
+    char **argv = malloc(bytes);
+    char *cmd = malloc(text_bytes);
+    if (argv == NULL || cmd == NULL) {
+        free(argv);
+        free(cmd);
+        return -1;
+    }
+
+    char *out = (char *)(argv + t->argc + 1);
+    int cmd_len = 0;
+    for (int i = 0; i < t->argc; i++) {
+        struct template_arg *arg = &t->args[i];
+        argv[i] = out;
+        int len = strlen(arg->prefix);
+        memcpy(out, arg->prefix, len);
+        out += len;
+        if (arg->param != -1) {
+            memcpy(out, values[arg->param], value_lens[arg->param]);
+            out += value_lens[arg->param];
+            len = strlen(arg->suffix);
+            memcpy(out, arg->suffix, len);
+            out += len;
+        }
+        *out++ = '\0';
+
+        // cmd = argumentos separados por um espaço
+        if (i > 0) cmd[cmd_len++] = ' ';
+        len = strlen(argv[i]);
+        memcpy(cmd + cmd_len, argv[i], len);
+        cmd_len += len;
+    }
+    argv[t->argc] = NULL;
+    cmd[cmd_len] = '\0';
+
+    if (t->path != NULL) {
+        memcpy(out, t->path, strlen(t->path) + 1);
+        job->exec_path = out;
+    }
+    job->argv = argv;
+    job->cmd = cmd;
+    template_invokes++;
+    metrics_changed();
+    return 0;
+}
+
+/*
+ * fork() + exec de um job: com o argv montado por %invoke ou separando
+ * job->cmd. Também corre nos dispatchers (--loop threads).
+ */
+pid_t job_fork(struct job *job) {
+    TRACE(TRACE_SPAWN, 'B', job->id, job->cmd);
+    long start = now_us();
+    pid_t pid;
+    if (job->argv != NULL) {
+        pid = execute_argv(job->cmd, job->argv, job->exec_path, job->place, job->out_fd);
+    } else {
+        pid = execute_command(job->cmd, job->place, job->out_fd);
+    }
+    job->spawn_us = now_us() - start;
+    TRACE(TRACE_SPAWN, 'E', job->id, NULL);
+    if (pid > 0) TRACE(TRACE_RUN, 'b', job->id, NULL);
+    return pid;
+}
+
+/*
+ * ============================================================================
+ * OUTPUT GUARDADO PARA CONSULTA (--retain / ./client --fetch)
+ * ============================================================================
+ *
+ * OBJETIVO:
+ * O output de um job só aparecia no stdout do servidor: um cliente que já
+ * não estava a ver quando o job acabou perdia-o. Escrever o output de
+ * cada job em disco é caro quando os jobs são muitos e pequenos. Com
+ * --retain MB, o servidor captura o stdout de todos os jobs (o mesmo
+ * memfd do %cache) e guarda os mais recentes em memória, até MB
+ * megabytes. Depois:
+ *
+ *   ./client --fetch 1234          o job com esse id ("id" no --watch)
+ *   ./client --fetch ci.build-42   o último job de "./client --name ci.build-42"
+ *
+ * O cliente não tem como saber o id no momento em que submete (o FIFO
+ * não tem caminho de volta), por isso um nome escolhido com --name
+ * também serve.
+ *
+ * MEMÓRIA:
+ *   O output é guardado em pedaços de RETAIN_CHUNK bytes, tirados de slabs
+ *   de RETAIN_SLAB pedaços: um output de 30 bytes ocupa um pedaço e não
+ *   um malloc() à medida, e os pedaços libertados são reutilizados sem
+ *   voltar ao malloc(). Os registos estão numa lista LRU (uma consulta
+ *   conta como uso); quando um registo novo não cabe no orçamento, saem
+ *   os menos usados. As contas incluem o próprio registo, por isso um
+ *   milhão de jobs sem output também não passa do orçamento.
+ *
+ * DISCO:
+ *   Um output maior do que RETAIN_SPILL_SIZE vai para o ficheiro
+ *   RETAIN_DIR/<id> em vez de para a memória (com --loop threads, quem o
+ *   escreve é o reaper). Esses ficheiros têm o seu orçamento
+ *   (--retain-disk MB) e saem pela mesma ordem.
+ *
+ * Os jobs corridos noutro servidor (--nodes) não são guardados (o output
+ * fica no nó). Numa atualização (re-exec) os outputs guardados perdem-se;
+ * os ids continuam a contar.
+ */
+#define RETAIN_DIR "logs/outputs"
+#define RETAIN_CHUNK 512                  // Bytes de cada pedaço (com o ponteiro)
+#define RETAIN_DATA (RETAIN_CHUNK - (int)sizeof(void *))  // Bytes de output por pedaço
+#define RETAIN_SLAB 128                   // Pedaços por slab (64 KB)
+#define RETAIN_SPILL_SIZE (64 * 1024)     // Outputs maiores vão para disco
+#define RETAIN_BUCKETS 4096               // Índice por id (potência de 2)
+
+struct retain_chunk {
+    struct retain_chunk *next;
+    char data[RETAIN_DATA];
+};
+
+struct retained {
+    long id;
+    char *cmd;                  // No mesmo bloco que o registo
+    char *client;               // NULL = sem --name
+    int status;
+    long len;
+    int spilled;                // O output está em RETAIN_DIR/<id>
+    long size;                  // Bytes de memória contados no orçamento
+    struct retain_chunk *chunks;
+    struct retained *newer;     // Lista LRU
+    struct retained *older;
+    struct retained *hnext;     // Índice por id
+};
+
+long retain_disk_budget = 256L * 1024 * 1024;  // --retain-disk (bytes)
+struct retained *retain_table[RETAIN_BUCKETS];
+struct retained *retain_newest = NULL;
+struct retained *retain_oldest = NULL;
+struct retain_chunk *retain_free = NULL;       // Pedaços livres (de todas as slabs)
+
+int write_all(int fd, const void *buf, size_t len);  // Secção da atualização
+
+void retain_path(char *path, int size, long id) {
+    int pos = append_str(path, 0, size, RETAIN_DIR "/");
+    append_int(path, pos, size, id);
+}
+
+/*
+ * Abre RETAIN_DIR/<id> para escrever o output (também no reaper)
+ */
+int retain_spill_open(long id) {
+    char path[64];
+    retain_path(path, sizeof(path), id);
+    return open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+}
+
+void retain_spill_drop(long id) {
+    char path[64];
+    retain_path(path, sizeof(path), id);
+    unlink(path);
+}
+
+struct retain_chunk *retain_chunk_alloc(void) {
+    if (retain_free == NULL) {
+        struct retain_chunk *slab = malloc(RETAIN_SLAB * sizeof(struct retain_chunk));
+        if (slab == NULL) return NULL;
+        for (int i = 0; i < RETAIN_SLAB; i++) {
+            slab[i].next = retain_free;
+            retain_free = &slab[i];
+        }
+    }
+    struct retain_chunk *chunk = retain_free;
+    retain_free = chunk->next;
+    return chunk;
+}
+
+void retain_chunks_free(struct retain_chunk *chunk) {
+    while (chunk != NULL) {
+        struct retain_chunk *next = chunk->next;
+        chunk->next = retain_free;
+        retain_free = chunk;
+        chunk = next;
+    }
+}
+
+void retain_unlink_lru(struct retained *e) {
+    if (e->newer != NULL) e->newer->older = e->older;
+    else retain_newest = e->older;
+    if (e->older != NULL) e->older->newer = e->newer;
+    else retain_oldest = e->newer;
+}
+
+void retain_push_lru(struct retained *e) {
+    e->newer = NULL;
+    e->older = retain_newest;
+    if (retain_newest != NULL) retain_newest->newer = e;
+    else retain_oldest = e;
+    retain_newest = e;
+}
+
+void retain_drop(struct retained *e) {
+    struct retained **p = &retain_table[e->id & (RETAIN_BUCKETS - 1)];
+    while (*p != e) p = &(*p)->hnext;
+    *p = e->hnext;
+    retain_unlink_lru(e);
+
+    if (e->spilled) {
+        char path[64];
+        retain_path(path, sizeof(path), e->id);
+        unlink(path);
+        retain_disk -= e->len;
+    }
+    retain_chunks_free(e->chunks);
+    retain_mem -= e->size;
+    retain_count--;
+    free(e);
+}
+
+/*
+ * Tira os registos menos usados até caberem mem_need bytes em memória e
+ * disk_need em disco. Para libertar disco só saem registos em disco.
+ */
+void retain_evict(long mem_need, long disk_need) {
+    struct retained *e = retain_oldest;
+    while (e != NULL && (retain_mem + mem_need > retain_budget ||
+                         retain_disk + disk_need > retain_disk_budget)) {
+        struct retained *newer = e->newer;
+        if (retain_mem + mem_need > retain_budget || e->spilled) {
+            retain_drop(e);
+            retain_evictions++;
+        }
+        e = newer;
+    }
+}
+
+/*
+ * Guarda o output de um job que terminou (só na thread principal).
+ * spilled = o output já está em RETAIN_DIR/<id> (escrito por cache_collect).
+ */
+void retain_store(struct job *job, int status, const char *output, long len, int spilled) {
+    char path[64];
+    retain_path(path, sizeof(path), job->id);
+
+    if (!spilled && len > RETAIN_SPILL_SIZE) {
+        // Resposta da cache grande: vai já para disco
+        int fd = retain_spill_open(job->id);
+        if (fd == -1) return;
+        spilled = write_all(fd, output, len) == 0;
+        close(fd);
+        if (!spilled) {
+            unlink(path);
+            return;
+        }
+    }
+
+    int cmd_len = strlen(job->cmd);
+    int client_len = job->client != NULL ? (int)strlen(job->client) : -1;
+    long chunks = spilled ? 0 : (len + RETAIN_DATA - 1) / RETAIN_DATA;
+    long size = sizeof(struct retained) + cmd_len + client_len + 2 + chunks * RETAIN_CHUNK;
+    if (size > retain_budget || (spilled && len > retain_disk_budget)) {
+        if (spilled) unlink(path);
+        return;
+    }
+    retain_evict(size, spilled ? len : 0);
+
+    struct retained *e = malloc(sizeof(struct retained) + cmd_len + client_len + 2);
+    if (e == NULL) {
+        if (spilled) unlink(path);
+        return;
+    }
+    memset(e, 0, sizeof(*e));
+    e->cmd = (char *)(e + 1);
+    memcpy(e->cmd, job->cmd, cmd_len + 1);
+    if (client_len >= 0) {
+        e->client = e->cmd + cmd_len + 1;
+        memcpy(e->client, job->client, client_len + 1);
+    }
+    e->id = job->id;
+    e->status = status;
+    e->len = len;
+    e->spilled = spilled;
+    e->size = size;
+
+    // Copia o output para os pedaços
+    struct retain_chunk **tail = &e->chunks;
+    for (long off = 0; !spilled && off < len; ) {
+        struct retain_chunk *chunk = retain_chunk_alloc();
+        if (chunk == NULL) {
+            retain_chunks_free(e->chunks);
+            free(e);
+            return;
+        }
+        long n = len - off < RETAIN_DATA ? len - off : RETAIN_DATA;
+        memcpy(chunk->data, output + off, n);
+        off += n;
+        chunk->next = NULL;
+        *tail = chunk;
+        tail = &chunk->next;
+    }
+
+    struct retained **bucket = &retain_table[e->id & (RETAIN_BUCKETS - 1)];
+    e->hnext = *bucket;
+    *bucket = e;
+    retain_push_lru(e);
+    retain_mem += size;
+    if (spilled) retain_disk += len;
+    retain_count++;
+    metrics_changed();
+}
+
+/*
+ * Um job local terminou: guarda o que cache_collect() capturou
+ */
+void retain_job(struct job *job) {
+    if (retain_budget == 0 || job->out_fd == -1) return;
+    if (job->spilled) {
+        retain_store(job, job->status, NULL, job->out_len, 1);
+    } else if (job->output != NULL) {
+        retain_store(job, job->status, job->output, job->out_len, 0);
+    }
+}
+
+/*
+ * %coalesce: o seguidor fica com o output do líder (em disco, com um link)
+ */
+void retain_share(struct job *job, struct job *from) {
+    if (retain_budget == 0 || from->out_fd == -1) return;
+    if (from->spilled) {
+        char from_path[64], path[64];
+        retain_path(from_path, sizeof(from_path), from->id);
+        retain_path(path, sizeof(path), job->id);
+        if (link(from_path, path) == 0) {
+            retain_store(job, from->status, NULL, from->out_len, 1);
+        }
+    } else if (from->output != NULL) {
+        retain_store(job, from->status, from->output, from->out_len, 0);
+    }
+}
+
+/*
+ * Procura um registo pelo id ou, se key não for um número, pelo nome de
+ * --name (o mais recente). Conta como uso para a LRU.
+ */
+struct retained *retain_find(const char *key) {
+    struct retained *e = NULL;
+    if (*key >= '0' && *key <= '9' && key[strspn(key, "0123456789")] == '\0') {
+        long id = atol(key);
+        e = retain_table[id & (RETAIN_BUCKETS - 1)];
+        while (e != NULL && e->id != id) e = e->hnext;
+    } else {
+        e = retain_newest;
+        while (e != NULL && (e->client == NULL || strcmp(e->client, key) != 0)) e = e->older;
+    }
+    if (e != NULL) {
+        retain_unlink_lru(e);
+        retain_push_lru(e);
+        retain_fetches++;
+        metrics_changed();
+    }
+    return e;
+}
+
+/*
+ * Abre o output de um registo para ser enviado. Retorna um fd no início
+ * do output ou -1. Os pedaços são copiados para um memfd: assim o envio
+ * não depende do registo, que pode sair da LRU entretanto.
+ */
+int retain_open(struct retained *e) {
+    if (e->spilled) {
+        char path[64];
+        retain_path(path, sizeof(path), e->id);
+        return open(path, O_RDONLY | O_CLOEXEC);
+    }
+
+    int fd = memfd_create("exec_fetch", MFD_CLOEXEC);
+    if (fd == -1) return -1;
+    long left = e->len;
+    for (struct retain_chunk *c = e->chunks; c != NULL && left > 0; c = c->next) {
+        long n = left < RETAIN_DATA ? left : RETAIN_DATA;
+        if (write_all(fd, c->data, n) == -1) {
+            close(fd);
+            return -1;
+        }
+        left -= n;
+    }
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+/*
+ * Cria RETAIN_DIR e apaga os outputs deixados por um servidor anterior
+ */
+void retain_init(void) {
+    if (retain_budget == 0) return;
+
+    mkdir(RETAIN_DIR, 0777);
+    DIR *dir = opendir(RETAIN_DIR);
+    if (dir != NULL) {
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] == '.') continue;
+            unlinkat(dirfd(dir), entry->d_name, 0);
+        }
+        closedir(dir);
+    }
+
+    print_str("[Servidor] Outputs guardados em memória até ");
+    print_int(STDOUT_FILENO, retain_budget / (1024 * 1024));
+    print_str(" MB (./client --fetch).\n");
+}
+
+/*
+ * ============================================================================
+ * CACHE DE RESULTADOS (%cache)
+ * ============================================================================
+ *
+ * OBJETIVO:
+ * Comandos determinísticos (ex: "sha256sum f", "gcc -c a.c") dão sempre o
+ * mesmo resultado para as mesmas entradas. Com o prefixo "%cache " ou
+ * "%cache=a.c,a.h " (./client --cache), o servidor guarda o exit status
+ * e o output e, da vez seguinte, responde sem lançar nada.
+ *
+ * CHAVE:
+ *   argv normalizado + device, inode, tamanho e mtime (ns) de cada
+ *   ficheiro declarado. Se um ficheiro mudar, a chave muda. Se não
+ *   existir, o comando corre sem cache.
+ *
+ * OUTPUT:
+ *   O stdout do filho vai para um memfd; quando ele termina, o servidor
+ *   mostra-o (como antes) e guarda-o. O stderr não é guardado. Só ficam
+ *   na cache filhos que terminaram com exit() (não os mortos por sinal).
+ *
+ * ARMAZENAMENTO (--cache-file, omissão logs/cache.db):
+ *   Ficheiro de tamanho fixo (--cache-size MB) mapeado com mmap(). Os
+ *   registos são escritos em anel e, quando falta espaço, os mais antigos
+ *   são descartados - a memória usada nunca passa do tamanho do ficheiro.
+ *
+ *   [cabeçalho][registo][registo]...[WRAP]
+ *                tail ->             head ->
+ *
+ *   Sobrevive a reinícios: ao abrir, o índice em memória (hash -> posição)
+ *   é reconstruído percorrendo o anel de tail a head. Se o ficheiro não
+ *   estiver coerente (ex: o servidor morreu a meio de uma escrita), a
+ *   cache recomeça vazia.
+ *
+ * O ficheiro só é aberto no primeiro %cache.
+ */
+#define CACHE_PREFIX "%cache"
+#define CACHE_FILE "logs/cache.db"
+#define CACHE_MAGIC 0x43414348u         // "CACH"
+#define CACHE_VERSION 1
+#define CACHE_RECORD_MAGIC 0x52455355u  // Registo com um resultado
+#define CACHE_WRAP_MAGIC 0x57524150u    // Resto do anel por usar: volta ao início
+#define CACHE_BUCKETS 4096              // Índice em memória (potência de 2)
+#define CACHE_MAX_OUTPUT (1024 * 1024)  // Outputs maiores não são guardados
+
+struct cache_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t data_size;   // Bytes do anel (a seguir ao cabeçalho)
+    uint64_t head;        // Onde vai o próximo registo
+    uint64_t tail;        // Registo mais antigo
+    uint64_t used;        // Bytes ocupados de tail até head
+    uint64_t next_seq;
+    char pad[16];         // Os registos começam alinhados a 64 bytes
+};
+
+/*
+ * Seguido de key_len bytes da chave e out_len bytes do output
+ */
+struct cache_record {
+    uint32_t magic;
+    uint32_t len;         // Tamanho total (múltiplo de 8)
+    uint64_t seq;         // Distingue um registo novo de restos de um antigo
+    uint64_t hash;
+    uint32_t key_len;
+    uint32_t out_len;
+    int32_t status;       // Formato do waitpid()
+    uint32_t pad;
+};
+
+struct cache_entry {
+    uint64_t hash;
+    uint64_t offset;
+    uint64_t seq;
+    struct cache_entry *next;
+};
+
+const char *cache_path = CACHE_FILE;
+long cache_size_mb = 64;
+struct cache_header *cache = NULL;   // NULL = ainda não aberta
+char *cache_data = NULL;
+int cache_failed = 0;                // Não foi possível abrir: sem cache
+struct cache_entry *cache_index[CACHE_BUCKETS];
+
+struct cache_record *cache_record_at(uint64_t offset) {
+    return (struct cache_record *)(cache_data + offset);
+}
+
+/*
+ * Tamanho do registo em offset. Um WRAP (ou um resto do anel onde nem
+ * cabe um cabeçalho) ocupa tudo até ao fim.
+ */
+uint64_t cache_record_len(uint64_t offset) {
+    if (cache->data_size - offset < sizeof(struct cache_record) ||
+        cache_record_at(offset)->magic == CACHE_WRAP_MAGIC) {
+        return cache->data_size - offset;
+    }
+    return cache_record_at(offset)->len;
+}
+
+int cache_is_record(uint64_t offset) {
+    return cache->data_size - offset >= sizeof(struct cache_record) &&
+           cache_record_at(offset)->magic == CACHE_RECORD_MAGIC;
+}
+
+void cache_index_add(uint64_t hash, uint64_t offset, uint64_t seq) {
+    struct cache_entry *e = malloc(sizeof(struct cache_entry));
+    if (e == NULL) return;  // Só se perde o acesso a este registo
+    e->hash = hash;
+    e->offset = offset;
+    e->seq = seq;
+    e->next = cache_index[hash & (CACHE_BUCKETS - 1)];
+    cache_index[hash & (CACHE_BUCKETS - 1)] = e;
+}
+
+void cache_index_remove(uint64_t hash, uint64_t offset) {
+    for (struct cache_entry **p = &cache_index[hash & (CACHE_BUCKETS - 1)]; *p != NULL;
+         p = &(*p)->next) {
+        if ((*p)->offset == offset) {
+            struct cache_entry *e = *p;
+            *p = e->next;
+            free(e);
+            return;
+        }
+    }
+}
+
+void cache_index_clear(void) {
+    for (int b = 0; b < CACHE_BUCKETS; b++) {
+        while (cache_index[b] != NULL) {
+            struct cache_entry *e = cache_index[b];
+            cache_index[b] = e->next;
+            free(e);
+        }
+    }
+}
+
+/*
+ * Reconstrói o índice a partir do ficheiro. Retorna 0 se o anel está
+ * coerente, -1 se não.
+ */
+int cache_load_index(void) {
+    if (cache->head >= cache->data_size || cache->tail >= cache->data_size ||
+        cache->used > cache->data_size) {
+        return -1;
+    }
+
+    uint64_t pos = cache->tail;
+    uint64_t seen = 0;
+    while (seen < cache->used) {
+        uint64_t len = cache_record_len(pos);
+        if (len == 0 || len > cache->data_size - pos) return -1;
+
+        if (cache_is_record(pos)) {
+            struct cache_record *rec = cache_record_at(pos);
+            if (sizeof(*rec) + rec->key_len + rec->out_len > len) return -1;
+            cache_index_add(rec->hash, pos, rec->seq);
+        } else if (len == cache->data_size - pos) {
+            // WRAP
+        } else {
+            return -1;
+        }
+
+        pos += len;
+        if (pos == cache->data_size) pos = 0;
+        seen += len;
+    }
+    return seen == cache->used && pos == cache->head ? 0 : -1;
+}
+
+/*
+ * Abre (ou cria) o ficheiro da cache. Retorna 0 ou -1 (cache desligada).
+ */
+int cache_open(void) {
+    if (cache != NULL) return 0;
+    if (cache_failed) return -1;
+
+    uint64_t data_size = (uint64_t)cache_size_mb * 1024 * 1024;
+    uint64_t total = sizeof(struct cache_header) + data_size;
+
+    int fd = open(cache_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1 ||
+        ((uint64_t)st.st_size != total && ftruncate(fd, total) == -1)) {
+        print_error("Erro ao abrir a cache");
+        if (fd != -1) close(fd);
+        cache_failed = 1;
+        return -1;
+    }
+
+    void *p = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);  // O mapeamento continua válido
+    if (p == MAP_FAILED) {
+        print_error("mmap");
+        cache_failed = 1;
+        return -1;
+    }
+    cache = p;
+    cache_data = (char *)p + sizeof(struct cache_header);
+
+    if (cache->magic != CACHE_MAGIC || cache->version != CACHE_VERSION ||
+        cache->data_size != data_size || cache_load_index() == -1) {
+        cache_index_clear();
+        memset(cache, 0, sizeof(*cache));
+        cache->magic = CACHE_MAGIC;
+        cache->version = CACHE_VERSION;
+        cache->data_size = data_size;
+        cache->next_seq = 1;
+    }
+    cache_bytes = cache->used;
+    metrics_changed();
+    return 0;
+}
+
+/*
+ * Descarta o registo mais antigo
+ */
+void cache_evict_oldest(void) {
+    uint64_t len = cache_record_len(cache->tail);
+    if (cache_is_record(cache->tail)) {
+        cache_index_remove(cache_record_at(cache->tail)->hash, cache->tail);
+        cache_evictions++;
+    }
+    cache->tail += len;
+    if (cache->tail == cache->data_size) cache->tail = 0;
+    cache->used -= len;
+}
+
+/*
+ * Descarta registos antigos até [head, head + len) estar livre.
+ * head + len nunca passa do fim do anel.
+ */
+void cache_make_room(uint64_t len) {
+    for (;;) {
+        if (cache->used == 0) return;
+        if (cache->tail < cache->head) return;
+        if (cache->tail > cache->head && cache->tail - cache->head >= len) return;
+        cache_evict_oldest();
+    }
+}
+
+void cache_put(const char *key, uint64_t hash, int status, const char *out, uint32_t out_len) {
+    uint32_t key_len = strlen(key);
+    uint64_t len = (sizeof(struct cache_record) + key_len + out_len + 7) & ~7UL;
+    if (len > cache->data_size / 4) return;
+
+    if (cache->used == 0) cache->head = cache->tail = 0;
+
+    // Não cabe antes do fim: o resto fica como WRAP e recomeça no início
+    if (cache->head + len > cache->data_size) {
+        uint64_t rest = cache->data_size - cache->head;
+        cache_make_room(rest);
+        if (rest >= sizeof(struct cache_record)) {
+            cache_record_at(cache->head)->magic = CACHE_WRAP_MAGIC;
+        }
+        cache->used += rest;
+        cache->head = 0;
+    }
+    cache_make_room(len);
+
+    struct cache_record *rec = cache_record_at(cache->head);
+    rec->magic = 0;  // Só fica válido no fim
+    rec->len = len;
+    rec->seq = cache->next_seq++;
+    rec->hash = hash;
+    rec->key_len = key_len;
+    rec->out_len = out_len;
+    rec->status = status;
+    memcpy((char *)(rec + 1), key, key_len);
+    memcpy((char *)(rec + 1) + key_len, out, out_len);
+    rec->magic = CACHE_RECORD_MAGIC;
+
+    cache_index_add(hash, cache->head, rec->seq);
+    cache->head += len;
+    if (cache->head == cache->data_size) cache->head = 0;
+    cache->used += len;
+    cache_bytes = cache->used;
+    cache_stores++;
+}
+
+struct cache_record *cache_get(const char *key, uint64_t hash) {
+    uint32_t key_len = strlen(key);
+    for (struct cache_entry *e = cache_index[hash & (CACHE_BUCKETS - 1)]; e != NULL;
+         e = e->next) {
+        if (e->hash != hash) continue;
+        struct cache_record *rec = cache_record_at(e->offset);
+        if (rec->magic == CACHE_RECORD_MAGIC && rec->seq == e->seq &&
+            rec->key_len == key_len && memcmp(rec + 1, key, key_len) == 0) {
+            return rec;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Calcula job->cache_key. Retorna 0, ou -1 se um ficheiro de entrada
+ * não existe (o comando corre sem cache).
+ */
+int cache_make_key(struct job *job) {
+    char key[MAX_BUFFER];
+    int pos = normalize_argv(job->cmd, key, sizeof(key));
+
+    if (job->cache_inputs != NULL) {
+        char list[MAX_BUFFER];
+        append_str(list, 0, sizeof(list), job->cache_inputs);
+
+        char *saveptr;
+        for (char *path = strtok_r(list, ",", &saveptr); path != NULL;
+             path = strtok_r(NULL, ",", &saveptr)) {
+            struct stat st;
+            if (stat(path, &st) == -1) {
+                print_err("[Servidor] Aviso: ");
+                print_err(path);
+                print_err(" não existe; a correr sem cache\n");
+                return -1;
+            }
+            // "\nficheiro:dev:inode:tamanho:mtime.ns"
+            pos = append_str(key, pos, sizeof(key), "\n");
+            pos = append_str(key, pos, sizeof(key), path);
+            pos = append_str(key, pos, sizeof(key), ":");
+            pos = append_int(key, pos, sizeof(key), (long)st.st_dev);
+            pos = append_str(key, pos, sizeof(key), ":");
+            pos = append_int(key, pos, sizeof(key), (long)st.st_ino);
+            pos = append_str(key, pos, sizeof(key), ":");
+            pos = append_int(key, pos, sizeof(key), (long)st.st_size);
+            pos = append_str(key, pos, sizeof(key), ":");
+            pos = append_int(key, pos, sizeof(key), (long)st.st_mtim.tv_sec);
+            pos = append_str(key, pos, sizeof(key), ".");
+            pos = append_int(key, pos, sizeof(key), st.st_mtim.tv_nsec);
+        }
+    }
+
+    job->cache_key = strdup(key);
+    if (job->cache_key == NULL) return -1;
+    job->cache_hash = str_hash(key);
+    return 0;
+}
+
+/*
+ * Procura o resultado de um job com %cache. Retorna 1 se respondeu
+ * (o job já foi registado e libertado), 0 se tem de correr.
+ */
+int cache_lookup(struct job *job) {
+    if (cache_open() == -1 || cache_make_key(job) == -1) return 0;
+
+    struct cache_record *rec = cache_get(job->cache_key, job->cache_hash);
+    metrics_changed();
+    if (rec == NULL) {
+        cache_misses++;
+        return 0;
+    }
+
+    cache_hits++;
+    const char *output = (char *)(rec + 1) + rec->key_len;
+    write(STDOUT_FILENO, output, rec->out_len);
+    job->cached = 1;
+    job->status = rec->status;
+    job_log(job, rec->status);
+    if (retain_budget > 0) retain_store(job, rec->status, output, rec->out_len, 0);
+    batch_job_done(job, 1);
+    job_free(job);
+    return 1;
+}
+
+/*
+ * Lê o output capturado, mostra-o no stdout do servidor e guarda-o em
+ * job->output para cache_store() e retain_job(). Um output grande com
+ * --retain vai para RETAIN_DIR. Com --loop threads corre no reaper.
+ */
+void cache_collect(struct job *job) {
+    if (job->out_fd == -1) return;
+
+    off_t size = lseek(job->out_fd, 0, SEEK_END);
+    int spill = retain_budget > 0 && size > RETAIN_SPILL_SIZE;
+    if (size >= 0 && size <= CACHE_MAX_OUTPUT && (job->cache_key != NULL || !spill)) {
+        job->output = malloc(size > 0 ? size : 1);
+    }
+    int spill_fd = spill ? retain_spill_open(job->id) : -1;
+
+    char buf[MAX_BUFFER];
+    ssize_t n;
+    off_t offset = 0;
+    while ((n = pread(job->out_fd, buf, sizeof(buf), offset)) > 0) {
+        write(STDOUT_FILENO, buf, n);
+        if (job->output != NULL && offset + n <= size) {
+            memcpy(job->output + offset, buf, n);
+        }
+        if (spill_fd != -1 && write_all(spill_fd, buf, n) == -1) {
+            // Disco cheio ou erro: um output cortado não é guardado
+            close(spill_fd);
+            spill_fd = -1;
+            retain_spill_drop(job->id);
+        }
+        offset += n;
+    }
+    if (offset != size) {  // Mudou entretanto: não guarda
+        free(job->output);
+        job->output = NULL;
+    }
+    if (spill_fd != -1) {
+        close(spill_fd);
+        if (offset == size) job->spilled = 1;
+        else retain_spill_drop(job->id);
+    }
+    job->out_len = offset;
+}
+
+/*
+ * O job terminou: guarda o resultado (só na thread principal)
+ */
+void cache_store(struct job *job) {
+    if (job->output == NULL || job->cache_key == NULL || !WIFEXITED(job->status) ||
+        cache_open() == -1) {
+        return;
+    }
+    cache_put(job->cache_key, job->cache_hash, job->status, job->output, job->out_len);
+    metrics_changed();
+}
+
+/*
+ * Lança o processo filho de um job e regista-o em running[].
+ * Retorna 0 ou -1 se o comando não pôde ser lançado.
+ */
+int job_launch(struct job *job) {
+    job->queue_ms = now_ms() - job->submit_ms;
+
+    // %cache / --retain: o stdout do filho (ou do builtin) vai para um memfd
+    if ((job->cache_key != NULL || retain_budget > 0) && job->out_fd == -1) {
+        job->out_fd = memfd_create("exec_output", MFD_CLOEXEC);
+    }
+
+    // --builtins: corre dentro do servidor, sem ocupar lugar em running[]
+    if (builtins_active && job_run_builtin(job)) {
+        return 0;
+    }
+
+    job->place = placement_choose();
+
+    // --loop threads: quem faz o fork() é um dispatcher
+    if (loop_backend == BACKEND_THREADS) {
+        job->slot = num_running;
+        running[num_running++] = job;
+        threads_dispatch(job);
+        return 0;
+    }
+
+    job->pid = job_fork(job);
+
+    if (job->pid <= 0) {
+        // Falhou - liberta o lugar e a memória
+        placement_release(job->place);
+        coalesce_release(job, 0);
+        batch_job_done(job, 0);
+        job_free(job);
+        return -1;
+    }
+
+    job->slot = num_running;
+    running[num_running++] = job;
+
+    if (loop_backend == BACKEND_URING) {
+        uring_watch_child(job);
+    }
+    return 0;
+}
+
+/*
+ * Cria o job de um comando da mensagem (diretivas e %invoke), sem o
+ * lançar. Retorna NULL se não há job (%prepare, ou falhou logo).
+ */
+struct job *job_parse(const char *cmd, struct batch *batch) {
+    // %prepare: só regista o modelo, não é um job
+    if (strncmp(cmd, PREPARE_PREFIX, strlen(PREPARE_PREFIX)) == 0) {
+        template_prepare(cmd + strlen(PREPARE_PREFIX));
+        return NULL;
+    }
+
+    struct job *job = calloc(1, sizeof(struct job));
+    if (job == NULL) {
+        print_error("calloc");
+        return NULL;
+    }
+
+    /*
+     * strdup() faz uma cópia do comando.
+     * Precisamos disto porque:
+     * 1. strtok_r() modifica o buffer original
+     * 2. Queremos guardar o comando para escrever no log depois
+     */
+    job->batch = batch;
+    job->place = -1;
+    job->out_fd = -1;
+    job->submit_ms = now_ms();
+    job->id = ++next_job_id;
+    shard_count(1);
+    TRACE(TRACE_JOB, 'b', job->id, NULL);
+    TRACE(TRACE_PARSE, 'B', job->id, NULL);
+    batch->total++;
+    batch->remaining++;
+
+    // Diretivas antes do comando: "%coalesce ", "%cache ", "%cache=a,b ",
+    // "%client=NOME ", "%step=NOME ", "%after=a,b ", e por último
+    // "%invoke " (o resto é o nome do modelo e os valores)
+    while (*cmd == '%') {
+        int len = strcspn(cmd, " ");
+        if (strncmp(cmd, COALESCE_PREFIX, strlen(COALESCE_PREFIX)) == 0) {
+            job->want_coalesce = 1;
+        } else if (strncmp(cmd, CACHE_PREFIX, len) == 0 && len == (int)strlen(CACHE_PREFIX)) {
+            job->want_cache = 1;
+        } else if (strncmp(cmd, CACHE_PREFIX "=", strlen(CACHE_PREFIX) + 1) == 0) {
+            job->want_cache = 1;
+            free(job->cache_inputs);
+            job->cache_inputs = strndup(cmd + strlen(CACHE_PREFIX) + 1,
+                                        len - strlen(CACHE_PREFIX) - 1);
+        } else if (strncmp(cmd, CLIENT_PREFIX, strlen(CLIENT_PREFIX)) == 0) {
+            free(job->client);
+            job->client = strndup(cmd + strlen(CLIENT_PREFIX), len - strlen(CLIENT_PREFIX));
+        } else if (strncmp(cmd, STEP_PREFIX, strlen(STEP_PREFIX)) == 0) {
+            free(job->step);
+            job->step = strndup(cmd + strlen(STEP_PREFIX), len - strlen(STEP_PREFIX));
+        } else if (strncmp(cmd, AFTER_PREFIX, strlen(AFTER_PREFIX)) == 0) {
+            free(job->after);
+            job->after = strndup(cmd + strlen(AFTER_PREFIX), len - strlen(AFTER_PREFIX));
+        } else {
+            break;  // Não é uma diretiva: faz parte do comando
+        }
+        cmd += len;
+        while (*cmd == ' ') cmd++;
+    }
+
+    if (strncmp(cmd, INVOKE_PREFIX, strlen(INVOKE_PREFIX)) == 0) {
+        if (template_invoke(job, cmd + strlen(INVOKE_PREFIX)) == -1) {
+            TRACE(TRACE_PARSE, 'E', job->id, NULL);
+            batch_job_done(job, 0);
+            job_free(job);
+            return NULL;
+        }
+    } else {
+        job->cmd = strdup(cmd);
+    }
+    TRACE(TRACE_PARSE, 'E', job->id, job->cmd);
+    return job;
+}
+
+/*
+ * Lança um job já criado (ou põe-no na fila).
+ * Retorna 0 se foi aceite, -1 se falhou logo.
+ */
+int job_start(struct job *job) {
+    if (job->want_cache && cache_lookup(job)) {
+        return 0;
+    }
+
+    if (job->want_coalesce) {
+        if (coalesce_attach(job)) {
+            print_str("[Servidor] '");
+            print_str(job->cmd);
+            print_str("' junta-se ao job igual em curso (sem fork).\n");
+            coalesce_attached++;
+            metrics_changed();
+            return 0;
+        }
+        coalesce_leaders++;
+        metrics_changed();
+    }
+
+    // --nodes: vai para um nó remoto se lá houver mais lugares livres
+    int node = launch_paused ? -1 : node_better();
+    if (node != -1) {
+        remote_submit(job, node);
+        return 0;
+    }
+
+    if (num_running < job_limit && !launch_paused) {
+        return job_launch(job);
+    }
+
+    if (queue_tail != NULL) queue_tail->next = job;
+    else queue_head = job;
+    queue_tail = job;
+    return 0;
+}
+
+/*
+ * Aceita um comando de uma mensagem: lança-o já ou põe-no na fila.
+ * Retorna 0 se foi aceite, -1 se falhou logo.
+ */
+int job_submit(const char *cmd, struct batch *batch) {
+    struct job *job = job_parse(cmd, batch);
+    if (job == NULL) return -1;
+    return job_start(job);
+}
+
+/*
+ * Lança jobs da fila enquanto houver lugar em running[] (ou num nó remoto)
+ */
+void start_queued_jobs(void) {
+    while (queue_head != NULL && !launch_paused) {
+        int node = node_better();
+        if (node == -1 && num_running >= job_limit) break;
+
+        struct job *job = queue_head;
+        queue_head = job->next;
+        if (queue_head == NULL) queue_tail = NULL;
+        job->next = NULL;
+
+        if (node != -1) remote_submit(job, node);
+        else job_launch(job);
+    }
+}
+
+
+/*
+ * ============================================================================
+ * GRAFOS DE DEPENDÊNCIAS (%after)
+ * ============================================================================
+ *
+ * OBJETIVO:
+ * Numa mensagem, os comandos correm todos em paralelo. Com "%after=a,b"
+ * um comando só arranca quando os comandos a e b terminarem com
+ * sucesso; os outros continuam a arrancar logo:
+ *
+ *   %step=a make a;%step=b make b;%after=a,b make link
+ *
+ * Um pré-requisito é o nome dado com "%step=NOME" ou a posição do
+ * comando na mensagem (1, 2, ...). Se um comando falhar, os que
+ * dependem dele (direta ou indiretamente) não correm e ficam no log
+ * como "ignorado".
+ *
+ * COMO FUNCIONA:
+ * - process_message() cria os jobs com job_parse() e guarda-os em
+ *   held[]; os pré-requisitos de cada um ficam num bitmask (needs), o
+ *   que chega porque MAX_COMMANDS <= 32
+ * - dag_release() lança (job_start) cada job cujos pré-requisitos já
+ *   estão todos em done; é chamada no início e sempre que um job da
+ *   batch termina (batch_job_done -> dag_job_done)
+ * - Nomes desconhecidos ou ciclos invalidam o grafo todo: nenhum dos
+ *   comandos corre
+ * - No fim da batch, dag_report() escreve no log o caminho crítico: a
+ *   cadeia de dependências que mais tempo demorou, do início do
+ *   primeiro comando ao fim do último
+ *
+ * ATUALIZAÇÃO (SIGHUP):
+ * Os jobs à espera em held[] não estão em running[] nem na fila, por
+ * isso não passariam para a versão nova: a atualização fica adiada até
+ * todos terem sido lançados (ou ignorados). Os jobs que já correm passam
+ * normalmente, mas a batch retomada já não tem o grafo (nem a linha do
+ * caminho crítico).
+ * Com a atualização pedida, as mensagens novas com %after não criam
+ * grafos (senão podiam adiá-la para sempre): ficam guardadas
+ * (dag_park) e passam no memfd para a versão nova, que as processa.
+ */
+struct dag {
+    int count;                          // Comandos (posições) na mensagem
+    struct job *held[MAX_COMMANDS];     // À espera dos pré-requisitos (NULL = lançado)
+    long ids[MAX_COMMANDS];             // Id do job de cada posição (0 = sem job)
+    char *steps[MAX_COMMANDS];          // %step=NOME de cada posição (NULL = sem nome)
+    char *labels[MAX_COMMANDS];         // Nome (%step) ou comando, para o log
+    uint32_t needs[MAX_COMMANDS];       // Pré-requisitos (bit i = posição i)
+    uint32_t done;                      // Terminaram com sucesso
+    uint32_t failed;                    // Falharam, não arrancaram ou foram ignorados
+    long start_ms[MAX_COMMANDS];        // Lançado (0 = nunca)
+    long end_ms[MAX_COMMANDS];
+    long begin_ms;                      // Chegada da mensagem
+    int order[MAX_COMMANDS];            // Posições pela ordem de lançamento
+    int num_released;
+    int num_skipped;
+    int rejected;                       // Grafo inválido: tudo é ignorado
+};
+
+int dag_held_jobs = 0;        // Jobs em held[] de todas as batches
+int dag_upgrade_deferred = 0; // Pedido de atualização à espera de dag_held_jobs == 0
+
+/*
+ * Mensagem com %after que chegou com uma atualização pendente
+ */
+struct parked_message {
+    struct parked_message *next;
+    int len;
+    char text[];
+};
+
+struct parked_message *parked_head = NULL;
+struct parked_message *parked_tail = NULL;
+int num_parked = 0;
+
+/*
+ * Guarda uma cópia da mensagem para depois da atualização.
+ * Retorna 0 ou -1 (sem memória: a mensagem é processada já).
+ */
+int dag_park(const char *buffer, int len) {
+    struct parked_message *msg = malloc(sizeof(struct parked_message) + len + 1);
+    if (msg == NULL) return -1;
+    msg->next = NULL;
+    msg->len = len;
+    memcpy(msg->text, buffer, len);
+    msg->text[len] = '\0';
+
+    if (parked_tail != NULL) parked_tail->next = msg;
+    else parked_head = msg;
+    parked_tail = msg;
+    num_parked++;
+    return 0;
+}
+
+struct dag *dag_create(void) {
+    struct dag *dag = calloc(1, sizeof(struct dag));
+    if (dag == NULL) {
+        print_error("calloc");
+        return NULL;
+    }
+    dag->begin_ms = now_ms();
+    return dag;
+}
+
+/*
+ * A mensagem usa %after? Só conta nas diretivas do início de cada comando
+ * (como em job_parse()), não nos argumentos: "grep %after= notas" não é
+ * um grafo. Corre antes do strtok_r, com a mensagem ainda inteira.
+ */
+int message_has_after(const char *buffer) {
+    for (const char *cmd = buffer; *cmd != '\0'; ) {
+        cmd += strspn(cmd, " ");
+        while (*cmd == '%' && strncmp(cmd, INVOKE_PREFIX, strlen(INVOKE_PREFIX)) != 0 &&
+               strncmp(cmd, PREPARE_PREFIX, strlen(PREPARE_PREFIX)) != 0) {
+            if (strncmp(cmd, AFTER_PREFIX, strlen(AFTER_PREFIX)) == 0) return 1;
+            cmd += strcspn(cmd, " ;");
+            cmd += strspn(cmd, " ");
+        }
+        cmd += strcspn(cmd, ";");
+        if (*cmd == ';') cmd++;
+    }
+    return 0;
+}
+
+/*
+ * Guarda o job da próxima posição. job = NULL: o comando não deu um job
+ * (conta como falhado, exceto um %prepare), mas o seu %step continua a
+ * poder ser usado como pré-requisito.
+ */
+void dag_add(struct dag *dag, struct job *job, const char *cmd) {
+    int i = dag->count++;
+    if (job == NULL) {
+        if (strncmp(cmd, PREPARE_PREFIX, strlen(PREPARE_PREFIX)) == 0) {
+            dag->done |= 1u << i;
+            return;
+        }
+        dag->failed |= 1u << i;
+        for (; *cmd == '%'; cmd += strspn(cmd, " ")) {
+            int len = strcspn(cmd, " ");
+            if (strncmp(cmd, STEP_PREFIX, strlen(STEP_PREFIX)) == 0) {
+                free(dag->steps[i]);
+                dag->steps[i] = strndup(cmd + strlen(STEP_PREFIX), len - strlen(STEP_PREFIX));
+            }
+            cmd += len;
+        }
+        return;
+    }
+    dag->held[i] = job;
+    dag->ids[i] = job->id;
+    if (job->step != NULL) dag->steps[i] = strdup(job->step);
+    dag->labels[i] = strdup(job->step != NULL ? job->step : job->cmd);
+    dag_held_jobs++;
+}
+
+/*
+ * Traduz os "%after=" em needs[]. Retorna 0, ou -1 com a razão em *why
+ * (nome desconhecido, posição fora da mensagem, nome repetido, ciclo).
+ */
+int dag_resolve(struct dag *dag, const char **why) {
+    for (int i = 0; i < dag->count; i++) {
+        if (dag->steps[i] == NULL) continue;
+        for (int j = 0; j < i; j++) {
+            if (dag->steps[j] != NULL && strcmp(dag->steps[i], dag->steps[j]) == 0) {
+                *why = "nome de %step repetido";
+                return -1;
+            }
+        }
+    }
+
+    for (int i = 0; i < dag->count; i++) {
+        struct job *job = dag->held[i];
+        if (job == NULL || job->after == NULL) continue;
+
+        const char *p = job->after;
+        while (*p != '\0') {
+            int len = strcspn(p, ",");
+            int target = -1;
+
+            int digits = len > 0 && (int)strspn(p, "0123456789") >= len;
+            if (digits) {
+                target = atoi(p) - 1;
+                if (target < 0 || target >= dag->count) {
+                    *why = "posição fora da mensagem";
+                    return -1;
+                }
+            } else {
+                for (int j = 0; j < dag->count; j++) {
+                    const char *step = dag->steps[j];
+                    if (step != NULL && (int)strlen(step) == len && strncmp(step, p, len) == 0) {
+                        target = j;
+                        break;
+                    }
+                }
+                if (target == -1) {
+                    *why = "pré-requisito desconhecido";
+                    return -1;
+                }
+            }
+            if (target == i) {
+                *why = "comando depende de si próprio";
+                return -1;
+            }
+            dag->needs[i] |= 1u << target;
+
+            p += len;
+            if (*p == ',') p++;
+        }
+    }
+
+    // Ciclos: retira repetidamente os comandos sem pré-requisitos por
+    // retirar (algoritmo de Kahn); se sobrar algum, há um ciclo
+    uint32_t all = dag->count == 32 ? ~0u : (1u << dag->count) - 1;
+    uint32_t removed = dag->done | dag->failed;
+    int progress = 1;
+    while (removed != all && progress) {
+        progress = 0;
+        for (int i = 0; i < dag->count; i++) {
+            if (!(removed & (1u << i)) && (dag->needs[i] & ~removed) == 0) {
+                removed |= 1u << i;
+                progress = 1;
+            }
+        }
+    }
+    if (removed != all) {
+        *why = "as dependências formam um ciclo";
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Tira o job da posição i de held[] (lançado ou ignorado)
+ */
+struct job *dag_take(struct dag *dag, int i) {
+    struct job *job = dag->held[i];
+    dag->held[i] = NULL;
+    dag_held_jobs--;
+    if (dag_held_jobs == 0 && dag_upgrade_deferred) {
+        upgrade_handler(SIGHUP);  // Acorda o ciclo para a atualização adiada
+    }
+    return job;
+}
+
+/*
+ * Não corre um job à espera: regista-o no log e desconta-o da batch
+ * (o que ignora também os que dependem dele)
+ */
+void dag_skip(struct dag *dag, int i, const char *why) {
+    struct job *job = dag_take(dag, i);
+    dag->num_skipped++;
+
+    char log_entry[512];
+    int len = append_str(log_entry, 0, sizeof(log_entry) - 1, job->cmd);
+    len = append_str(log_entry, len, sizeof(log_entry) - 1, "; ignorado: ");
+    len = append_str(log_entry, len, sizeof(log_entry) - 1, why);
+    log_entry[len++] = '\n';
+    log_entry[len] = '\0';
+
+    print_str("[Servidor] ");
+    print_str(log_entry);
+    append_log(log_entry);
+
+    batch_job_done(job, 0);
+    job_free(job);
+}
+
+/*
+ * Ignora os jobs à espera de um pré-requisito que falhou
+ */
+void dag_skip_failed(struct dag *dag) {
+    for (int i = 0; i < dag->count; i++) {
+        if (dag->held[i] != NULL && (dag->needs[i] & dag->failed) != 0) {
+            dag_skip(dag, i, "dependência falhou");
+        }
+    }
+}
+
+/*
+ * Lança os jobs cujos pré-requisitos já terminaram todos com sucesso.
+ * job_start() pode acabar logo (builtin, cache) e voltar a chamar esta
+ * função; held[] é relido a cada volta, por isso não há problema.
+ */
+void dag_release(struct dag *dag) {
+    for (int i = 0; i < dag->count; i++) {
+        if (dag->held[i] == NULL || (dag->needs[i] & ~dag->done) != 0) continue;
+
+        struct job *job = dag_take(dag, i);
+        dag->start_ms[i] = now_ms();
+        dag->order[dag->num_released++] = i;
+        job->submit_ms = dag->start_ms[i];  // O tempo à espera não é fila
+        job_start(job);
+    }
+}
+
+/*
+ * Chamada por batch_job_done() antes de descontar o job
+ */
+void dag_job_done(struct job *job, int launched) {
+    struct dag *dag = job->batch->dag;
+    int i = 0;
+    while (i < dag->count && dag->ids[i] != job->id) i++;
+    if (i == dag->count || dag->held[i] == job) return;  // Ainda não está no grafo
+
+    dag->end_ms[i] = now_ms();
+    if (dag->rejected) return;
+    if (launched && job->status == 0) {
+        dag->done |= 1u << i;
+        dag_release(dag);
+        return;
+    }
+
+    dag->failed |= 1u << i;
+    dag_skip_failed(dag);
+}
+
+/*
+ * Grafo inválido: nenhum dos comandos corre
+ */
+void dag_reject(struct dag *dag, const char *why) {
+    print_err("[Servidor] %after: ");
+    print_err(why);
+    print_err("; a mensagem não foi executada.\n");
+
+    dag->rejected = 1;
+    for (int i = 0; i < dag->count; i++) {
+        if (dag->held[i] != NULL) dag_skip(dag, i, why);
+    }
+}
+
+/*
+ * Fim da batch: escreve no log o caminho crítico do grafo, ex:
+ *   %after: 3 comando(s), caminho crítico 2004 ms (a > b > link), total 2006 ms, 0 ignorado(s)
+ * (sem "; ", para não ser confundida com a linha de um job)
+ */
+void dag_report(struct batch *batch) {
+    struct dag *dag = batch->dag;
+    batch->dag = NULL;
+
+    // cp[i]: a cadeia mais longa que acaba em i (os pré-requisitos são
+    // sempre lançados antes, por isso basta seguir order[])
+    long cp[MAX_COMMANDS] = {0};
+    int prev[MAX_COMMANDS];
+    int last = -1;
+    long end = dag->begin_ms;
+    for (int k = 0; k < dag->num_released; k++) {
+        int i = dag->order[k];
+        prev[i] = -1;
+        for (int j = 0; j < dag->count; j++) {
+            if ((dag->needs[i] & (1u << j)) && (prev[i] == -1 || cp[j] > cp[prev[i]])) {
+                prev[i] = j;
+            }
+        }
+        cp[i] = dag->end_ms[i] - dag->start_ms[i] + (prev[i] != -1 ? cp[prev[i]] : 0);
+        if (last == -1 || cp[i] >= cp[last]) last = i;  // Empate: o mais fundo
+        if (dag->end_ms[i] > end) end = dag->end_ms[i];
+    }
+
+    int path[MAX_COMMANDS];
+    int path_len = 0;
+    for (int i = last; i != -1; i = prev[i]) path[path_len++] = i;
+
+    char line[512];
+    int size = sizeof(line) - 1;
+    int len = append_str(line, 0, size, "%after: ");
+    len = append_int(line, len, size, dag->num_released);
+    len = append_str(line, len, size, " comando(s), caminho crítico ");
+    len = append_int(line, len, size, last != -1 ? cp[last] : 0);
+    len = append_str(line, len, size, " ms (");
+    while (path_len > 0) {
+        len = append_str(line, len, size, dag->labels[path[--path_len]]);
+        if (path_len > 0) len = append_str(line, len, size, " > ");
+    }
+    len = append_str(line, len, size, "), total ");
+    len = append_int(line, len, size, end - dag->begin_ms);
+    len = append_str(line, len, size, " ms, ");
+    len = append_int(line, len, size, dag->num_skipped);
+    len = append_str(line, len, size, " ignorado(s)");
+    line[len++] = '\n';
+    line[len] = '\0';
+
+    print_str("[Servidor] ");
+    print_str(line);
+    append_log(line);
+
+    for (int i = 0; i < dag->count; i++) {
+        free(dag->steps[i]);
+        free(dag->labels[i]);
+    }
+    free(dag);
+}
+
+/*
+ * ============================================================================
+ * FUNÇÃO: job_finished
+ * ============================================================================
+ *
+ * OBJETIVO:
+ * Regista no log um job que terminou e liberta os seus recursos.
+ *
+ * PARÂMETROS:
+ *   - job: o job que terminou
+ *   - status: estado de saída no formato do waitpid()
+ *
+ * WIFEXITED(status): verifica se o filho terminou normalmente
+ * WEXITSTATUS(status): obtém o código de saída (0 = sucesso)
+ *
+ * Está dividida em duas partes porque, com --loop threads, o registo
+ * (job_log) é feito pelo reaper e as contas (job_retire) pela receção,
+ * que é a única thread que mexe em running[], na fila e nas batches.
+ */
+void job_log(struct job *job, int status) {
+    if (job->pid > 0 && !job->shared) TRACE(TRACE_RUN, 'e', job->id, NULL);
+    TRACE(TRACE_EXIT, 'i', job->id, NULL);
+
+    // --executor: o estado que volta ao dispatcher (lido só no fim da batch)
+    job->batch->status = status;
+
+    // Prepara a entrada para o log
+    char log_entry[512];
+    int len = format_log_entry(log_entry, sizeof(log_entry), job->cmd, status, job->place);
+
+    /*
+     * Notas no fim da linha:
+     *   "; cache"                   %cache: respondido sem correr
+     *   "; partilhado (pid 1234)"   %coalesce: o estado veio de outro job
+     *   "; remoto: host:porta"      --nodes: correu noutro servidor
+     */
+    char notes[128];
+    int n = append_str(notes, 0, sizeof(notes), "");
+    if (job->cached) {
+        n = append_str(notes, n, sizeof(notes), "; cache");
+    }
+    if (job->shared) {
+        n = append_str(notes, n, sizeof(notes), "; partilhado");
+        if (job->shared_pid > 0) {
+            n = append_str(notes, n, sizeof(notes), " (pid ");
+            n = append_int(notes, n, sizeof(notes), job->shared_pid);
+            n = append_str(notes, n, sizeof(notes), ")");
+        }
+    }
+    if (job->remote) {
+        n = append_str(notes, n, sizeof(notes), "; remoto: ");
+        n = append_str(notes, n, sizeof(notes), node_name(job->remote - 1));
+    }
+    if (n > 0) {
+        len = append_str(log_entry, len - 1, sizeof(log_entry) - 1, notes);
+        log_entry[len++] = '\n';
+        log_entry[len] = '\0';
+    }
+
+    // Mostra e guarda o resultado
+    print_str("[Servidor] ");
+    print_str(log_entry);
+    append_log(log_entry);
+
+    // --watch só é tocado pela receção: com --loop threads, os jobs que o
+    // reaper regista são publicados em job_retire()
+    if (loop_backend != BACKEND_THREADS || job->pid <= 0) {
+        watch_publish(job, status);
+    }
+}
+
+void job_retire(struct job *job) {
+    placement_release(job->place);
+
+    // Retira o job de running[] (o último ocupa o seu lugar)
+    struct job *last = running[--num_running];
+    running[job->slot] = last;
+    last->slot = job->slot;
+
+    if (loop_backend == BACKEND_THREADS && job->pid > 0) {
+        watch_publish(job, job->status);
+    }
+
+    // pid <= 0: o dispatcher não conseguiu lançar o comando
+    cache_store(job);
+    if (job->pid > 0) retain_job(job);
+    coalesce_release(job, job->pid > 0);
+    batch_job_done(job, job->pid > 0);
+    job_free(job);
+
+    start_queued_jobs();
+}
+
+void job_finished(struct job *job, int status) {
+    job->status = status;
+    cache_collect(job);
+    job_log(job, status);
+    job_retire(job);
+}
+
+/*
+ * Um builtin terminou: não há processo nem lugar em running[] para
+ * libertar, só o registo e a batch
+ */
+void builtin_job_done(struct job *job, int status) {
+    job->status = status;
+    cache_collect(job);
+    job_log(job, status);
+    cache_store(job);
+    retain_job(job);
+    coalesce_release(job, 1);
+    batch_job_done(job, 1);
+    job_free(job);
+}
+
+void builtin_sleep_done(void *arg) {
+    builtin_job_done(arg, 0);
+}
+
+/*
+ * Tenta correr o comando de um job como builtin.
+ * Retorna 1 se correu (ou, no caso do sleep, ficou agendado),
+ * 0 se tem de ser lançado com fork()/execvp().
+ */
+int job_run_builtin(struct job *job) {
+    char *cmd = job->cmd;
+    while (*cmd == ' ') cmd++;
+    if (strlen(cmd) > MAX_CMD_LENGTH) return 0;  // execute_command() dá o erro
+
+    char cmd_copy[512];
+    strncpy(cmd_copy, cmd, sizeof(cmd_copy) - 1);
+    cmd_copy[sizeof(cmd_copy) - 1] = '\0';
+
+    char *args[32];
+    if (split_command(cmd_copy, args) == 0) return 0;
+
+    struct builtin *builtin = builtin_lookup(args[0]);
+    if (builtin == NULL) return 0;
+
+    long delay_ms = 0;
+    int out_fd = job->out_fd != -1 ? job->out_fd : STDOUT_FILENO;
+    int code = builtin->run(args, out_fd, &delay_ms);
+    if (code == BUILTIN_INCOMPATIBLE ||
+        (delay_ms > 0 && timer_add(delay_ms, builtin_sleep_done, job) == -1)) {
+        builtin->fallbacks++;
+        metrics_changed();
+        return 0;
+    }
+
+    builtin->runs++;
+    metrics_changed();
+
+    job->place = -1;
+    if (delay_ms == 0) {
+        builtin_job_done(job, code << 8);  // Formato do waitpid()
+    }
+    return 1;
+}
+
+/*
+ * Procura o job de um PID (ciclo clássico, depois do waitpid)
+ */
+struct job *find_job(pid_t pid) {
+    for (int i = 0; i < num_running; i++) {
+        if (running[i]->pid == pid) return running[i];
+    }
+    return NULL;
+}
+
+/*
+ * ============================================================================
+ * FUNÇÃO: reap_children (ciclo clássico)
+ * ============================================================================
+ *
+ * Recolhe TODOS os filhos que já terminaram, sem bloquear.
+ *
+ * IMPORTANTE: Usamos waitpid(-1, ...) para recolher QUALQUER filho que
+ * termine, não por uma ordem específica. Isto permite que os comandos
+ * executem verdadeiramente em paralelo.
+ *
+ * waitpid(-1, &status, WNOHANG) retorna:
+ *   > 0: PID do filho que terminou
+ *   0: nenhum filho terminou ainda
+ *   -1: erro (ex: não há mais filhos)
+ */
+void reap_children(void) {
+    int status;
+    pid_t pid;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        struct job *job = find_job(pid);
+
+        // Se não encontrou o PID (erro improvável), continua
+        if (job == NULL) {
+            print_err("[Servidor] Aviso: PID terminado não encontrado\n");
+            continue;
+        }
+        job_finished(job, status);
+    }
+}
+
+/*
+ * ============================================================================
+ * CONTROLO ADAPTATIVO DA CONCORRÊNCIA (--adaptive)
+ * ============================================================================
+ *
+ * OBJETIVO:
+ * Um limite fixo de jobs em simultâneo está sempre errado para alguém:
+ * baixo demais deixa cores parados, alto demais põe a máquina em
+ * thrashing quando os jobs usam muita memória ou I/O.
+ *
+ * COMO FUNCIONA (AIMD, como o controlo de congestão do TCP):
+ * A cada CONCURRENCY_INTERVAL_MS medimos a pressão da máquina:
+ *   - PSI: /proc/pressure/{cpu,memory,io}, linha "some ... total=N"
+ *     (microssegundos em que alguma tarefa esteve parada à espera do
+ *     recurso). Pressão = aumento de total / duração do intervalo,
+ *     o pior dos três recursos.
+ *   - Sem PSI (kernel antigo ou desligado): processos prontos a correr
+ *     (/proc/loadavg) acima do número de CPUs.
+ *
+ *   pressão > alvo              -> limite = limite * 3/4  (desce depressa)
+ *   pressão <= alvo e há fila   -> limite = limite + 1    (sobe devagar)
+ *
+ * O limite fica entre 1 e --max-inflight (omissão: MAX_JOBS) e vai para o
+ * ficheiro de métricas. Sem --adaptive, --max-inflight é um limite fixo.
+ */
+#define CONCURRENCY_INTERVAL_MS 250
+#define PSI_RESOURCES 3
+
+#define PRESSURE_PSI     0
+#define PRESSURE_LOADAVG 1
+
+const char *psi_paths[PSI_RESOURCES] = {
+    "/proc/pressure/cpu", "/proc/pressure/memory", "/proc/pressure/io"
+};
+
+int adaptive_active = 0;          // --adaptive
+int max_inflight = MAX_JOBS;      // --max-inflight
+int target_pressure = 10;         // --target-pressure (%)
+int pressure_source = PRESSURE_PSI;
+int pressure_pct = 0;             // Última medição (%)
+int online_cpus = 1;
+long psi_last[PSI_RESOURCES];     // Último total=N de cada recurso
+long pressure_last_ms = 0;
+
+/*
+ * total=N da linha "some" (a primeira), ou -1
+ */
+long psi_total(const char *path) {
+    char buf[256];
+    if (read_small_file(path, buf, sizeof(buf)) <= 0) return -1;
+
+    char *total = strstr(buf, "total=");
+    return total != NULL ? atol(total + 6) : -1;
+}
+
+/*
+ * Pressão (%) desde a última medição, ou -1 se ainda não há intervalo
+ */
+int pressure_sample(void) {
+    long now = now_ms();
+    long elapsed_us = (now - pressure_last_ms) * 1000;
+    int first = pressure_last_ms == 0;
+    pressure_last_ms = now;
+
+    if (pressure_source == PRESSURE_PSI) {
+        int worst = 0;
+        for (int r = 0; r < PSI_RESOURCES; r++) {
+            long total = psi_total(psi_paths[r]);
+            if (total < 0) continue;
+            if (!first && elapsed_us > 0) {
+                int pct = (total - psi_last[r]) * 100 / elapsed_us;
+                if (pct > worst) worst = pct;
+            }
+            psi_last[r] = total;
+        }
+        return first ? -1 : worst;
+    }
+
+    // "0.52 0.58 0.59 3/345 12345": 3 prontos a correr (incluindo nós)
+    char buf[128];
+    if (read_small_file("/proc/loadavg", buf, sizeof(buf)) <= 0) return -1;
+    char *slash = strchr(buf, '/');
+    if (slash == NULL) return -1;
+    char *start = slash;
+    while (start > buf && start[-1] != ' ') start--;
+
+    int excess = atoi(start) - 1 - online_cpus;
+    int sample = excess > 0 ? excess * 100 / online_cpus : 0;
+    return (pressure_pct + sample) / 2;  // Uma só amostra é muito instável
+}
+
+void concurrency_adjust(void *arg) {
+    (void)arg;
+
+    int pressure = pressure_sample();
+    if (pressure >= 0) {
+        pressure_pct = pressure;
+        int old_limit = job_limit;
+
+        if (pressure > target_pressure) {
+            job_limit = job_limit * 3 / 4;
+        } else if (queue_head != NULL && num_running >= job_limit) {
+            job_limit++;
+        }
+        if (job_limit < 1) job_limit = 1;
+        if (job_limit > max_inflight) job_limit = max_inflight;
+
+        if (job_limit > old_limit) start_queued_jobs();
+        metrics_changed();
+    }
+    timer_add(CONCURRENCY_INTERVAL_MS, concurrency_adjust, NULL);
+}
+
+void concurrency_init(void) {
+    job_limit = max_inflight;
+    if (!adaptive_active) return;
+
+    online_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (online_cpus < 1) online_cpus = 1;
+    if (psi_total(psi_paths[0]) < 0) pressure_source = PRESSURE_LOADAVG;
+
+    // Começa com um job por CPU; o AIMD ajusta a partir daí
+    if (online_cpus < job_limit) job_limit = online_cpus;
+    pressure_sample();
+    timer_add(CONCURRENCY_INTERVAL_MS, concurrency_adjust, NULL);
+
+    print_str("[Servidor] Concorrência adaptativa (");
+    print_str(pressure_source == PRESSURE_PSI ? "PSI" : "loadavg");
+    print_str("): limite inicial ");
+    print_int(STDOUT_FILENO, job_limit);
+    print_str(", pressão alvo ");
+    print_int(STDOUT_FILENO, target_pressure);
+    print_str("%.\n");
+}
+
+/*
+ * Linhas do ficheiro de métricas (ver metrics_flush)
+ */
+int concurrency_metrics(char *buf, int pos, int size) {
+    if (!adaptive_active && max_inflight == MAX_JOBS) return pos;
+
+    pos = append_str(buf, pos, size, "concurrency.limit=");
+    pos = append_int(buf, pos, size, job_limit);
+    pos = append_str(buf, pos, size, "\n");
+    if (adaptive_active) {
+        pos = append_str(buf, pos, size, "concurrency.pressure=");
+        pos = append_int(buf, pos, size, pressure_pct);
+        pos = append_str(buf, pos, size, "\nconcurrency.source=");
+        pos = append_str(buf, pos, size, pressure_source == PRESSURE_PSI ? "psi" : "loadavg");
+        pos = append_str(buf, pos, size, "\n");
+    }
+    return pos;
+}
+
+
+/*
+ * ============================================================================
+ * FUNÇÃO: process_message
+ * ============================================================================
+ *
+ * OBJETIVO:
+ * Processa uma mensagem completa ("cmd1;cmd2;..."): lança todos os
+ * comandos em paralelo. Os resultados são registados por job_finished()
+ * quando cada comando terminar.
+ *
+ * A mensagem pode ter chegado pelo FIFO ou pelo anel em memória
+ * partilhada (--ring) - o tratamento é o mesmo.
+ *
+ * PARÂMETROS:
+ *   - buffer: mensagem terminada em '\0' (é modificada pelo strtok_r)
+ */
+void process_message(char *buffer) {
+    TRACE(TRACE_RECEIVE, 'B', 0, NULL);
+    print_str("[Servidor] Mensagem recebida: '");
+    print_str(buffer);
+    print_str("'\n");
+
+    // Atualização pendente: um grafo novo podia adiá-la para sempre
+    int has_after = message_has_after(buffer);
+    if (has_after && (upgrade_requested || dag_upgrade_deferred) &&
+        dag_park(buffer, strlen(buffer)) == 0) {
+        print_str("[Servidor] Mensagem com %after guardada para depois da atualização.\n");
+        TRACE(TRACE_RECEIVE, 'E', 0, NULL);
+        return;
+    }
+
+    struct batch *batch = calloc(1, sizeof(struct batch));
+    if (batch == NULL) {
+        print_error("calloc");
+        TRACE(TRACE_RECEIVE, 'E', 0, NULL);
+        return;
+    }
+
+    // %after: os jobs são só criados aqui e lançados por dag_release()
+    if (has_after) {
+        batch->dag = dag_create();
+    }
+
+    /*
+     * ================================================================
+     * PARSING NÍVEL 1: Separar os comandos por ';'
+     * ================================================================
+     * 
+     * Exemplo: "ls -la;pwd;date" é separado em:
+     *   - "ls -la"
+     *   - "pwd"
+     *   - "date"
+     * 
+     * Usamos strtok_r() em vez de strtok() porque é mais seguro
+     * (strtok_r usa saveptr para guardar o estado)
+     */
+    char *saveptr1;
+    char *cmd = strtok_r(buffer, ";", &saveptr1);
+    int num_commands = 0;
+
+    /*
+     * A batch conta como "em curso" enquanto ainda estamos a lançar os
+     * comandos, para não ser libertada se algum falhar logo no início.
+     */
+    batch->remaining = 1;
+
+    while (cmd != NULL && num_commands < MAX_COMMANDS &&
+           (batch->dag == NULL || batch->dag->count < MAX_COMMANDS)) {
+        // Remove espaços no início do comando
+        while (*cmd == ' ') cmd++;
+        
+        // Se o comando não está vazio, executa-o (cria processo filho)
+        if (strlen(cmd) > 0 && batch->dag != NULL) {
+            struct job *job = job_parse(cmd, batch);
+            dag_add(batch->dag, job, cmd);
+            if (job != NULL) num_commands++;
+        } else if (strlen(cmd) > 0 && job_submit(cmd, batch) == 0) {
+            num_commands++;
+        }
+        
+        // Próximo comando
+        cmd = strtok_r(NULL, ";", &saveptr1);
+    }
+
+    print_str("[Servidor] A executar ");
+    print_int(STDOUT_FILENO, num_commands);
+    print_str(" comando(s)...\n");
+
+    if (batch->dag != NULL) {
+        const char *why;
+        if (dag_resolve(batch->dag, &why) == -1) {
+            dag_reject(batch->dag, why);
+        } else {
+            dag_skip_failed(batch->dag);  // Comandos que nem chegaram a ser jobs
+            dag_release(batch->dag);
+        }
+    }
+
+    batch->remaining--;
+    if (batch->remaining == 0) {
+        if (batch->dag != NULL) dag_report(batch);
+        free(batch);  // Nenhum comando ficou a correr
+    }
+    TRACE(TRACE_RECEIVE, 'E', 0, NULL);
+}
+
+/*
+ * Processa as mensagens guardadas por dag_park() (depois da atualização,
+ * ou se ela falhou)
+ */
+void dag_unpark(void) {
+    // Tira a lista toda primeiro: com outra atualização pedida, as
+    // mensagens voltam a ser guardadas numa lista nova
+    struct parked_message *msg = parked_head;
+    parked_head = parked_tail = NULL;
+    num_parked = 0;
+
+    while (msg != NULL) {
+        struct parked_message *next = msg->next;
+        process_message(msg->text);
+        free(msg);
+        msg = next;
+    }
+}
+
+
+/*
+ * ============================================================================
+ * LEITURA DO FIFO (UMA MENSAGEM POR LINHA)
+ * ============================================================================
+ *
+ * Vários clientes podem escrever no FIFO ao mesmo tempo e um read() pode
+ * trazer mais do que uma mensagem, ou só parte de uma. Por isso os
+ * clientes terminam cada mensagem com '\n' e aqui juntamos os bytes até
+ * termos linhas completas.
+ *
+ * Compatibilidade: se o escritor fechar o FIFO (EOF) com bytes sem '\n'
+ * pendentes, tratamos esses bytes como uma mensagem (protocolo antigo).
+ */
+char fifo_pending[MAX_BUFFER];  // Bytes lidos que ainda não formam uma linha
+int fifo_pending_len = 0;
+
+/*
+ * Processa todas as linhas completas em fifo_pending[]
+ */
+void dispatch_fifo_lines(void) {
+    char message[MAX_BUFFER];
+    int start = 0;
+
+    for (int i = 0; i < fifo_pending_len; i++) {
+        if (fifo_pending[i] != '\n') continue;
+
+        int len = i - start;
+        memcpy(message, fifo_pending + start, len);
+        message[len] = '\0';
+        if (len > 0) process_message(message);
+        start = i + 1;
+    }
+
+    // Guarda o resto (linha incompleta) no início do buffer
+    fifo_pending_len -= start;
+    memmove(fifo_pending, fifo_pending + start, fifo_pending_len);
+
+    // Linha maior que o buffer: não vai caber nunca, processa o que temos
+    if (fifo_pending_len == MAX_BUFFER - 1) {
+        memcpy(message, fifo_pending, fifo_pending_len);
+        message[fifo_pending_len] = '\0';
+        fifo_pending_len = 0;
+        process_message(message);
+    }
+}
+
+/*
+ * Junta bytes lidos do FIFO (por read() ou pelo io_uring) e processa
+ * as mensagens que ficarem completas
+ */
+void on_fifo_data(const char *data, int len) {
+    while (len > 0) {
+        int room = sizeof(fifo_pending) - 1 - fifo_pending_len;
+        int n = len < room ? len : room;
+
+        memcpy(fifo_pending + fifo_pending_len, data, n);
+        fifo_pending_len += n;
+        data += n;
+        len -= n;
+        dispatch_fifo_lines();
+    }
+}
+
+/*
+ * ================================================================
+ * Cliente fechou o FIFO (EOF)
+ * ================================================================
+ * Quando o cliente fecha a sua ponta do FIFO, read() retorna 0.
+ * Processamos os bytes pendentes (mensagem sem '\n') e temos de
+ * fechar e reabrir o FIFO para aceitar novos clientes.
+ */
+void on_fifo_eof(void) {
+    if (fifo_pending_len > 0) {
+        char message[MAX_BUFFER];
+        memcpy(message, fifo_pending, fifo_pending_len);
+        message[fifo_pending_len] = '\0';
+        fifo_pending_len = 0;
+        process_message(message);
+    }
+
+    print_str("[Servidor] Cliente terminou a escrita. A reabrir FIFO...\n");
+    close(server_fd);
+    server_fd = open(fifo_path, O_RDONLY | O_NONBLOCK);
+}
+
+
+/*
+ * ============================================================================
+ * ANEL EM MEMÓRIA PARTILHADA (--ring)
+ * ============================================================================
+ *
+ * O ciclo principal espera no poll() pelo FIFO. O anel não tem um fd, por
+ * isso uma thread "vigia" dorme no futex do anel (ring_wait) e, quando
+ * chegam frames, acorda o ciclo principal escrevendo num eventfd.
+ *
+ * A vigia só volta a dormir no anel depois de o ciclo principal o ter
+ * esvaziado (ring_armed = 1). Enquanto o servidor está ocupado, o anel
+ * está marcado como não-idle e os produtores não fazem syscall nenhuma.
+ */
+struct exec_ring *ring = NULL;
+int ring_event_fd = -1;                 // eventfd: vigia -> ciclo principal
+_Atomic uint32_t ring_armed = 1;        // 1 = vigia deve esperar no anel
+
+void *ring_watcher(void *arg) {
+    (void)arg;
+    uint64_t one = 1;
+
+    for (;;) {
+        // Espera que o ciclo principal acabe de esvaziar o anel
+        while (atomic_load(&ring_armed) == 0) {
+            exec_futex_wait(&ring_armed, 0);
+        }
+
+        ring_wait(ring);
+        atomic_store(&ring_armed, 0);
+        write(ring_event_fd, &one, sizeof(one));
+    }
+    return NULL;
+}
+
+/*
+ * Cria o anel e arranca a vigia. Se falhar, o servidor continua só
+ * com o FIFO (os clientes fazem o mesmo).
+ */
+int upgrade_fd = -1;  // --upgrade-fd (interno): estado herdado da versão anterior
+
+void ring_start(void) {
+    // Numa atualização, o anel (com os frames por ler) continua o mesmo
+    if (upgrade_fd != -1) ring = ring_reopen();
+    if (ring == NULL) ring = ring_create();
+    if (ring == NULL) {
+        print_error("Anel indisponível (a usar só o FIFO)");
+        use_ring = 0;
+        return;
+    }
+
+    ring_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pthread_t thread;
+    if (ring_event_fd == -1 || pthread_create(&thread, NULL, ring_watcher, NULL) != 0) {
+        print_error("Vigia do anel");
+        ring_destroy(ring);
+        ring = NULL;
+        use_ring = 0;
+        return;
+    }
+    pthread_detach(thread);
+
+    print_str("[Servidor] Anel em memória partilhada ativo (/dev/shm");
+    print_str(RING_NAME);
+    print_str(").\n");
+}
+
+/*
+ * Processa todos os frames do anel e volta a armar a vigia
+ */
+void drain_ring(void) {
+    char message[RING_SLOT_SIZE];
+    uint64_t counter;
+
+    read(ring_event_fd, &counter, sizeof(counter));  // Limpa o eventfd
+
+    while (ring_pop(ring, message, sizeof(message)) >= 0) {
+        if (message[0] != '\0') process_message(message);
+    }
+
+    atomic_store(&ring_armed, 1);
+    exec_futex_wake(&ring_armed);
+}
+
+
+/*
+ * ============================================================================
+ * VÁRIOS SERVIDORES EM REDE (--executor / --nodes)
+ * ============================================================================
+ *
+ * OBJETIVO:
+ * Uma máquina não chega para os picos. Um servidor com --nodes distribui
+ * os jobs por outros servidores ("executores", arrancados com --executor)
+ * através de ligações TCP persistentes:
+ *
+ *   clientes --FIFO--> dispatcher --TCP--> executor 127.0.0.1:7001
+ *                                 --TCP--> executor 127.0.0.1:7002
+ *
+ * PROTOCOLO (uma mensagem por linha, como no FIFO):
+ *   dispatcher -> executor:  "J <id> <comando>"   corre este comando
+ *   executor -> dispatcher:  "S <livres>"          lugares livres
+ *                            "D <id> <estado>"     terminou (formato waitpid)
+ *
+ * - O executor anuncia os lugares livres (job_limit - a correr, 0 se tiver
+ *   fila) quando um dispatcher se liga e sempre que o valor muda.
+ * - O dispatcher manda cada job para onde houver mais lugares livres,
+ *   contando com ele próprio (em empate corre localmente). Se não houver
+ *   lugar em lado nenhum, o job fica na fila.
+ * - O resultado fica no log do dispatcher com "; remoto: host:porta"
+ *   (e também no log do executor).
+ * - Se a ligação a um nó cair, os jobs que lá estavam voltam para o início
+ *   da fila e o dispatcher tenta religar-se a cada NODE_RETRY_MS. Um job
+ *   pode assim correr duas vezes (se o nó caiu depois de o lançar).
+ * - As ligações não passam por uma atualização (SIGHUP): ela espera que
+ *   terminem os jobs remotos, nos dois sentidos (net_busy). Entretanto o
+ *   executor anuncia 0 lugares e o dispatcher não envia jobs novos.
+ *
+ * Todos os sockets estão num epoll: os ciclos de eventos só vigiam o fd
+ * do epoll (tal como o eventfd do anel) e chamam net_process().
+ *
+ * ATENÇÃO: o executor corre qualquer comando que lhe chegue, sem
+ * autenticação. Por isso, só com a porta ("--executor 7001") fica só em
+ * 127.0.0.1; para o abrir à rede é preciso dar o endereço
+ * ("--executor 10.0.0.2:7001" ou "0.0.0.0:7001").
+ */
+#define MAX_PEERS 32
+#define PEER_BUFFER (4 * MAX_BUFFER)
+#define NODE_RETRY_MS 1000
+
+struct peer {
+    int fd;                 // -1 = desligado
+    int id;                 // Muda a cada ligação
+    int is_node;            // 1 = executor a que nos ligámos (--nodes)
+    int connecting;         // connect() ainda a decorrer
+    int warned;             // Já avisámos que o nó não responde
+    char name[64];          // "host:porta"
+    struct sockaddr_in addr;
+    int free_slots;         // Nó: lugares livres (anunciados - enviados)
+    int reported;           // Dispatcher: último "S" enviado (-1 = nenhum)
+    struct job *inflight;   // Nó: jobs enviados por terminar (mais recente primeiro)
+    char in[PEER_BUFFER];   // Bytes recebidos que ainda não formam uma linha
+    int in_len;
+    char *out;              // Bytes por enviar (o socket estava cheio)
+    int out_len;
+    int out_cap;
+    int want_out;           // EPOLLOUT ativo
+};
+
+struct peer nodes[MAX_PEERS];         // --nodes (somos o dispatcher)
+int num_nodes = 0;
+struct peer dispatchers[MAX_PEERS];   // Ligados a nós (somos executor)
+int net_epoll_fd = -1;
+int listen_fd = -1;
+const char *executor_addr = NULL;     // --executor [ENDEREÇO:]PORTA
+const char *nodes_list = NULL;        // --nodes host:porta,host:porta
+int next_peer_id = 1;
+long next_remote_id = 1;
+int executor_batches = 0;             // Jobs pedidos por dispatchers, por responder
+int net_upgrade_deferred = 0;         // Atualização à espera de net_busy() == 0
+
+/*
+ * Há uma atualização pedida ou adiada: não aceitamos nem enviamos jobs
+ * remotos novos
+ */
+int upgrade_pending(void) {
+    return upgrade_requested || dag_upgrade_deferred || net_upgrade_deferred;
+}
+
+/*
+ * Há jobs remotos a meio (pedidos por um dispatcher, enviados a um nó, ou
+ * uma resposta por enviar)? Uma atualização fecha as ligações: o
+ * dispatcher voltava a mandar os jobs e eles corriam duas vezes.
+ */
+int net_busy(void) {
+    if (executor_batches > 0) return 1;
+    for (int i = 0; i < num_nodes; i++) {
+        if (nodes[i].inflight != NULL) return 1;
+    }
+    for (int i = 0; i < MAX_PEERS; i++) {
+        if (dispatchers[i].fd != -1 && dispatchers[i].out_len > 0) return 1;
+    }
+    return 0;
+}
+
+const char *node_name(int node) {
+    return nodes[node].name;
+}
+
+/*
+ * "host:porta" ou "porta" -> endereço IPv4. Retorna 0 ou -1.
+ */
+int parse_addr(const char *str, const char *default_host, struct sockaddr_in *addr) {
+    char host[64];
+    const char *colon = strrchr(str, ':');
+    const char *port = colon != NULL ? colon + 1 : str;
+
+    if (colon != NULL) {
+        int len = colon - str < (int)sizeof(host) - 1 ? colon - str : (int)sizeof(host) - 1;
+        memcpy(host, str, len);
+        host[len] = '\0';
+    } else {
+        append_str(host, 0, sizeof(host), default_host);
+    }
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (atoi(port) <= 0 || getaddrinfo(host, NULL, &hints, &res) != 0) return -1;
+
+    *addr = *(struct sockaddr_in *)res->ai_addr;
+    addr->sin_port = htons(atoi(port));
+    freeaddrinfo(res);
+    return 0;
+}
+
+void peer_watch(struct peer *p, int op) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | (p->want_out ? EPOLLOUT : 0);
+    ev.data.ptr = p;
+    epoll_ctl(net_epoll_fd, op, p->fd, &ev);
+}
+
+/*
+ * Envia o que estiver em p->out. Se o socket encher, o resto vai quando
+ * o epoll disser EPOLLOUT. Num erro fecha só o envio: quem trata da
+ * ligação perdida é net_process() (evita mexer na fila a meio de um
+ * start_queued_jobs()).
+ */
+void peer_flush(struct peer *p) {
+    int sent = 0;
+    while (sent < p->out_len) {
+        ssize_t n = send(p->fd, p->out + sent, p->out_len - sent, MSG_NOSIGNAL);
+        if (n > 0) {
+            sent += n;
+        } else if (n == -1 && errno == EINTR) {
+            continue;
+        } else {
+            if (n == -1 && errno != EAGAIN) {
+                shutdown(p->fd, SHUT_RDWR);
+                sent = p->out_len;
+            }
+            break;
+        }
+    }
+    memmove(p->out, p->out + sent, p->out_len - sent);
+    p->out_len -= sent;
+
+    int want_out = p->out_len > 0;
+    if (want_out != p->want_out) {
+        p->want_out = want_out;
+        peer_watch(p, EPOLL_CTL_MOD);
+    }
+}
+
+void peer_send(struct peer *p, const char *data, int len) {
+    if (p->fd == -1) return;
+
+    if (p->out_len + len > p->out_cap) {
+        int cap = p->out_cap > 0 ? p->out_cap * 2 : MAX_BUFFER;
+        while (cap < p->out_len + len) cap *= 2;
+        char *out = realloc(p->out, cap);
+        if (out == NULL) {
+            shutdown(p->fd, SHUT_RDWR);
+            return;
+        }
+        p->out = out;
+        p->out_cap = cap;
+    }
+    memcpy(p->out + p->out_len, data, len);
+    p->out_len += len;
+
+    if (!p->connecting) peer_flush(p);
+}
+
+void node_connect(struct peer *p);
+
+void node_retry(void *arg) {
+    struct peer *p = arg;
+    if (p->fd == -1) node_connect(p);
+}
+
+void node_connect(struct peer *p) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd != -1 && connect(fd, (struct sockaddr *)&p->addr, sizeof(p->addr)) == -1 &&
+        errno != EINPROGRESS) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd == -1) {
+        timer_add(NODE_RETRY_MS, node_retry, p);
+        return;
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    p->fd = fd;
+    p->id = next_peer_id++;
+    p->connecting = 1;
+    p->free_slots = 0;
+    p->want_out = 1;  // Avisa quando o connect() terminar
+    peer_watch(p, EPOLL_CTL_ADD);
+}
+
+/*
+ * Fecha a ligação. Num nó, os jobs que lá estavam voltam para a fila.
+ */
+void peer_drop(struct peer *p) {
+    epoll_ctl(net_epoll_fd, EPOLL_CTL_DEL, p->fd, NULL);
+    close(p->fd);
+    p->fd = -1;
+    p->in_len = 0;
+    p->out_len = 0;
+    p->want_out = 0;
+
+    if (!p->is_node) {
+        print_str("[Servidor] Dispatcher ");
+        print_str(p->name);
+        print_str(" desligou-se.\n");
+        return;
+    }
+
+    if (!p->connecting || !p->warned) {
+        print_err("[Servidor] Aviso: sem ligação ao nó ");
+        print_err(p->name);
+        print_err("; a tentar de novo.\n");
+        p->warned = 1;
+    }
+    p->connecting = 0;
+    p->free_slots = 0;
+
+    // inflight está do mais recente para o mais antigo: pô-los um a um à
+    // frente da fila deixa o mais antigo em primeiro
+    int requeued = 0;
+    while (p->inflight != NULL) {
+        struct job *job = p->inflight;
+        p->inflight = job->next;
+        job->remote = 0;
+        job->next = queue_head;
+        queue_head = job;
+        if (queue_tail == NULL) queue_tail = job;
+        requeued++;
+    }
+    if (requeued > 0) {
+        print_str("[Servidor] ");
+        print_int(STDOUT_FILENO, requeued);
+        print_str(" job(s) do nó voltaram para a fila.\n");
+    }
+
+    timer_add(NODE_RETRY_MS, node_retry, p);
+    start_queued_jobs();
+}
+
+/*
+ * ================================================================
+ * Lado do dispatcher (--nodes)
+ * ================================================================
+ */
+
+/*
+ * Nó com mais lugares livres, se tiver mais do que este servidor.
+ * Retorna o índice ou -1 (corre localmente / fica na fila).
+ */
+int node_better(void) {
+    if (upgrade_pending()) return -1;  // Corre cá: passa para a versão nova
+
+    int best = -1;
+    for (int i = 0; i < num_nodes; i++) {
+        if (nodes[i].fd == -1 || nodes[i].connecting || nodes[i].free_slots <= 0) continue;
+        if (best == -1 || nodes[i].free_slots > nodes[best].free_slots) best = i;
+    }
+    if (best == -1) return -1;
+
+    int local_free = job_limit - num_running;
+    return nodes[best].free_slots > local_free ? best : -1;
+}
+
+void remote_submit(struct job *job, int node) {
+    struct peer *p = &nodes[node];
+
+    job->remote = node + 1;
+    job->remote_id = next_remote_id++;
+    job->next = p->inflight;
+    p->inflight = job;
+    p->free_slots--;
+
+    char line[MAX_BUFFER + 32];
+    int len = append_str(line, 0, sizeof(line), "J ");
+    len = append_int(line, len, sizeof(line), job->remote_id);
+    len = append_str(line, len, sizeof(line), " ");
+    len = append_str(line, len, sizeof(line), job->cmd);
+    len = append_str(line, len, sizeof(line), "\n");
+    peer_send(p, line, len);
+}
+
+void remote_job_done(struct job *job, int status) {
+    job->status = status;
+    job_log(job, status);
+    coalesce_release(job, 1);
+    batch_job_done(job, 1);
+    job_free(job);
+}
+
+void node_line(struct peer *p, char *line) {
+    if (line[0] == 'S' && line[1] == ' ') {
+        p->free_slots = atoi(line + 2);
+        start_queued_jobs();
+    } else if (line[0] == 'D' && line[1] == ' ') {
+        char *end;
+        long id = strtol(line + 2, &end, 10);
+        int status = atoi(end);
+
+        for (struct job **j = &p->inflight; *j != NULL; j = &(*j)->next) {
+            if ((*j)->remote_id == id) {
+                struct job *job = *j;
+                *j = job->next;
+                remote_job_done(job, status);
+                break;
+            }
+        }
+    }
+}
+
+/*
+ * ================================================================
+ * Lado do executor (--executor)
+ * ================================================================
+ */
+
+/*
+ * Lugares livres que anunciamos aos dispatchers
+ */
+int local_free_slots(void) {
+    if (queue_head != NULL || launch_paused || upgrade_pending()) return 0;
+    return num_running < job_limit ? job_limit - num_running : 0;
+}
+
+void executor_line(struct peer *p, char *line) {
+    if (line[0] != 'J' || line[1] != ' ') return;
+
+    char *cmd;
+    long id = strtol(line + 2, &cmd, 10);
+    while (*cmd == ' ') cmd++;
+
+    struct batch *batch = calloc(1, sizeof(struct batch));
+    if (batch == NULL) {
+        print_error("calloc");
+        return;
+    }
+    batch->origin = p->id;
+    batch->origin_id = id;
+    batch->status = 127 << 8;  // Se não chegar a correr
+    executor_batches++;
+
+    batch->remaining = 1;  // Guarda, como em process_message()
+    job_submit(cmd, batch);
+    batch->remaining--;
+    if (batch->remaining == 0) batch_finish(batch);
+}
+
+/*
+ * Um job pedido por um dispatcher terminou: "D <id> <estado>"
+ */
+void executor_reply(struct batch *batch) {
+    executor_batches--;
+    for (int i = 0; i < MAX_PEERS; i++) {
+        struct peer *p = &dispatchers[i];
+        if (p->fd == -1 || p->id != batch->origin) continue;
+
+        char line[64];
+        int len = append_str(line, 0, sizeof(line), "D ");
+        len = append_int(line, len, sizeof(line), batch->origin_id);
+        len = append_str(line, len, sizeof(line), " ");
+        len = append_int(line, len, sizeof(line), batch->status);
+        len = append_str(line, len, sizeof(line), "\n");
+        peer_send(p, line, len);
+        return;
+    }
+    // O dispatcher já se desligou: já pôs o job noutro lado
+}
+
+void executor_accept(void) {
+    for (;;) {
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        int fd = accept4(listen_fd, (struct sockaddr *)&addr, &addr_len,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) return;
+
+        struct peer *p = NULL;
+        for (int i = 0; i < MAX_PEERS && p == NULL; i++) {
+            if (dispatchers[i].fd == -1) p = &dispatchers[i];
+        }
+        if (p == NULL) {
+            close(fd);
+            continue;
+        }
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        p->fd = fd;
+        p->id = next_peer_id++;
+        p->reported = -1;
+        p->in_len = 0;
+        p->out_len = 0;
+        p->want_out = 0;
+        inet_ntop(AF_INET, &addr.sin_addr, p->name, sizeof(p->name) - 8);
+        int len = strlen(p->name);
+        len = append_str(p->name, len, sizeof(p->name), ":");
+        append_int(p->name, len, sizeof(p->name), ntohs(addr.sin_port));
+        peer_watch(p, EPOLL_CTL_ADD);
+
+        print_str("[Servidor] Dispatcher ");
+        print_str(p->name);
+        print_str(" ligado.\n");
+    }
+}
+
+/*
+ * ================================================================
+ * Ciclo de eventos
+ * ================================================================
+ */
+
+/*
+ * Lê o que chegou e trata as linhas completas. Retorna -1 se a ligação
+ * terminou.
+ */
+int peer_read(struct peer *p) {
+    for (;;) {
+        ssize_t n = read(p->fd, p->in + p->in_len, PEER_BUFFER - p->in_len);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1 && errno == EAGAIN) return 0;
+        if (n <= 0) return -1;
+        p->in_len += n;
+
+        int start = 0;
+        for (int i = 0; i < p->in_len; i++) {
+            if (p->in[i] != '\n') continue;
+            p->in[i] = '\0';
+            if (p->is_node) node_line(p, p->in + start);
+            else executor_line(p, p->in + start);
+            start = i + 1;
+        }
+        memmove(p->in, p->in + start, p->in_len - start);
+        p->in_len -= start;
+
+        if (p->in_len == PEER_BUFFER) return -1;  // Linha longa demais
+    }
+}
+
+int watch_event(void *ptr, uint32_t events);  // Secção --watch
+void watch_init(void);
+
+/*
+ * Trata os eventos dos sockets (o fd do epoll ficou pronto)
+ */
+void net_process(void) {
+    struct epoll_event events[64];
+    int n;
+
+    do {
+        n = epoll_wait(net_epoll_fd, events, 64, 0);
+        for (int i = 0; i < n; i++) {
+            struct peer *p = events[i].data.ptr;
+            if (p == NULL) {
+                executor_accept();
+                continue;
+            }
+            if (watch_event(p, events[i].events)) continue;  // --watch
+            if (p->fd == -1) continue;  // Fechado por um evento anterior
+
+            if (p->connecting && (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+                int err = 0;
+                socklen_t err_len = sizeof(err);
+                getsockopt(p->fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+                if (err != 0) {
+                    peer_drop(p);
+                    continue;
+                }
+                p->connecting = 0;
+                p->warned = 0;
+                print_str("[Servidor] Ligado ao nó ");
+                print_str(p->name);
+                print_str(".\n");
+                peer_flush(p);
+            }
+
+            if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && peer_read(p) == -1) {
+                peer_drop(p);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                peer_flush(p);
+            }
+        }
+    } while (n == 64);
+}
+
+/*
+ * Antes de esperar por eventos: anuncia os lugares livres a quem mudou
+ */
+void net_flush(void) {
+    if (net_upgrade_deferred && !net_busy()) {
+        upgrade_handler(SIGHUP);  // Acorda o ciclo para a atualização adiada
+    }
+    if (listen_fd == -1) return;
+
+    int free_slots = local_free_slots();
+    for (int i = 0; i < MAX_PEERS; i++) {
+        struct peer *p = &dispatchers[i];
+        if (p->fd == -1 || p->reported == free_slots) continue;
+
+        char line[32];
+        int len = append_str(line, 0, sizeof(line), "S ");
+        len = append_int(line, len, sizeof(line), free_slots);
+        len = append_str(line, len, sizeof(line), "\n");
+        peer_send(p, line, len);
+        p->reported = free_slots;
+    }
+}
+
+/*
+ * Cria o epoll, o socket do executor (se não veio de uma atualização),
+ * as ligações aos nós e o socket do --watch
+ */
+void net_init(void) {
+    for (int i = 0; i < MAX_PEERS; i++) dispatchers[i].fd = -1;
+    if (executor_addr == NULL && nodes_list == NULL && !watch_enabled) return;
+
+    net_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (net_epoll_fd == -1) {
+        print_error("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+
+    if (executor_addr != NULL) {
+        if (listen_fd == -1) {
+            struct sockaddr_in addr;
+            int one = 1;
+            if (parse_addr(executor_addr, "127.0.0.1", &addr) == -1) {
+                print_err("[Servidor] Erro: endereço inválido em --executor\n");
+                exit(EXIT_FAILURE);
+            }
+            listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (listen_fd == -1 ||
+                setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1 ||
+                bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+                listen(listen_fd, 64) == -1) {
+                print_error("Erro no socket do executor");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;  // NULL = socket de escuta
+        epoll_ctl(net_epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+
+        print_str("[Servidor] Executor: à escuta em ");
+        print_str(executor_addr);
+        print_str(".\n");
+    }
+
+    if (nodes_list != NULL) {
+        char list[MAX_BUFFER];
+        append_str(list, 0, sizeof(list), nodes_list);
+
+        char *saveptr;
+        for (char *item = strtok_r(list, ",", &saveptr); item != NULL && num_nodes < MAX_PEERS;
+             item = strtok_r(NULL, ",", &saveptr)) {
+            struct peer *p = &nodes[num_nodes];
+            if (parse_addr(item, "127.0.0.1", &p->addr) == -1) {
+                print_err("[Servidor] Erro: nó inválido em --nodes: ");
+                print_err(item);
+                print_err("\n");
+                exit(EXIT_FAILURE);
+            }
+            append_str(p->name, 0, sizeof(p->name), item);
+            p->fd = -1;
+            p->is_node = 1;
+            num_nodes++;
+            node_connect(p);
+        }
+    }
+
+    if (watch_enabled) {
+        watch_init();
+    }
+}
+
+
+/*
+ * ============================================================================
+ * RESULTADOS EM DIRETO PARA MONITORES (--watch)
+ * ============================================================================
+ *
+ * OBJETIVO:
+ * Dashboards e alertas faziam "tail -f logs/server.log" e voltavam a
+ * interpretar o texto. Com --watch, o servidor aceita subscritores no
+ * socket Unix WATCH_PATH (/tmp/exec_watch.sock) e manda a cada um uma
+ * linha JSON por cada job que termina, no momento em que termina:
+ *
+ *   {"id":17,"time":1760774400123,"cmd":"make -j4","client":"ci",
+ *    "pid":4242,"exit":0,"signal":null,"duration_ms":1520,"queue_ms":0,
+ *    "spawn_us":310,"cached":false,"shared":false,"remote":null,"dropped":0}
+ *
+ * queue_ms é o tempo na fila (--max-inflight, jobs a correr) e spawn_us
+ * quanto demorou o fork() + exec no servidor (null se não houve fork).
+ *
+ * FILTROS (linhas enviadas pelo subscritor, a qualquer altura):
+ *   cmd=TEXTO      só comandos que contêm TEXTO
+ *   client=NOME    só pedidos de "./client --name NOME" (ou NOME.qualquer)
+ *   exit=N         só exit status N ("exit=!0" = só falhas)
+ * Uma linha com o valor vazio ("cmd=") tira esse filtro.
+ *   ready          o servidor responde {"ready":true}: os filtros das
+ *                  linhas anteriores já estão ativos (quem submete logo
+ *                  a seguir, como o "./client --map", espera por isto)
+ *
+ * OUTPUT GUARDADO (--retain, ./client --fetch):
+ *   fetch=ID       pede o output do job ID (ou do último com esse --name)
+ * A resposta é uma linha {"fetch":"ID","found":true,"id":...,"bytes":N}
+ * seguida dos N bytes do output, e o servidor fecha a ligação. A partir
+ * do pedido a ligação deixa de receber registos (os que já estavam por
+ * enviar são descartados, menos um que esteja a meio).
+ *
+ * SUBSCRITORES LENTOS:
+ * Cada subscritor tem um anel de WATCH_RING registos. O servidor nunca
+ * espera por ele: escreve o que o socket aceitar e, se o anel encher,
+ * descarta o registo mais antigo. "dropped" é o total de registos que
+ * esse subscritor já perdeu (um salto no valor = houve perdas).
+ *
+ * Os sockets estão no mesmo epoll dos nós (--nodes / --executor).
+ * Os registos são criados só pela receção (ver job_log()).
+ */
+#define MAX_SUBSCRIBERS 32
+#define WATCH_RING 1024
+
+struct subscriber {
+    int fd;                 // -1 = livre
+    char *ring[WATCH_RING]; // Linhas por enviar (a mais antiga em head)
+    int head;
+    int count;
+    int offset;             // Bytes de ring[head] já enviados
+    long dropped;
+    int want_out;           // EPOLLOUT ativo
+    int read_closed;        // Já não manda filtros
+    char filter_cmd[128];
+    char filter_client[64];
+    int filter_exit;        // -1 = qualquer
+    int filter_exit_not;    // "exit=!N"
+    char in[256];           // Linha de filtro ainda incompleta
+    int in_len;
+    int fetching;           // fetch=ID: resposta a caminho, depois fecha
+    int fetch_fd;           // Output por enviar (-1 = nenhum)
+    off_t fetch_off;
+};
+
+struct subscriber subscribers[MAX_SUBSCRIBERS];
+int watch_enabled = 0;                // --watch (usa o epoll da secção dos nós)
+
+int json_str(char *buf, int pos, int size, const char *str) {
+    if (str == NULL) return append_str(buf, pos, size, "null");
+
+    pos = append_str(buf, pos, size, "\"");
+    for (; *str != '\0' && pos < size - 8; str++) {
+        unsigned char c = *str;
+        if (c == '"' || c == '\\') {
+            buf[pos++] = '\\';
+            buf[pos++] = c;
+        } else if (c < 0x20) {
+            const char hex[] = "0123456789abcdef";
+            pos = append_str(buf, pos, size, "\\u00");
+            buf[pos++] = hex[c >> 4];
+            buf[pos++] = hex[c & 15];
+        } else {
+            buf[pos++] = c;
+        }
+    }
+    buf[pos] = '\0';
+    return append_str(buf, pos, size, "\"");
+}
+
+void watch_events(struct subscriber *sub) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = (sub->read_closed ? 0 : EPOLLIN) | (sub->want_out ? EPOLLOUT : 0);
+    ev.data.ptr = sub;
+    epoll_ctl(net_epoll_fd, EPOLL_CTL_MOD, sub->fd, &ev);
+}
+
+void watch_drop(struct subscriber *sub) {
+    epoll_ctl(net_epoll_fd, EPOLL_CTL_DEL, sub->fd, NULL);
+    close(sub->fd);
+    sub->fd = -1;
+    if (sub->fetch_fd != -1) close(sub->fetch_fd);
+    while (sub->count > 0) {
+        free(sub->ring[sub->head]);
+        sub->head = (sub->head + 1) % WATCH_RING;
+        sub->count--;
+    }
+    num_subscribers--;
+    metrics_changed();
+}
+
+/*
+ * Escreve o que o socket aceitar, sem bloquear
+ */
+void watch_flush(struct subscriber *sub) {
+    while (sub->count > 0) {
+        char *line = sub->ring[sub->head];
+        int len = strlen(line) - sub->offset;
+        ssize_t n = send(sub->fd, line + sub->offset, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1 && errno == EAGAIN) break;
+        if (n <= 0) {
+            watch_drop(sub);
+            return;
+        }
+        if (n < len) {
+            sub->offset += n;
+            break;
+        }
+        free(line);
+        sub->head = (sub->head + 1) % WATCH_RING;
+        sub->count--;
+        sub->offset = 0;
+    }
+
+    // fetch=ID: depois do cabeçalho vai o output; no fim fecha a ligação
+    while (sub->fetching && sub->count == 0) {
+        ssize_t n = 0;
+        if (sub->fetch_fd != -1) {
+            n = sendfile(sub->fd, sub->fetch_fd, &sub->fetch_off, MAX_BUFFER * 16);
+        }
+        if (n > 0 || (n == -1 && errno == EINTR)) continue;
+        if (n == -1 && errno == EAGAIN) break;
+        watch_drop(sub);
+        return;
+    }
+
+    int want_out = sub->count > 0 || sub->fetching;
+    if (want_out != sub->want_out) {
+        sub->want_out = want_out;
+        watch_events(sub);
+    }
+}
+
+int watch_matches(struct subscriber *sub, struct job *job, int status) {
+    if (sub->filter_cmd[0] != '\0' && strstr(job->cmd, sub->filter_cmd) == NULL) return 0;
+    if (sub->filter_client[0] != '\0') {
+        int len = strlen(sub->filter_client);
+        if (job->client == NULL || strncmp(job->client, sub->filter_client, len) != 0 ||
+            (job->client[len] != '\0' && job->client[len] != '.')) {
+            return 0;
+        }
+    }
+    if (sub->filter_exit != -1) {
+        int code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+        if ((code == sub->filter_exit) == sub->filter_exit_not) return 0;
+    }
+    return 1;
+}
+
+/*
+ * Um job terminou: manda o registo a quem o quiser
+ */
+void watch_publish(struct job *job, int status) {
+    if (num_subscribers == 0) return;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    // Tudo menos "dropped", que é de cada subscritor
+    char record[2 * MAX_BUFFER];
+    int pos = append_str(record, 0, sizeof(record), "{\"id\":");
+    pos = append_int(record, pos, sizeof(record), job->id);
+    pos = append_str(record, pos, sizeof(record), ",\"time\":");
+    pos = append_int(record, pos, sizeof(record), ts.tv_sec * 1000L + ts.tv_nsec / 1000000);
+    pos = append_str(record, pos, sizeof(record), ",\"cmd\":");
+    pos = json_str(record, pos, sizeof(record), job->cmd);
+    pos = append_str(record, pos, sizeof(record), ",\"client\":");
+    pos = json_str(record, pos, sizeof(record), job->client);
+    pos = append_str(record, pos, sizeof(record), ",\"pid\":");
+    pos = append_int(record, pos, sizeof(record), job->shared ? job->shared_pid : job->pid);
+    pos = append_str(record, pos, sizeof(record), ",\"exit\":");
+    if (WIFEXITED(status)) pos = append_int(record, pos, sizeof(record), WEXITSTATUS(status));
+    else pos = append_str(record, pos, sizeof(record), "null");
+    pos = append_str(record, pos, sizeof(record), ",\"signal\":");
+    if (WIFSIGNALED(status)) pos = append_int(record, pos, sizeof(record), WTERMSIG(status));
+    else pos = append_str(record, pos, sizeof(record), "null");
+    pos = append_str(record, pos, sizeof(record), ",\"duration_ms\":");
+    pos = append_int(record, pos, sizeof(record), now_ms() - job->submit_ms);
+    pos = append_str(record, pos, sizeof(record), ",\"queue_ms\":");
+    pos = append_int(record, pos, sizeof(record), job->queue_ms);
+    pos = append_str(record, pos, sizeof(record), ",\"spawn_us\":");
+    if (job->pid > 0 && !job->shared) pos = append_int(record, pos, sizeof(record), job->spawn_us);
+    else pos = append_str(record, pos, sizeof(record), "null");
+    pos = append_str(record, pos, sizeof(record), job->cached ? ",\"cached\":true" : ",\"cached\":false");
+    pos = append_str(record, pos, sizeof(record), job->shared ? ",\"shared\":true" : ",\"shared\":false");
+    pos = append_str(record, pos, sizeof(record), ",\"remote\":");
+    pos = json_str(record, pos, sizeof(record), job->remote ? node_name(job->remote - 1) : NULL);
+
+    int published = 0;
+    for (int i = 0; i < MAX_SUBSCRIBERS; i++) {
+        struct subscriber *sub = &subscribers[i];
+        if (sub->fd == -1 || sub->fetching || !watch_matches(sub, job, status)) continue;
+
+        // Anel cheio: sai o mais antigo (se ainda não começou a ser enviado)
+        if (sub->count == WATCH_RING) {
+            int oldest = sub->offset > 0 ? (sub->head + 1) % WATCH_RING : sub->head;
+            free(sub->ring[oldest]);
+            if (oldest != sub->head) sub->ring[oldest] = sub->ring[sub->head];
+            sub->head = (sub->head + 1) % WATCH_RING;
+            sub->count--;
+            sub->dropped++;
+            watch_dropped++;
+        }
+
+        char tail[48];
+        int tlen = append_str(tail, 0, sizeof(tail), ",\"dropped\":");
+        tlen = append_int(tail, tlen, sizeof(tail), sub->dropped);
+        tlen = append_str(tail, tlen, sizeof(tail), "}\n");
+
+        char *line = malloc(pos + tlen + 1);
+        if (line == NULL) continue;
+        memcpy(line, record, pos);
+        memcpy(line + pos, tail, tlen + 1);
+        sub->ring[(sub->head + sub->count) % WATCH_RING] = line;
+        sub->count++;
+        published = 1;
+
+        watch_flush(sub);
+    }
+    if (published) {
+        watch_published++;
+        metrics_changed();
+    }
+}
+
+/*
+ * fetch=ID: põe a resposta no anel (sem os registos que lá estavam)
+ */
+void watch_fetch(struct subscriber *sub, const char *key) {
+    while (sub->count > (sub->offset > 0 ? 1 : 0)) {
+        int last = (sub->head + sub->count - 1) % WATCH_RING;
+        free(sub->ring[last]);
+        sub->count--;
+    }
+    sub->fetching = 1;
+    sub->read_closed = 1;
+
+    struct retained *e = retain_budget > 0 ? retain_find(key) : NULL;
+    if (e != NULL) sub->fetch_fd = retain_open(e);
+
+    char header[2 * MAX_BUFFER];
+    int pos = append_str(header, 0, sizeof(header), "{\"fetch\":");
+    pos = json_str(header, pos, sizeof(header), key);
+    if (sub->fetch_fd == -1) {
+        pos = append_str(header, pos, sizeof(header), ",\"found\":false}\n");
+    } else {
+        pos = append_str(header, pos, sizeof(header), ",\"found\":true,\"id\":");
+        pos = append_int(header, pos, sizeof(header), e->id);
+        pos = append_str(header, pos, sizeof(header), ",\"cmd\":");
+        pos = json_str(header, pos, sizeof(header), e->cmd);
+        pos = append_str(header, pos, sizeof(header), ",\"client\":");
+        pos = json_str(header, pos, sizeof(header), e->client);
+        pos = append_str(header, pos, sizeof(header), ",\"exit\":");
+        if (WIFEXITED(e->status)) pos = append_int(header, pos, sizeof(header), WEXITSTATUS(e->status));
+        else pos = append_str(header, pos, sizeof(header), "null");
+        pos = append_str(header, pos, sizeof(header), ",\"signal\":");
+        if (WIFSIGNALED(e->status)) pos = append_int(header, pos, sizeof(header), WTERMSIG(e->status));
+        else pos = append_str(header, pos, sizeof(header), "null");
+        pos = append_str(header, pos, sizeof(header), ",\"bytes\":");
+        pos = append_int(header, pos, sizeof(header), e->len);
+        pos = append_str(header, pos, sizeof(header), "}\n");
+    }
+
+    char *line = strdup(header);
+    if (line == NULL) return;  // Sem resposta: watch_flush() fecha a ligação
+    sub->ring[(sub->head + sub->count) % WATCH_RING] = line;
+    sub->count++;
+}
+
+/*
+ * "ready": confirma os filtros (a resposta segue com o próximo EPOLLOUT)
+ */
+void watch_ready(struct subscriber *sub) {
+    if (sub->count == WATCH_RING) return;
+    char *line = strdup("{\"ready\":true}\n");
+    if (line == NULL) return;
+    sub->ring[(sub->head + sub->count) % WATCH_RING] = line;
+    sub->count++;
+    if (!sub->want_out) {
+        sub->want_out = 1;
+        watch_events(sub);
+    }
+}
+
+/*
+ * "cmd=...", "client=...", "exit=N" / "exit=!N", "fetch=ID", "ready"
+ */
+void watch_filter(struct subscriber *sub, const char *line) {
+    if (strncmp(line, "cmd=", 4) == 0) {
+        append_str(sub->filter_cmd, 0, sizeof(sub->filter_cmd), line + 4);
+    } else if (strncmp(line, "client=", 7) == 0) {
+        append_str(sub->filter_client, 0, sizeof(sub->filter_client), line + 7);
+    } else if (strncmp(line, "exit=", 5) == 0) {
+        sub->filter_exit_not = line[5] == '!';
+        const char *value = line + 5 + sub->filter_exit_not;
+        sub->filter_exit = *value != '\0' ? atoi(value) : -1;
+    } else if (strncmp(line, "fetch=", 6) == 0) {
+        watch_fetch(sub, line + 6);
+    } else if (strcmp(line, "ready") == 0) {
+        watch_ready(sub);
+    }
+}
+
+void watch_read(struct subscriber *sub) {
+    for (;;) {
+        ssize_t n = read(sub->fd, sub->in + sub->in_len, sizeof(sub->in) - 1 - sub->in_len);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1 && errno == EAGAIN) return;
+        if (n <= 0) {
+            // Fechou a escrita (ou erro): continua a receber até EPOLLHUP
+            sub->read_closed = 1;
+            watch_events(sub);
+            return;
+        }
+        sub->in_len += n;
+
+        int start = 0;
+        for (int i = 0; i < sub->in_len && !sub->fetching; i++) {
+            if (sub->in[i] != '\n') continue;
+            sub->in[i] = '\0';
+            watch_filter(sub, sub->in + start);
+            start = i + 1;
+        }
+        if (sub->fetching) {
+            // O resto do que o subscritor mandar é ignorado
+            watch_events(sub);
+            watch_flush(sub);
+            return;
+        }
+        memmove(sub->in, sub->in + start, sub->in_len - start);
+        sub->in_len -= start;
+        if (sub->in_len == (int)sizeof(sub->in) - 1) sub->in_len = 0;  // Linha longa: ignora
+    }
+}
+
+void watch_accept(void) {
+    for (;;) {
+        int fd = accept4(watch_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) return;
+
+        struct subscriber *sub = NULL;
+        for (int i = 0; i < MAX_SUBSCRIBERS && sub == NULL; i++) {
+            if (subscribers[i].fd == -1) sub = &subscribers[i];
+        }
+        if (sub == NULL) {
+            close(fd);
+            continue;
+        }
+
+        memset(sub, 0, sizeof(*sub));
+        sub->fd = fd;
+        sub->filter_exit = -1;
+        sub->fetch_fd = -1;
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = sub;
+        epoll_ctl(net_epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+        num_subscribers++;
+        metrics_changed();
+    }
+}
+
+/*
+ * Evento do epoll para um subscritor (ou para o socket de escuta).
+ * Retorna 0 se ptr não é do --watch.
+ */
+int watch_event(void *ptr, uint32_t events) {
+    if (ptr == &watch_fd) {
+        watch_accept();
+        return 1;
+    }
+
+    struct subscriber *sub = ptr;
+    if (sub < subscribers || sub >= subscribers + MAX_SUBSCRIBERS) return 0;
+    if (sub->fd == -1) return 1;  // Fechado por um evento anterior
+
+    if (events & (EPOLLHUP | EPOLLERR)) {
+        watch_drop(sub);
+        return 1;
+    }
+    if (events & EPOLLIN) watch_read(sub);
+    if ((events & EPOLLOUT) && sub->fd != -1) watch_flush(sub);
+    return 1;
+}
+
+/*
+ * Cria o socket WATCH_PATH (ou usa o herdado numa atualização)
+ */
+void watch_init(void) {
+    for (int i = 0; i < MAX_SUBSCRIBERS; i++) subscribers[i].fd = -1;
+
+    if (watch_fd == -1) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        append_str(addr.sun_path, 0, sizeof(addr.sun_path), WATCH_PATH);
+
+        unlink(WATCH_PATH);  // Deixado por um servidor que não terminou bem
+        watch_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (watch_fd == -1 ||
+            bind(watch_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+            listen(watch_fd, 16) == -1) {
+            print_error("Erro no socket --watch");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = &watch_fd;
+    epoll_ctl(net_epoll_fd, EPOLL_CTL_ADD, watch_fd, &ev);
+
+    print_str("[Servidor] Resultados em direto em ");
+    print_str(WATCH_PATH);
+    print_str(" (./client --watch).\n");
+}
+
+/*
+ * ============================================================================
+ * SERVIDOR COM VÁRIAS THREADS (--loop threads)
+ * ============================================================================
+ *
+ * OBJETIVO:
+ * Nos outros ciclos, uma só thread lê mensagens, faz fork(), espera pelos
+ * filhos e escreve no log. O fork() de um servidor grande é caro e, com
+ * muitos clientes, é ele que limita o ritmo de submissão. Aqui o trabalho
+ * é dividido:
+ *
+ *   receção (thread principal): lê o FIFO/anel, separa os comandos,
+ *       escolhe a colocação e entrega cada job a um dispatcher
+ *       (round-robin). Também é a única que mexe em running[], na fila
+ *       de espera e nas batches.
+ *   dispatchers (--dispatchers N): fazem o fork()/execvp() em paralelo
+ *       e passam o job ao reaper.
+ *   reaper: espera (epoll) pelo pidfd de cada filho que os dispatchers
+ *       lançaram; escreve o registo no log e devolve o job à receção.
+ *
+ * As passagens são filas lock-free MPSC (mpsc.h), sem mutex: um push é
+ * uma troca atómica. Só se faz syscall para acordar uma thread parada
+ * (futex; no caso da receção e do reaper, um eventfd que o poll()/epoll
+ * vigia).
+ *
+ * O SIGCHLD fica com a ação por omissão: quem recolhe os filhos é o
+ * reaper, só os que lhe foram entregues (waitid(P_PIDFD)).
+ */
+#define MAX_DISPATCHERS 64
+#define REAPER_EVENTS 64        // Eventos por epoll_wait() do reaper
+#define REAPER_SLOW_MS 100      // Jobs sem pidfd: de quanto em quanto tempo ver
+
+int num_dispatchers = 2;                         // --dispatchers
+struct mpsc_queue dispatch_queues[MAX_DISPATCHERS];
+int next_dispatcher = 0;
+
+struct mpsc_queue reaper_queue;                  // Jobs lançados (dispatchers -> reaper)
+int reaper_event_fd = -1;                        // Acorda o epoll do reaper
+int reaper_epoll_fd = -1;                        // pidfds dos filhos + reaper_event_fd
+struct mpsc_queue done_queue;                    // Jobs terminados (-> receção)
+int done_event_fd = -1;                          // Acorda o poll() da receção
+
+/*
+ * Para a atualização (do_upgrade) é preciso parar as threads num ponto
+ * seguro: nenhum job a meio de um fork() e o reaper fora do waitid().
+ */
+_Atomic int dispatch_pending = 0;                // Jobs entregues e ainda sem fork()
+_Atomic uint32_t reaper_park = 0;                // 1 = o reaper deve parar
+_Atomic uint32_t reaper_parked = 0;              // 1 = o reaper está parado
+struct mpsc_node reaper_park_node;               // Acorda o reaper que espera no epoll
+pthread_t reaper;
+
+/*
+ * Receção: entrega o job ao próximo dispatcher
+ */
+void threads_dispatch(struct job *job) {
+    struct mpsc_queue *queue = &dispatch_queues[next_dispatcher];
+    next_dispatcher = (next_dispatcher + 1) % num_dispatchers;
+
+    atomic_fetch_add(&dispatch_pending, 1);
+    if (mpsc_push(queue, &job->node)) mpsc_wake(queue);
+}
+
+/*
+ * Entrega um nó ao reaper (um job lançado, ou o pedido de paragem)
+ */
+void reaper_push(struct mpsc_node *node) {
+    uint64_t one = 1;
+    if (mpsc_push(&reaper_queue, node)) {
+        write(reaper_event_fd, &one, sizeof(one));
+    }
+}
+
+/*
+ * Devolve um job terminado (ou que não arrancou) à receção
+ */
+void threads_done(struct job *job) {
+    uint64_t one = 1;
+    if (mpsc_push(&done_queue, &job->node)) {
+        write(done_event_fd, &one, sizeof(one));
+    }
+}
+
+void *dispatcher_thread(void *arg) {
+    struct mpsc_queue *queue = arg;
+    trace_thread_name("dispatcher");
+
+    for (;;) {
+        struct job *job = (struct job *)mpsc_wait(queue);
+        job->pid = job_fork(job);
+
+        if (job->pid > 0) {
+            reaper_push(&job->node);
+        } else {
+            threads_done(job);
+        }
+        atomic_fetch_sub(&dispatch_pending, 1);
+    }
+    return NULL;
+}
+
+/*
+ * ================================================================
+ * Reaper
+ * ================================================================
+ * Cada job que chega pela fila ganha um pidfd (pidfd_open), que fica no
+ * epoll do reaper junto com o reaper_event_fd. Assim:
+ * - um push na fila acorda logo o reaper, mesmo com outros filhos a
+ *   correr durante muito tempo;
+ * - um filho que termine antes de o job chegar continua por recolher
+ *   (zombie) até lá, e o pidfd fica logo pronto - não há órfãos;
+ * - só são recolhidos os filhos entregues pelos dispatchers.
+ * Se o pidfd_open() falhar (ex: sem fds), o job vai para reaper_slow e
+ * é visto com waitid(P_PID, WNOHANG) a cada REAPER_SLOW_MS.
+ */
+struct job *reaper_slow = NULL;
+
+int status_from_siginfo(const siginfo_t *info);  // Definida na secção do io_uring
+
+void reaper_finish(struct job *job, int status) {
+    job->status = status;  // Lido pela receção em job_retire()
+    cache_collect(job);
+    job_log(job, status);
+    threads_done(job);
+}
+
+/*
+ * Passa a vigiar o filho de um job lançado
+ */
+void reaper_add(struct job *job) {
+    job->pidfd = syscall(SYS_pidfd_open, job->pid, 0);
+    if (job->pidfd != -1) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = job };
+        if (epoll_ctl(reaper_epoll_fd, EPOLL_CTL_ADD, job->pidfd, &ev) == 0) return;
+        close(job->pidfd);
+        job->pidfd = -1;
+    }
+    print_error("pidfd_open");
+    job->hnext = reaper_slow;
+    reaper_slow = job;
+}
+
+/*
+ * O filho de um job terminou (ou, com WNOHANG, talvez ainda não).
+ * Retorna 1 se o job foi recolhido.
+ */
+int reaper_collect(struct job *job, int options) {
+    siginfo_t info;
+    info.si_pid = 0;
+    int r = job->pidfd != -1 ? waitid(P_PIDFD, job->pidfd, &info, WEXITED | options)
+                             : waitid(P_PID, job->pid, &info, WEXITED | options);
+    if (r == -1 && errno == EINTR) return 0;
+    if (r == 0 && info.si_pid == 0) return 0;  // WNOHANG: ainda a correr
+
+    if (r == -1) {
+        print_error("waitid");
+        info.si_code = CLD_KILLED;  // Não há estado; conta como anormal
+        info.si_status = SIGKILL;
+    }
+    if (job->pidfd != -1) {
+        // Um filho a meio de um fork() pode ter uma cópia do pidfd: o
+        // close() sozinho não o tiraria do epoll
+        epoll_ctl(reaper_epoll_fd, EPOLL_CTL_DEL, job->pidfd, NULL);
+        close(job->pidfd);
+    }
+    reaper_finish(job, status_from_siginfo(&info));
+    return 1;
+}
+
+/*
+ * Jobs novos da fila. mpsc_arm() vem antes de esvaziar a fila, para não
+ * perder nenhum aviso (como em drain_done_queue()).
+ */
+void reaper_drain_queue(void) {
+    uint64_t counter;
+    read(reaper_event_fd, &counter, sizeof(counter));  // Limpa o eventfd
+
+    mpsc_arm(&reaper_queue);
+    struct mpsc_node *node;
+    while ((node = mpsc_pop(&reaper_queue)) != NULL) {
+        if (node != &reaper_park_node) reaper_add((struct job *)node);
+    }
+}
+
+/*
+ * Pedido de paragem (atualização): fica parado até reaper_park voltar a 0
+ */
+void reaper_park_here(void) {
+    atomic_store(&reaper_parked, 1);
+    while (atomic_load(&reaper_park) == 1) {
+        exec_futex_wait(&reaper_park, 1);
+    }
+    atomic_store(&reaper_parked, 0);
+}
+
+void *reaper_thread(void *arg) {
+    (void)arg;
+    trace_thread_name("reaper");
+
+    for (;;) {
+        reaper_drain_queue();
+        if (atomic_load(&reaper_park) == 1) {
+            reaper_park_here();
+            continue;
+        }
+
+        for (struct job **p = &reaper_slow; *p != NULL;) {
+            struct job *job = *p;
+            *p = job->hnext;
+            if (!reaper_collect(job, WNOHANG)) {
+                job->hnext = *p;
+                *p = job;
+                p = &job->hnext;
+            }
+        }
+
+        struct epoll_event events[REAPER_EVENTS];
+        int n = epoll_wait(reaper_epoll_fd, events, REAPER_EVENTS,
+                           reaper_slow != NULL ? REAPER_SLOW_MS : -1);
+        if (n == -1 && errno != EINTR) print_error("epoll_wait");
+
+        for (int i = 0; i < n; i++) {
+            struct job *job = events[i].data.ptr;
+            if (job != NULL) reaper_collect(job, 0);  // NULL: reaper_event_fd
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Receção: trata os jobs que o reaper (ou um dispatcher) devolveu.
+ * mpsc_arm() vem antes de esvaziar a fila, para não perder nenhum aviso.
+ */
+void drain_done_queue(void) {
+    uint64_t counter;
+    read(done_event_fd, &counter, sizeof(counter));  // Limpa o eventfd
+
+    mpsc_arm(&done_queue);
+    struct mpsc_node *node;
+    while ((node = mpsc_pop(&done_queue)) != NULL) {
+        job_retire((struct job *)node);
+    }
+}
+
+/*
+ * Cria as filas e arranca as threads. Retorna o eventfd que a receção
+ * vigia, ou -1 se não foi possível.
+ */
+int threads_start(void) {
+    if (num_dispatchers < 1) num_dispatchers = 1;
+    if (num_dispatchers > MAX_DISPATCHERS) num_dispatchers = MAX_DISPATCHERS;
+
+    done_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (done_event_fd == -1) return -1;
+
+    reaper_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    reaper_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (reaper_event_fd == -1 || reaper_epoll_fd == -1) return -1;
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    if (epoll_ctl(reaper_epoll_fd, EPOLL_CTL_ADD, reaper_event_fd, &ev) == -1) return -1;
+
+    mpsc_init(&reaper_queue);
+    mpsc_init(&done_queue);
+    mpsc_arm(&reaper_queue);  // O reaper e a receção estão sempre "parados"
+    mpsc_arm(&done_queue);    // no epoll / no poll()
+
+    pthread_t thread;
+    for (int i = 0; i < num_dispatchers; i++) {
+        mpsc_init(&dispatch_queues[i]);
+        if (pthread_create(&thread, NULL, dispatcher_thread, &dispatch_queues[i]) != 0) {
+            return -1;
+        }
+        pthread_detach(thread);
+    }
+    if (pthread_create(&reaper, NULL, reaper_thread, NULL) != 0) return -1;
+    pthread_detach(reaper);
+
+    print_str("[Servidor] Ciclo de eventos: threads (");
+    print_int(STDOUT_FILENO, num_dispatchers);
+    print_str(" dispatcher(s) + reaper).\n");
+    return done_event_fd;
+}
+
+void sleep_ms(int ms) {
+    struct timespec ts = { ms / 1000, (long)(ms % 1000) * 1000000L };
+    nanosleep(&ts, NULL);
+}
+
+/*
+ * Atualização: espera que os dispatchers acabem os fork() pendentes e
+ * para o reaper. Depois disto running[] tem só jobs cujo filho ainda não
+ * foi recolhido (o processo novo espera por eles).
+ */
+void threads_quiesce(void) {
+    while (atomic_load(&dispatch_pending) > 0) {
+        sleep_ms(1);
+    }
+
+    // O nó na fila acorda o reaper no epoll; ele vê reaper_park e para
+    atomic_store(&reaper_park, 1);
+    reaper_push(&reaper_park_node);
+    while (atomic_load(&reaper_parked) == 0) {
+        sleep_ms(1);
+    }
+
+    // Jobs que o reaper já registou e ainda estavam na fila de fim
+    struct mpsc_node *node;
+    while ((node = mpsc_pop(&done_queue)) != NULL) {
+        job_retire((struct job *)node);
+    }
+}
+
+/*
+ * A atualização falhou: o reaper continua
+ */
+void threads_resume(void) {
+    atomic_store(&reaper_park, 0);
+    exec_futex_wake(&reaper_park);
+}
+
+
+/*
+ * ============================================================================
+ * CICLO DE EVENTOS CLÁSSICO (--loop classic, omissão)
+ * ============================================================================
+ *
+ * O servidor fica num ciclo infinito:
+ * 1. poll() espera por dados no FIFO, frames no anel (--ring), por um
+ *    aviso do SIGCHLD handler no sigchld_pipe ou pelo próximo temporizador
+ * 2. Recolhe os filhos que terminaram e regista-os no log
+ * 3. Lê as mensagens e lança os comandos
+ *
+ * Com --loop threads este é o ciclo da receção: em vez do sigchld_pipe
+ * vigia o eventfd da fila de jobs terminados.
+ *
+ * Se o servidor vier de uma atualização (--upgrade-fd), os jobs herdados
+ * são retomados antes da primeira iteração.
+ *
+ * O loop pode ser interrompido por:
+ * - Signal handler (SIGINT/SIGTERM)
+ * - Erro fatal na leitura
+ */
+void upgrade_restore_jobs(void);  // Definida na secção da atualização
+
+void run_classic_loop(void) {
+    int threaded = loop_backend == BACKEND_THREADS;
+    int wake_fd;
+
+    if (threaded) {
+        wake_fd = threads_start();
+        if (wake_fd == -1) {
+            print_error("Erro ao criar as threads");
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        if (pipe2(sigchld_pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+            print_error("pipe");
+            exit(EXIT_FAILURE);
+        }
+        signal(SIGCHLD, sigchld_handler);  // Previne zombies
+        wake_fd = sigchld_pipe[0];
+    }
+
+    if (upgrade_fd != -1) {
+        upgrade_restore_jobs();
+        // Filhos que terminaram durante o execve() não geraram aviso
+        if (!threaded) reap_children();
+    }
+
+    while (1) {
+        net_flush();  // --executor: lugares livres
+
+        /*
+         * EINTR acontece quando chega um sinal - basta voltar a esperar.
+         */
+        struct pollfd fds[5];
+        int nfds = 3;
+        int ring_idx = -1;
+        int net_idx = -1;
+        fds[0].fd = server_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = wake_fd;
+        fds[1].events = POLLIN;
+        fds[2].fd = upgrade_pipe[0];
+        fds[2].events = POLLIN;
+        if (use_ring) {
+            ring_idx = nfds++;
+            fds[ring_idx].fd = ring_event_fd;
+            fds[ring_idx].events = POLLIN;
+        }
+        if (net_epoll_fd != -1) {
+            net_idx = nfds++;
+            fds[net_idx].fd = net_epoll_fd;
+            fds[net_idx].events = POLLIN;
+        }
+
+        if (poll(fds, nfds, timer_timeout_ms()) == -1) {
+            if (errno == EINTR) continue;
+            print_error("poll");
+            break;
+        }
+
+        run_timers();  // Builtin sleep, métricas
+
+        if ((fds[1].revents & POLLIN) && threaded) {
+            drain_done_queue();
+        } else if (fds[1].revents & POLLIN) {
+            char drain[64];
+            while (read(sigchld_pipe[0], drain, sizeof(drain)) > 0) {
+                // Esvazia o pipe; vários SIGCHLD = um só reap_children()
+            }
+            reap_children();
+        }
+
+        if (ring_idx != -1 && (fds[ring_idx].revents & POLLIN)) {
+            drain_ring();
+        }
+
+        if (net_idx != -1 && (fds[net_idx].revents & POLLIN)) {
+            net_process();
+        }
+
+        if (fds[2].revents & POLLIN) {
+            char drain[16];
+            while (read(upgrade_pipe[0], drain, sizeof(drain)) > 0) {
+                // Esvazia o pipe
+            }
+        }
+        if (trace_dump_requested) {
+            trace_save();
+        }
+        if (upgrade_requested) {
+            do_upgrade();  // Só retorna se a atualização falhar
+            continue;
+        }
+
+        if ((fds[0].revents & (POLLIN | POLLHUP)) == 0) {
+            continue;
+        }
+
+        /*
+         * Lê dados do FIFO
+         * - Retorna o número de bytes lidos
+         * - Retorna 0 quando o cliente fecha o FIFO (EOF)
+         * - Retorna -1 se houver erro (EAGAIN = ainda sem dados)
+         */
+        char buffer[MAX_BUFFER];
+        ssize_t bytes = read(server_fd, buffer, sizeof(buffer));
+        
+        if (bytes > 0) {
+            // Recebemos dados! Processa as mensagens completas
+            on_fifo_data(buffer, bytes);
+        } else if (bytes == 0) {
+            on_fifo_eof();
+        } else if (errno != EAGAIN && errno != EINTR) {
+            // Erro na leitura
+            print_error("read");
+            break;
+        }
+    }
+}
+
+
+/*
+ * ============================================================================
+ * CICLO DE EVENTOS COM IO_URING (--loop uring)
+ * ============================================================================
+ *
+ * OBJETIVO:
+ * Num servidor ocupado, o ciclo clássico faz dezenas de syscalls por
+ * iteração (poll, read, waitpid, write para cada registo do log...).
+ * Aqui tudo é pedido ao io_uring e cada iteração faz UMA syscall,
+ * io_uring_enter(), que submete os pedidos novos e espera por resultados:
+ *
+ *   - FIFO: uma leitura "multishot" que entrega dados sempre que chegam,
+ *     com buffers de um anel registado (fifo_bufs). Antes dela fazemos um
+ *     poll: sem escritores, read() num FIFO dá logo EOF e a leitura
+ *     multishot terminava em ciclo
+ *   - Anel (--ring): poll multishot no eventfd da vigia
+ *   - Filhos: um pedido waitid por cada filho lançado
+ *   - Log: os registos da iteração são escritos numa cadeia de writes
+ *     ligados (IOSQE_IO_LINK), que o kernel executa pela ordem certa
+ *
+ * O user_data de cada pedido identifica o que terminou: um ponteiro
+ * (job ou registo do log, alinhados a 8 bytes) mais uma etiqueta nos
+ * 3 bits de baixo.
+ *
+ * Se o kernel não tiver io_uring ou as operações necessárias
+ * (Linux >= 6.7), o servidor usa o ciclo clássico.
+ */
+#define TAG_FIFO   1
+#define TAG_RING   2
+#define TAG_WAITID 3
+#define TAG_LOG    4
+#define TAG_FIFO_POLL 5
+#define TAG_UPGRADE 6
+#define TAG_NET    7
+#define TAG_MASK   7
+
+#define URING_ENTRIES 256
+#define FIFO_BUFS 16          // Buffers para a leitura multishot do FIFO
+#define LOG_CHAIN_MAX 64      // Registos por cadeia de writes
+
+#define URING_RETRY_MS 10     // Espera máxima com pedidos por armar
+
+struct uring uring;
+struct uring_buf_ring fifo_bufs;
+int uring_inflight = 0;       // Pedidos (fora o log) cuja última CQE ainda não chegou
+int upgrading = 0;            // A parar o io_uring para uma atualização
+
+/*
+ * uring_get_sqe() dá NULL se a SQ estiver cheia e o io_uring_enter()
+ * falhar (ex: EBUSY com a CQ a transbordar de waitids). O pedido não se
+ * perde: fica marcado aqui e uring_retry_arms() volta a pedi-lo na
+ * iteração seguinte, depois de tratadas as CQEs.
+ */
+int uring_retry = 0;          // Pedidos permanentes por armar (bit 1 << TAG_...)
+int uring_retry_children = 0; // Jobs em running[] com watch_pending
+
+/*
+ * Registo do log à espera de ser escrito (o buffer tem de existir até
+ * o kernel acabar a escrita)
+ */
+struct log_record {
+    struct log_record *next;
+    int len;
+    char data[];
+};
+
+struct log_record *log_queue_head = NULL;
+struct log_record *log_queue_tail = NULL;
+int log_inflight = 0;         // Writes submetidos e ainda não terminados
+
+/*
+ * Escreve um registo no log.
+ * - Ciclo clássico: um write() imediato
+ * - io_uring: junta o registo à fila; uring_flush_log() submete-a
+ */
+void log_write(const char *record, int len) {
+    if (loop_backend != BACKEND_URING) {
+        TRACE(TRACE_LOG, 'B', 0, NULL);
+        if (write(log_fd, record, len) == -1) {
+            print_error("Erro ao escrever no ficheiro de log");
+        }
+        TRACE(TRACE_LOG, 'E', 0, NULL);
+        return;
+    }
+
+    struct log_record *rec = malloc(sizeof(struct log_record) + len);
+    if (rec == NULL) {
+        write(log_fd, record, len);
+        return;
+    }
+    rec->next = NULL;
+    rec->len = len;
+    memcpy(rec->data, record, len);
+
+    if (log_queue_tail != NULL) log_queue_tail->next = rec;
+    else log_queue_head = rec;
+    log_queue_tail = rec;
+}
+
+/*
+ * Submete os registos pendentes numa cadeia de writes ligados.
+ *
+ * Só há uma cadeia em voo de cada vez: duas cadeias podiam ser
+ * executadas em paralelo e trocar a ordem das linhas no log.
+ */
+void uring_flush_log(void) {
+    if (log_inflight > 0 || log_queue_head == NULL) return;
+    TRACE(TRACE_LOG, 'B', 0, NULL);
+
+    // A cadeia tem de caber toda na SQ (não pode ser submetida a meio)
+    int max = uring_sq_space(&uring);
+    if (max > LOG_CHAIN_MAX) max = LOG_CHAIN_MAX;
+
+    struct io_uring_sqe *prev = NULL;
+    while (log_queue_head != NULL && log_inflight < max) {
+        struct log_record *rec = log_queue_head;
+        struct io_uring_sqe *sqe = uring_get_sqe(&uring);
+        if (sqe == NULL) break;  // O resto vai na próxima cadeia
+
+        log_queue_head = rec->next;
+        if (log_queue_head == NULL) log_queue_tail = NULL;
+
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = log_fd;
+        sqe->addr = (unsigned long)rec->data;
+        sqe->len = rec->len;
+        sqe->off = (unsigned long long)-1;   // Posição atual (O_APPEND)
+        sqe->user_data = (unsigned long)rec | TAG_LOG;
+
+        if (prev != NULL) prev->flags |= IOSQE_IO_LINK;
+        prev = sqe;
+        log_inflight++;
+    }
+
+    // Nem um write na SQ e nenhum em voo: escreve já, pela mesma ordem
+    while (log_inflight == 0 && log_queue_head != NULL) {
+        struct log_record *rec = log_queue_head;
+        log_queue_head = rec->next;
+        if (log_queue_head == NULL) log_queue_tail = NULL;
+        write(log_fd, rec->data, rec->len);
+        free(rec);
+    }
+    // No trace, só a preparação: os writes são feitos no io_uring_enter()
+    TRACE(TRACE_LOG, 'E', 0, NULL);
+}
+
+/*
+ * Resultado de uma escrita do log. Se falhou (ou foi cancelada porque a
+ * anterior da cadeia falhou) ou ficou incompleta, escreve o resto com
+ * write() para não perder o registo.
+ */
+void uring_log_done(struct log_record *rec, int res) {
+    log_inflight--;
+
+    int done = res > 0 ? res : 0;
+    if (done < rec->len) {
+        write(log_fd, rec->data + done, rec->len - done);
+    }
+    free(rec);
+}
+
+/*
+ * Espera (poll) que um cliente escreva no FIFO; só depois arma a leitura
+ */
+void uring_poll_fifo(void) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&uring);
+    if (sqe == NULL) {
+        uring_retry |= 1 << TAG_FIFO_POLL;
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = server_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = TAG_FIFO_POLL;
+    uring_inflight++;
+}
+
+/*
+ * Leitura multishot do FIFO: o kernel escolhe um buffer de fifo_bufs
+ * e entrega uma CQE por cada read() que teria sido feito.
+ */
+void uring_arm_fifo(void) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&uring);
+    if (sqe == NULL) {
+        uring_retry |= 1 << TAG_FIFO;
+        return;
+    }
+    sqe->opcode = URING_OP_READ_MULTISHOT;
+    sqe->fd = server_fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = fifo_bufs.group;
+    sqe->user_data = TAG_FIFO;
+    uring_inflight++;
+}
+
+void uring_arm_ring(void) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&uring);
+    if (sqe == NULL) {
+        uring_retry |= 1 << TAG_RING;
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = ring_event_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = TAG_RING;
+    uring_inflight++;
+}
+
+/*
+ * Pedido de atualização (o upgrade_handler escreveu no upgrade_pipe)
+ */
+void uring_arm_upgrade(void) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&uring);
+    if (sqe == NULL) {
+        uring_retry |= 1 << TAG_UPGRADE;
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = upgrade_pipe[0];
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = TAG_UPGRADE;
+    uring_inflight++;
+}
+
+void uring_arm_net(void) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&uring);
+    if (sqe == NULL) {
+        uring_retry |= 1 << TAG_NET;
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = net_epoll_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = TAG_NET;
+    uring_inflight++;
+}
+
+/*
+ * Pede ao kernel que nos avise (e recolha o filho) quando ele terminar.
+ * Equivalente a waitid(P_PID, pid, &job->info, WEXITED).
+ */
+void uring_watch_child(struct job *job) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&uring);
+    if (sqe == NULL) {
+        job->watch_pending = 1;
+        uring_retry_children++;
+        return;
+    }
+    job->watch_pending = 0;
+    sqe->opcode = URING_OP_WAITID;
+    sqe->fd = job->pid;
+    sqe->len = P_PID;
+    sqe->file_index = WEXITED;
+    sqe->addr2 = (unsigned long)&job->info;
+    sqe->user_data = (unsigned long)job | TAG_WAITID;
+    uring_inflight++;
+}
+
+/*
+ * Converte o siginfo do waitid para o formato de estado do waitpid(),
+ * que é o que format_log_entry() usa (WIFEXITED/WEXITSTATUS).
+ */
+int status_from_siginfo(const siginfo_t *info) {
+    if (info->si_code == CLD_EXITED) {
+        return (info->si_status & 0xff) << 8;
+    }
+    return info->si_status & 0x7f;  // Terminado por um sinal
+}
+
+/*
+ * Prepara o io_uring. Retorna -1 se não for possível usá-lo.
+ */
+int uring_setup(void) {
+    const int needed[] = {
+        URING_OP_READ_MULTISHOT, URING_OP_WAITID, IORING_OP_WRITE, IORING_OP_POLL_ADD
+    };
+
+    if (uring_init(&uring, URING_ENTRIES) == -1) return -1;
+
+    if (!uring_supports(&uring, needed, 4) ||
+        uring_buf_ring_init(&uring, &fifo_bufs, 0, FIFO_BUFS, MAX_BUFFER) == -1) {
+        uring_exit(&uring);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Trata uma CQE. Durante uma atualização (upgrading) não volta a armar
+ * os pedidos que terminam: queremos que deixe de haver pedidos em voo.
+ */
+void uring_handle_cqe(unsigned long long user_data, int res, unsigned flags) {
+    void *ptr = (void *)(unsigned long)(user_data & ~(unsigned long long)TAG_MASK);
+    int more = (flags & IORING_CQE_F_MORE) != 0;
+    int tag = user_data & TAG_MASK;
+
+    // Última CQE de um pedido (o log tem a sua conta; 0 = cancelamento)
+    if (!more && tag != TAG_LOG && tag != 0) uring_inflight--;
+
+    switch (tag) {
+    case TAG_FIFO_POLL:
+        if (!upgrading) uring_arm_fifo();
+        break;
+
+    case TAG_FIFO:
+        if (res > 0) {
+            unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+            on_fifo_data(uring_buf_ring_get(&fifo_bufs, bid), res);
+            uring_buf_ring_recycle(&fifo_bufs, bid);
+        }
+        if (!more) {
+            // A leitura multishot terminou: EOF, erro ou sem buffers
+            if (res == 0) {
+                on_fifo_eof();
+                if (!upgrading) uring_poll_fifo();
+            } else if (res == -ECANCELED && upgrading) {
+                // Cancelada pela atualização
+            } else if (res < 0 && res != -ENOBUFS) {
+                errno = -res;
+                print_error("read");
+                should_exit = 1;
+            } else if (!upgrading) {
+                uring_arm_fifo();
+            }
+        }
+        break;
+
+    case TAG_RING:
+        drain_ring();
+        if (!more && !upgrading) uring_arm_ring();
+        break;
+
+    case TAG_WAITID: {
+        struct job *job = ptr;
+        if (res == -ECANCELED) {
+            break;  // Atualização: o filho continua; o processo novo espera por ele
+        }
+        if (res < 0) {
+            errno = -res;
+            print_error("waitid");
+            job->info.si_code = CLD_KILLED;  // Regista como anormal
+            job->info.si_status = SIGKILL;
+        }
+        job_finished(job, status_from_siginfo(&job->info));
+        break;
+    }
+
+    case TAG_LOG:
+        uring_log_done(ptr, res);
+        break;
+
+    case TAG_NET:
+        net_process();
+        if (!more && !upgrading) uring_arm_net();
+        break;
+
+    case TAG_UPGRADE: {
+        char drain[16];
+        while (read(upgrade_pipe[0], drain, sizeof(drain)) > 0) {
+            // Esvazia o pipe; do_upgrade() é chamada no fim da iteração
+        }
+        if (!more && !upgrading) uring_arm_upgrade();
+        break;
+    }
+    }
+}
+
+/*
+ * Trata todas as CQEs disponíveis
+ */
+void uring_process_cqes(void) {
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_peek_cqe(&uring)) != NULL) {
+        /*
+         * Copiamos a CQE e libertamos logo a posição: os handlers
+         * podem submeter pedidos e o kernel pode reutilizá-la.
+         */
+        unsigned long long user_data = cqe->user_data;
+        int res = cqe->res;
+        unsigned flags = cqe->flags;
+        uring_cqe_seen(&uring);
+
+        uring_handle_cqe(user_data, res, flags);
+    }
+}
+
+/*
+ * Atualização: cancela todos os pedidos em voo e espera pelas últimas
+ * CQEs. Um waitid que já recolheu o filho entrega a CQE normal e o job é
+ * registado; os restantes acabam com -ECANCELED e o filho fica por
+ * recolher, para o processo novo. O mesmo para a leitura do FIFO: os
+ * bytes que já leu são tratados aqui, os outros ficam no FIFO.
+ */
+void uring_quiesce(void) {
+    upgrading = 1;
+
+    // Sem SQE livre: trata CQEs (não rearmam nada) até haver lugar
+    struct io_uring_sqe *sqe;
+    while ((sqe = uring_get_sqe(&uring)) == NULL) {
+        uring_submit_and_wait(&uring, 1, 100);
+        uring_process_cqes();
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL | IORING_ASYNC_CANCEL_ANY;
+    sqe->user_data = 0;
+
+    while (uring_inflight > 0 || log_inflight > 0) {
+        if (uring_submit_and_wait(&uring, 1, 100) == -1) {
+            print_error("io_uring_enter");
+            break;
+        }
+        uring_process_cqes();
+    }
+
+    // Registos que ainda não tinham sido submetidos
+    while (log_queue_head != NULL) {
+        struct log_record *rec = log_queue_head;
+        log_queue_head = rec->next;
+        write(log_fd, rec->data, rec->len);
+        free(rec);
+    }
+    log_queue_tail = NULL;
+}
+
+/*
+ * Arma os pedidos permanentes (e o waitid de cada filho em running[]).
+ * Usada no arranque e quando uma atualização falha.
+ */
+void uring_arm_all(void) {
+    upgrading = 0;
+    uring_retry = 0;
+    uring_retry_children = 0;
+    uring_poll_fifo();
+    if (use_ring) {
+        uring_arm_ring();
+    }
+    if (net_epoll_fd != -1) {
+        uring_arm_net();
+    }
+    uring_arm_upgrade();
+    for (int i = 0; i < num_running; i++) {
+        uring_watch_child(running[i]);
+    }
+}
+
+/*
+ * Volta a pedir o que ficou sem SQE (ver uring_retry)
+ */
+void uring_retry_arms(void) {
+    int retry = uring_retry;
+    uring_retry = 0;
+    if (retry & (1 << TAG_FIFO_POLL)) uring_poll_fifo();
+    if (retry & (1 << TAG_FIFO)) uring_arm_fifo();
+    if (retry & (1 << TAG_RING)) uring_arm_ring();
+    if (retry & (1 << TAG_NET)) uring_arm_net();
+    if (retry & (1 << TAG_UPGRADE)) uring_arm_upgrade();
+
+    if (uring_retry_children > 0) {
+        uring_retry_children = 0;
+        for (int i = 0; i < num_running; i++) {
+            if (running[i]->watch_pending) uring_watch_child(running[i]);
+        }
+    }
+}
+
+void run_uring_loop(void) {
+    uring_arm_all();
+    if (upgrade_fd != -1) {
+        upgrade_restore_jobs();  // Os filhos herdados entram em running[]
+    }
+
+    while (!should_exit) {
+        net_flush();
+        uring_retry_arms();
+        uring_flush_log();
+
+        // Com pedidos por armar, volta cedo para tentar outra vez
+        int timeout = timer_timeout_ms();
+        if ((uring_retry != 0 || uring_retry_children > 0) &&
+            (timeout == -1 || timeout > URING_RETRY_MS)) {
+            timeout = URING_RETRY_MS;
+        }
+
+        // A única syscall da iteração: submete tudo e espera.
+        // EBUSY: a CQ transbordou; as CQEs tratadas abaixo abrem espaço
+        if (uring_submit_and_wait(&uring, 1, timeout) == -1 && errno != EBUSY) {
+            print_error("io_uring_enter");
+            break;
+        }
+        run_timers();
+        uring_process_cqes();
+
+        if (trace_dump_requested) {
+            trace_save();
+        }
+        if (upgrade_requested) {
+            do_upgrade();  // Só retorna se a atualização falhar
+        }
+    }
+}
+
+
+/*
+ * ============================================================================
+ * TRACE DOS JOBS (SIGUSR1)
+ * ============================================================================
+ * O trace_handler desligou o trace: grava os eventos desde a última
+ * gravação em logs/trace-<pid>-<n>.json (abrir em ui.perfetto.dev ou
+ * chrome://tracing). Os pontos do trace estão descritos em trace.h.
+ */
+int trace_dumps = 0;
+
+void trace_save(void) {
+    trace_dump_requested = 0;
+
+    // Depois de uma atualização o pid é o mesmo e a contagem recomeça
+    char path[64];
+    do {
+        int len = append_str(path, 0, sizeof(path), "logs/trace-");
+        len = append_int(path, len, sizeof(path), getpid());
+        len = append_str(path, len, sizeof(path), "-");
+        len = append_int(path, len, sizeof(path), ++trace_dumps);
+        append_str(path, len, sizeof(path), ".json");
+    } while (access(path, F_OK) == 0);
+
+    long count = trace_dump(path);
+    if (count == -1) {
+        print_error("Erro ao gravar o trace");
+        return;
+    }
+    print_str("[Servidor] Trace gravado em ");
+    print_str(path);
+    print_str(" (");
+    print_int(STDOUT_FILENO, count);
+    print_str(" eventos).\n");
+}
+
+
+/*
+ * ============================================================================
+ * ATUALIZAÇÃO SEM PARAR O SERVIÇO (SIGHUP / SIGUSR2)
+ * ============================================================================
+ *
+ * OBJETIVO:
+ * Pôr a correr uma versão nova do servidor (ex: depois de um "make") sem
+ * apagar o FIFO e sem perder os comandos que estão a correr.
+ *
+ * COMO FUNCIONA:
+ * 1. O servidor deixa de lançar jobs (ficam na fila) e leva as threads /
+ *    o io_uring a um ponto seguro, sem nada a meio
+ * 2. O estado vai para um memfd (ficheiro em memória, sem nome): os fds
+ *    do FIFO, do log e dos sockets de escuta, os bytes do FIFO ainda sem
+ *    '\n', os contadores dos builtins, os modelos de %prepare e os jobs
+ *    (em execução, na fila, builtins sleep)
+ * 3. execv() do binário (argv[0]) com os mesmos argumentos mais
+ *    --upgrade-fd N. O PID não muda, por isso os filhos em execução
+ *    continuam a ser filhos do servidor e a versão nova espera por eles
+ * 4. A versão nova lê o memfd, usa o FIFO e o log herdados e retoma
+ *
+ * O FIFO nunca é fechado nem apagado: um cliente que chegue a meio
+ * escreve no FIFO e a mensagem fica no kernel até a versão nova a ler.
+ * As ligações (--nodes / --executor / --watch) fecham-se e voltam a
+ * ligar-se. Por isso, com jobs remotos a meio (pedidos por um dispatcher
+ * ou enviados a um nó), a atualização fica adiada até terminarem.
+ * O anel (--ring) continua em /dev/shm com os frames por ler.
+ *
+ * SIGHUP, SIGUSR2 e SIGUSR1 ficam bloqueados durante o execv() (a ação
+ * por omissão terminava o servidor); a versão nova desbloqueia-os depois
+ * de instalar os handlers. O trace não passa para a versão nova.
+ *
+ * Se algo falhar antes do execv(), o servidor continua como estava.
+ */
+#define UPGRADE_MAGIC 0x55504752u   // "UPGR"
+#define UPGRADE_VERSION 8
+#define UPGRADE_MAX_BUILTINS 32
+
+#define UPGRADE_RUNNING 0   // Filho em execução (ou por recolher)
+#define UPGRADE_QUEUED  1   // Na fila, ainda não lançado
+#define UPGRADE_SLEEP   2   // Builtin sleep à espera do temporizador
+#define UPGRADE_FOLLOWER 3  // %coalesce: segue o líder escrito antes dele
+
+struct upgrade_header {
+    uint32_t magic;
+    int version;
+    int server_fd;
+    int log_fd;
+    int listen_fd;              // --executor (-1 = nenhum)
+    int watch_fd;               // --watch (-1 = nenhum)
+    int num_jobs;
+    int fifo_pending_len;
+    char fifo_pending[MAX_BUFFER];
+    int num_builtins;
+    struct {
+        char name[16];
+        long runs;
+        long fallbacks;
+    } builtins[UPGRADE_MAX_BUILTINS];
+    long coalesce_leaders;
+    long coalesce_attached;
+    int num_templates;          // Seguem-se: int len + texto do %prepare
+    int num_parked;             // Depois: int len + mensagem com %after (dag_park)
+    long template_invokes;
+    long watch_published;
+    long watch_dropped;
+    long next_job_id;
+};
+
+/*
+ * Cada job é um registo seguido de cmd_len bytes com o comando,
+ * key_len bytes com a chave de %cache e client_len bytes com %client
+ */
+struct upgrade_job {
+    int kind;
+    long id;
+    pid_t pid;
+    int place;
+    unsigned long batch_id;     // Endereço da batch na versão antiga (só agrupa)
+    int batch_total;
+    int batch_remaining;
+    long delay_ms;              // UPGRADE_SLEEP: tempo que ainda falta
+    int coalesce;               // Entra na tabela de %coalesce
+    int out_fd;                 // %cache: memfd com o output (herdado)
+    int cmd_len;
+    int key_len;
+    int client_len;
+};
+
+char **saved_argv = NULL;       // Argumentos do arranque (para o execv)
+int upgrade_num_jobs = 0;
+
+int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int read_all(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int upgrade_save_job(int fd, struct job *job, int kind, long delay_ms) {
+    struct upgrade_job rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.kind = kind;
+    rec.id = job->id;
+    rec.pid = job->pid;
+    rec.place = job->place;
+    rec.batch_id = (unsigned long)job->batch;
+    rec.batch_total = job->batch->total;
+    rec.batch_remaining = job->batch->remaining;
+    rec.delay_ms = delay_ms;
+    rec.coalesce = job->key != NULL || kind == UPGRADE_FOLLOWER;
+    rec.out_fd = job->out_fd;
+    rec.cmd_len = strlen(job->cmd);
+    rec.key_len = job->cache_key != NULL ? (int)strlen(job->cache_key) : 0;
+    rec.client_len = job->client != NULL ? (int)strlen(job->client) : 0;
+
+    if (job->out_fd != -1) fcntl(job->out_fd, F_SETFD, 0);  // Passa no execv
+
+    if (write_all(fd, &rec, sizeof(rec)) == -1 ||
+        write_all(fd, job->cmd, rec.cmd_len) == -1 ||
+        write_all(fd, job->cache_key, rec.key_len) == -1 ||
+        write_all(fd, job->client, rec.client_len) == -1) {
+        return -1;
+    }
+
+    // Os seguidores vão logo a seguir ao líder
+    for (struct job *f = job->followers; f != NULL; f = f->next) {
+        if (upgrade_save_job(fd, f, UPGRADE_FOLLOWER, 0) == -1) return -1;
+    }
+    return 0;
+}
+
+/*
+ * Registos que upgrade_save_job() escreve para um job
+ */
+int upgrade_job_records(struct job *job) {
+    int count = 1;
+    for (struct job *f = job->followers; f != NULL; f = f->next) count++;
+    return count;
+}
+
+/*
+ * Escreve o estado num memfd. Retorna o fd (já no início) ou -1.
+ */
+int upgrade_save(void) {
+    int fd = memfd_create("exec_upgrade", 0);  // Sem MFD_CLOEXEC: passa no execv
+    if (fd == -1) return -1;
+
+    struct upgrade_header *h = calloc(1, sizeof(struct upgrade_header));
+    if (h == NULL) {
+        close(fd);
+        return -1;
+    }
+    h->magic = UPGRADE_MAGIC;
+    h->version = UPGRADE_VERSION;
+    h->server_fd = server_fd;
+    h->log_fd = log_fd;
+    h->listen_fd = listen_fd;
+    h->watch_fd = watch_fd;
+    h->fifo_pending_len = fifo_pending_len;
+    memcpy(h->fifo_pending, fifo_pending, fifo_pending_len);
+
+    for (int i = 0; i < NUM_BUILTINS && i < UPGRADE_MAX_BUILTINS; i++) {
+        append_str(h->builtins[i].name, 0, sizeof(h->builtins[i].name), builtins[i].name);
+        h->builtins[i].runs = builtins[i].runs;
+        h->builtins[i].fallbacks = builtins[i].fallbacks;
+        h->num_builtins++;
+    }
+
+    h->coalesce_leaders = coalesce_leaders;
+    h->coalesce_attached = coalesce_attached;
+    h->num_templates = num_templates;
+    h->num_parked = num_parked;
+    h->template_invokes = template_invokes;
+    h->watch_published = watch_published;
+    h->watch_dropped = watch_dropped;
+    h->next_job_id = next_job_id;
+
+    for (int i = 0; i < num_running; i++) {
+        h->num_jobs += upgrade_job_records(running[i]);
+    }
+    for (struct job *job = queue_head; job != NULL; job = job->next) {
+        h->num_jobs += upgrade_job_records(job);
+    }
+    for (struct timer *t = timers; t != NULL; t = t->next) {
+        if (t->fn == builtin_sleep_done) h->num_jobs += upgrade_job_records(t->arg);
+    }
+
+    int ok = write_all(fd, h, sizeof(*h)) == 0;
+    free(h);
+
+    for (int i = 0; ok && i < num_templates; i++) {
+        int len = strlen(templates[i].source);
+        ok = write_all(fd, &len, sizeof(len)) == 0 &&
+             write_all(fd, templates[i].source, len) == 0;
+    }
+    for (struct parked_message *msg = parked_head; ok && msg != NULL; msg = msg->next) {
+        ok = write_all(fd, &msg->len, sizeof(msg->len)) == 0 &&
+             write_all(fd, msg->text, msg->len) == 0;
+    }
+
+    for (int i = 0; ok && i < num_running; i++) {
+        ok = upgrade_save_job(fd, running[i], UPGRADE_RUNNING, 0) == 0;
+    }
+    for (struct job *job = queue_head; ok && job != NULL; job = job->next) {
+        ok = upgrade_save_job(fd, job, UPGRADE_QUEUED, 0) == 0;
+    }
+    long now = now_ms();
+    for (struct timer *t = timers; ok && t != NULL; t = t->next) {
+        if (t->fn != builtin_sleep_done) continue;
+        long left = t->deadline - now;
+        ok = upgrade_save_job(fd, t->arg, UPGRADE_SLEEP, left > 0 ? left : 0) == 0;
+    }
+
+    if (!ok || lseek(fd, 0, SEEK_SET) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Argumentos para a versão nova: os do arranque (sem um --upgrade-fd
+ * antigo) mais --upgrade-fd N
+ */
+char **upgrade_argv(int fd, char *fd_str, int size) {
+    int argc = 0;
+    while (saved_argv[argc] != NULL) argc++;
+
+    char **argv = calloc(argc + 3, sizeof(char *));
+    if (argv == NULL) return NULL;
+
+    int n = 0;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(saved_argv[i], "--upgrade-fd") == 0 && i + 1 < argc) {
+            i++;
+            continue;
+        }
+        argv[n++] = saved_argv[i];
+    }
+    append_int(fd_str, 0, size, fd);
+    argv[n++] = "--upgrade-fd";
+    argv[n++] = fd_str;
+    argv[n] = NULL;
+    return argv;
+}
+
+/*
+ * ============================================================================
+ * FUNÇÃO: do_upgrade
+ * ============================================================================
+ * Chamada pelo ciclo de eventos quando upgrade_requested = 1.
+ * Só retorna se a atualização falhar.
+ */
+void do_upgrade(void) {
+    upgrade_requested = 0;
+
+    // Jobs à espera de um %after não passam para a versão nova
+    if (dag_held_jobs > 0) {
+        if (!dag_upgrade_deferred) {
+            print_str("[Servidor] Pedido de atualização adiado: há comandos à espera de um %after.\n");
+        }
+        dag_upgrade_deferred = 1;
+        return;
+    }
+    dag_upgrade_deferred = 0;
+
+    // Nem as ligações nem os jobs remotos passam para a versão nova
+    if (net_busy()) {
+        if (!net_upgrade_deferred) {
+            print_str("[Servidor] Pedido de atualização adiado: há jobs remotos por terminar.\n");
+        }
+        net_upgrade_deferred = 1;
+        return;
+    }
+    net_upgrade_deferred = 0;
+
+    print_str("[Servidor] Pedido de atualização. A reexecutar sem fechar o FIFO...\n");
+
+    sigset_t block, old_mask;
+    sigemptyset(&block);
+    sigaddset(&block, SIGHUP);
+    sigaddset(&block, SIGUSR2);
+    sigaddset(&block, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &block, &old_mask);
+
+    launch_paused = 1;
+    if (loop_backend == BACKEND_THREADS) threads_quiesce();
+    if (loop_backend == BACKEND_URING) uring_quiesce();
+
+    char fd_str[16];
+    char **argv = NULL;
+    int fd = upgrade_save();
+    if (fd != -1) argv = upgrade_argv(fd, fd_str, sizeof(fd_str));
+
+    if (argv != NULL) {
+        fcntl(log_fd, F_SETFD, 0);  // O log passa para a versão nova
+        if (listen_fd != -1) fcntl(listen_fd, F_SETFD, 0);
+        if (watch_fd != -1) fcntl(watch_fd, F_SETFD, 0);
+
+        execv(saved_argv[0], argv);
+        execv("/proc/self/exe", argv);  // Ex: argv[0] sem caminho
+
+        print_error("execv");
+        fcntl(log_fd, F_SETFD, FD_CLOEXEC);
+        if (listen_fd != -1) fcntl(listen_fd, F_SETFD, FD_CLOEXEC);
+        if (watch_fd != -1) fcntl(watch_fd, F_SETFD, FD_CLOEXEC);
+        for (int i = 0; i < num_running; i++) {
+            if (running[i]->out_fd != -1) fcntl(running[i]->out_fd, F_SETFD, FD_CLOEXEC);
+        }
+        free(argv);
+    } else {
+        print_error("Erro ao guardar o estado");
+    }
+    if (fd != -1) close(fd);
+
+    print_err("[Servidor] A atualização falhou; o servidor continua.\n");
+    if (loop_backend == BACKEND_THREADS) threads_resume();
+    if (loop_backend == BACKEND_URING) uring_arm_all();
+    launch_paused = 0;
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    start_queued_jobs();
+    dag_unpark();
+}
+
+/*
+ * ================================================================
+ * Lado da versão nova (--upgrade-fd N)
+ * ================================================================
+ */
+
+/*
+ * Lê o cabeçalho: FIFO, log, bytes pendentes e contadores.
+ * Se o estado for inválido, o servidor arranca do zero (upgrade_fd = -1).
+ */
+void upgrade_restore_fds(void) {
+    struct upgrade_header *h = calloc(1, sizeof(struct upgrade_header));
+    if (h == NULL || read_all(upgrade_fd, h, sizeof(*h)) == -1 ||
+        h->magic != UPGRADE_MAGIC || h->version != UPGRADE_VERSION) {
+        print_err("[Servidor] Estado da atualização inválido; a arrancar do zero.\n");
+        free(h);
+        close(upgrade_fd);
+        upgrade_fd = -1;
+        return;
+    }
+
+    server_fd = h->server_fd;
+    log_fd = h->log_fd;
+    fcntl(log_fd, F_SETFD, FD_CLOEXEC);
+    listen_fd = h->listen_fd;
+    if (listen_fd != -1) fcntl(listen_fd, F_SETFD, FD_CLOEXEC);
+    watch_fd = h->watch_fd;
+    if (watch_fd != -1) fcntl(watch_fd, F_SETFD, FD_CLOEXEC);
+
+    fifo_pending_len = h->fifo_pending_len;
+    memcpy(fifo_pending, h->fifo_pending, fifo_pending_len);
+
+    for (int i = 0; i < h->num_builtins && i < UPGRADE_MAX_BUILTINS; i++) {
+        for (int b = 0; b < NUM_BUILTINS; b++) {
+            if (strcmp(h->builtins[i].name, builtins[b].name) == 0) {
+                builtins[b].runs = h->builtins[i].runs;
+                builtins[b].fallbacks = h->builtins[i].fallbacks;
+            }
+        }
+    }
+    coalesce_leaders = h->coalesce_leaders;
+    coalesce_attached = h->coalesce_attached;
+    upgrade_num_jobs = h->num_jobs;
+
+    // Modelos: voltam a ser preparados (o PATH pode ter mudado). As
+    // mensagens guardadas e os jobs vêm a seguir no memfd: um modelo
+    // grande demais é saltado pelo tamanho; se a leitura falhar, a
+    // posição já não é de confiança e nada do resto é retomado.
+    int lost = 0;
+    for (int i = 0; i < h->num_templates; i++) {
+        char source[MAX_BUFFER];
+        int len;
+        if (read_all(upgrade_fd, &len, sizeof(len)) == -1 || len < 0) {
+            print_err("[Servidor] Estado da atualização inválido; os jobs não são retomados.\n");
+            upgrade_num_jobs = 0;
+            lost = 1;
+            break;
+        }
+        if (len >= (int)sizeof(source)) {
+            if (lseek(upgrade_fd, len, SEEK_CUR) == -1) {
+                print_error("lseek");
+                upgrade_num_jobs = 0;
+                lost = 1;
+                break;
+            }
+            continue;
+        }
+        if (read_all(upgrade_fd, source, len) == -1) {
+            print_err("[Servidor] Estado da atualização inválido; os jobs não são retomados.\n");
+            upgrade_num_jobs = 0;
+            lost = 1;
+            break;
+        }
+        source[len] = '\0';
+        template_prepare(source);
+    }
+
+    // Mensagens com %after guardadas: processadas em upgrade_restore_jobs()
+    for (int i = 0; !lost && i < h->num_parked; i++) {
+        int len;
+        char *text = NULL;
+        if (read_all(upgrade_fd, &len, sizeof(len)) == -1 || len < 0 ||
+            (text = malloc(len + 1)) == NULL || read_all(upgrade_fd, text, len) == -1 ||
+            dag_park(text, len) == -1) {
+            print_err("[Servidor] Estado da atualização inválido; os jobs não são retomados.\n");
+            upgrade_num_jobs = 0;
+            lost = 1;
+        }
+        free(text);
+    }
+    template_invokes = h->template_invokes;
+    watch_published = h->watch_published;
+    watch_dropped = h->watch_dropped;
+    next_job_id = h->next_job_id;
+    free(h);
+}
+
+/*
+ * Recria os jobs. Chamada pelo ciclo de eventos depois de preparado
+ * (threads a correr, io_uring criado), porque cada ciclo espera pelos
+ * filhos à sua maneira.
+ */
+void upgrade_restore_jobs(void) {
+    // id antigo -> batch nova (os jobs de uma batch vêm quase sempre seguidos)
+    unsigned long *ids = calloc(upgrade_num_jobs + 1, sizeof(unsigned long));
+    struct batch **batches = calloc(upgrade_num_jobs + 1, sizeof(struct batch *));
+    int num_batches = 0;
+    int restored = 0;
+
+    for (int i = 0; ids != NULL && batches != NULL && i < upgrade_num_jobs; i++) {
+        struct upgrade_job rec;
+        if (read_all(upgrade_fd, &rec, sizeof(rec)) == -1) break;
+
+        struct job *job = calloc(1, sizeof(struct job));
+        char *cmd = malloc(rec.cmd_len + 1);
+        char *key = malloc(rec.key_len + 1);
+        char *client = malloc(rec.client_len + 1);
+        if (job == NULL || cmd == NULL || key == NULL || client == NULL ||
+            read_all(upgrade_fd, cmd, rec.cmd_len) == -1 ||
+            read_all(upgrade_fd, key, rec.key_len) == -1 ||
+            read_all(upgrade_fd, client, rec.client_len) == -1) {
+            free(job);
+            free(cmd);
+            free(key);
+            free(client);
+            break;
+        }
+        cmd[rec.cmd_len] = '\0';
+        key[rec.key_len] = '\0';
+        client[rec.client_len] = '\0';
+        job->cmd = cmd;
+        job->id = rec.id;
+        shard_count(1);
+        job->submit_ms = now_ms();  // A duração recomeça na versão nova
+        if (rec.client_len > 0) job->client = client;
+        else free(client);
+        job->pid = rec.pid;
+        job->place = -1;
+
+        job->out_fd = rec.out_fd;
+        if (job->out_fd != -1) fcntl(job->out_fd, F_SETFD, FD_CLOEXEC);
+        if (rec.key_len > 0) {
+            job->cache_key = key;
+            job->cache_hash = str_hash(key);
+        } else {
+            free(key);
+        }
+
+        int b = num_batches - 1;
+        while (b >= 0 && ids[b] != rec.batch_id) b--;
+        if (b < 0) {
+            struct batch *batch = calloc(1, sizeof(struct batch));
+            if (batch == NULL) {
+                job_free(job);
+                break;
+            }
+            batch->total = rec.batch_total;
+            batch->remaining = rec.batch_remaining;
+            b = num_batches++;
+            ids[b] = rec.batch_id;
+            batches[b] = batch;
+        }
+        job->batch = batches[b];
+
+        // O líder vem sempre antes: o seguidor volta a juntar-se a ele
+        if (rec.coalesce && coalesce_attach(job)) {
+            restored++;
+            continue;
+        }
+
+        if (rec.kind == UPGRADE_RUNNING && num_running < MAX_JOBS) {
+            job->place = placement_claim(rec.place);
+            job->slot = num_running;
+            running[num_running++] = job;
+            if (loop_backend == BACKEND_THREADS) reaper_push(&job->node);
+            if (loop_backend == BACKEND_URING) uring_watch_child(job);
+        } else if (rec.kind == UPGRADE_SLEEP) {
+            if (timer_add(rec.delay_ms, builtin_sleep_done, job) == -1) {
+                builtin_job_done(job, 0);
+            }
+        } else {
+            if (queue_tail != NULL) queue_tail->next = job;
+            else queue_head = job;
+            queue_tail = job;
+        }
+        restored++;
+    }
+
+    free(ids);
+    free(batches);
+    close(upgrade_fd);
+    upgrade_fd = -1;
+
+    print_str("[Servidor] Atualização concluída: ");
+    print_int(STDOUT_FILENO, restored);
+    print_str(" job(s) retomado(s).\n");
+    start_queued_jobs();
+    dag_unpark();
+}
+
+/*
+ * ============================================================================
+ * SHARDS: VÁRIOS SERVIDORES, UM FIFO CADA (--shards K)
+ * ============================================================================
+ *
+ * OBJETIVO:
+ * Um só servidor a ler /tmp/exec_fifo é um ponto de serialização: todas as
+ * mensagens passam por um read() e um process_message() de cada vez. Com
+ * --shards K, o processo lançado passa a ser um supervisor que arranca K
+ * servidores ("shards"), cada um com a sua receção, tabela de jobs e fila
+ * (o --max-inflight é por shard) e com os seus ficheiros:
+ *
+ *   FIFO       /tmp/exec_fifo.N
+ *   log        logs/server.log.N      (--log FICHEIRO -> FICHEIRO.N)
+ *   métricas   logs/metrics.N         (idem para --metrics)
+ *   cache      logs/cache.db.N        (idem para --cache-file)
+ *
+ * O cliente escolhe o shard pela página de estado /dev/shm/exec_shards
+ * (ver exec_ring.h), onde cada shard publica quantos jobs tem por acabar.
+ *
+ * LOGS:
+ * Os shards escrevem o timestamp com milissegundos e cada log está por
+ * ordem, por isso juntam-se com um merge:
+ *
+ *   sort -m -s -k1,2 logs/server.log.* > logs/server.log
+ *
+ * SUPERVISOR:
+ * Cada shard é o mesmo binário, lançado com execv() e "--shard N" (assim
+ * uma atualização do shard reexecuta-o como shard). O supervisor:
+ *   - passa SIGHUP/SIGUSR2 (atualização) e SIGUSR1 (trace) aos shards;
+ *   - com SIGINT/SIGTERM termina-os e apaga a página de estado;
+ *   - relança um shard que termine sozinho, se tiver durado pelo menos
+ *     SHARD_MIN_UPTIME_MS (um shard que morre logo ao arrancar não é
+ *     relançado, para não ficar em ciclo).
+ * Espera pelos sinais com sigwaitinfo(): não há handlers nem corridas
+ * entre um sinal e o waitpid().
+ *
+ * --ring, --watch/--retain e --executor usam um nome fixo (anel, socket,
+ * porta), que os shards não podem partilhar: não são aceites com --shards.
+ */
+#define SHARD_MIN_UPTIME_MS 1000
+
+int num_shards = 0;            // --shards K: este processo é o supervisor
+int shard_index = -1;          // --shard N (interno): este processo é o shard N
+struct exec_shards *shard_page = NULL;
+long shard_jobs = 0;           // Jobs deste shard por acabar
+
+/*
+ * Um job entrou (+1) ou foi libertado (-1): atualiza a profundidade
+ * publicada. Só a receção cria e liberta jobs.
+ */
+void shard_count(int delta) {
+    if (shard_page == NULL) return;
+    shard_jobs += delta;
+    atomic_store_explicit(&shard_page->shards[shard_index].depth, shard_jobs,
+                          memory_order_relaxed);
+}
+
+/*
+ * "ficheiro" -> "ficheiro.N" (dura até ao fim do processo)
+ */
+const char *shard_path(const char *path) {
+    int size = strlen(path) + 16;
+    char *out = malloc(size);
+    if (out == NULL) return path;
+    int len = append_str(out, 0, size, path);
+    len = append_str(out, len, size, ".");
+    append_int(out, len, size, shard_index);
+    return out;
+}
+
+/*
+ * Arranque de um shard: ficheiros próprios e entrada na página de estado
+ */
+void shard_init(void) {
+    exec_shard_fifo(shard_index, fifo_path, sizeof(fifo_path));
+    log_path = shard_path(log_path);
+    metrics_path = shard_path(metrics_path);
+    cache_path = shard_path(cache_path);
+    log_millis = 1;
+
+    shard_page = shards_attach();
+    if (shard_page != NULL && shard_index >= (int)shard_page->count) {
+        shard_page = NULL;  // Página de outro supervisor
+    }
+    shard_count(0);
+}
+
+/*
+ * ================================================================
+ * Supervisor
+ * ================================================================
+ */
+pid_t shard_pids[SHARDS_MAX];
+long shard_started[SHARDS_MAX];
+char **shard_argv = NULL;      // saved_argv sem "--shards K", mais "--shard N"
+int shard_argc = 0;
+
+void shard_spawn(int n, const sigset_t *old_mask) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        char index[12];
+        append_int(index, 0, sizeof(index), n);
+        shard_argv[shard_argc + 1] = index;
+
+        sigprocmask(SIG_SETMASK, old_mask, NULL);
+        execv(saved_argv[0], shard_argv);
+        execv("/proc/self/exe", shard_argv);  // Ex: argv[0] sem caminho
+        print_error("execv");
+        _exit(127);
+    }
+    if (pid == -1) {
+        print_error("fork");
+        pid = 0;
+    }
+
+    shard_pids[n] = pid;
+    shard_started[n] = now_ms();
+    atomic_store(&shard_page->shards[n].depth, 0);
+    atomic_store(&shard_page->shards[n].pid, pid);
+}
+
+/*
+ * Um shard terminou: relança-o, ou desiste dele se morreu logo
+ */
+void shard_exited(int n, int status, const sigset_t *old_mask) {
+    atomic_store(&shard_page->shards[n].pid, 0);
+    shard_pids[n] = 0;
+
+    print_str("[Supervisor] O shard ");
+    print_int(STDOUT_FILENO, n);
+    print_str(WIFSIGNALED(status) ? " terminou com um sinal" : " terminou");
+    if (now_ms() - shard_started[n] < SHARD_MIN_UPTIME_MS) {
+        print_str(" logo ao arrancar; não é relançado.\n");
+        return;
+    }
+    print_str("; a relançar.\n");
+    shard_spawn(n, old_mask);
+}
+
+int run_supervisor(void) {
+    if (use_ring || watch_enabled || executor_addr != NULL) {
+        print_err("[Supervisor] --ring, --watch, --retain e --executor não funcionam com --shards\n");
+        return EXIT_FAILURE;
+    }
+
+    // Argumentos dos shards: os mesmos, sem "--shards K", mais "--shard N"
+    int argc = 0;
+    while (saved_argv[argc] != NULL) argc++;
+    shard_argv = calloc(argc + 3, sizeof(char *));
+    if (shard_argv == NULL) {
+        print_error("calloc");
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(saved_argv[i], "--shards") == 0 && i + 1 < argc) {
+            i++;
+            continue;
+        }
+        shard_argv[shard_argc++] = saved_argv[i];
+    }
+    shard_argv[shard_argc] = "--shard";
+
+    mkdir("logs", 0777);
+    shard_page = shards_create(num_shards);
+    if (shard_page == NULL && errno == EEXIST) {
+        print_err("[Supervisor] Já há outro supervisor com --shards a correr\n");
+        return EXIT_FAILURE;
+    }
+    if (shard_page == NULL) {
+        print_error("shm_open");
+        return EXIT_FAILURE;
+    }
+
+    sigset_t signals, old_mask;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGUSR2);
+    sigaddset(&signals, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &signals, &old_mask);
+
+    for (int n = 0; n < num_shards; n++) {
+        shard_spawn(n, &old_mask);
+    }
+    print_str("[Supervisor] ");
+    print_int(STDOUT_FILENO, num_shards);
+    print_str(" shard(s): " FIFO_PATH ".0 a " FIFO_PATH ".");
+    print_int(STDOUT_FILENO, num_shards - 1);
+    print_str("\n");
+
+    for (;;) {
+        siginfo_t info;
+        int sig = sigwaitinfo(&signals, &info);
+        if (sig == -1) continue;  // EINTR
+
+        if (sig == SIGCHLD) {
+            int status;
+            pid_t pid;
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                for (int n = 0; n < num_shards; n++) {
+                    if (shard_pids[n] == pid) shard_exited(n, status, &old_mask);
+                }
+            }
+
+            int alive = 0;
+            for (int n = 0; n < num_shards; n++) alive += shard_pids[n] != 0;
+            if (alive == 0) {
+                print_err("[Supervisor] Nenhum shard a correr. A terminar.\n");
+                shards_destroy(shard_page);
+                return EXIT_FAILURE;
+            }
+            continue;
+        }
+
+        if (sig == SIGINT || sig == SIGTERM) break;
+
+        // Atualização / trace: cada shard trata o seu
+        for (int n = 0; n < num_shards; n++) {
+            if (shard_pids[n] > 0) kill(shard_pids[n], sig);
+        }
+    }
+
+    print_str("\n[Supervisor] Sinal recebido. A terminar os shards...\n");
+    for (int n = 0; n < num_shards; n++) {
+        if (shard_pids[n] > 0) kill(shard_pids[n], SIGTERM);
+    }
+    for (int n = 0; n < num_shards; n++) {
+        if (shard_pids[n] > 0) waitpid(shard_pids[n], NULL, 0);
+    }
+    shards_destroy(shard_page);
+    return 0;
+}
+
+
+/*
+ * ============================================================================
+ * OPÇÕES DA LINHA DE COMANDO
+ * ============================================================================
+ * Todas as opções são opcionais; sem opções o servidor comporta-se
+ * exatamente como antes.
+ */
+void print_usage(void) {
+    print_err("Uso: ./server [opções]\n");
+    print_err("  --placement none|rr|least|numa  política de colocação dos filhos\n");
+    print_err("  --reserve-cores N               cores reservados ao servidor (omissão: 1)\n");
+    print_err("  --job-cores N                   máximo de cores usados pelos jobs\n");
+    print_err("  --ring                          aceita também frames pelo anel /dev/shm/exec_ring\n");
+    print_err("  --loop classic|uring|threads    ciclo de eventos (omissão: classic)\n");
+    print_err("  --dispatchers N                 threads que fazem fork/exec (--loop threads, omissão: 2)\n");
+    print_err("  --log FICHEIRO                  ficheiro de log (omissão: logs/server.log)\n");
+    print_err("  --builtins all|LISTA            corre echo,true,false,pwd,date,sleep,touch sem fork\n");
+    print_err("  --metrics FICHEIRO              ficheiro de métricas (omissão: logs/metrics)\n");
+    print_err("  --cache-file FICHEIRO           resultados de %cache (omissão: logs/cache.db)\n");
+    print_err("  --cache-size MB                 tamanho máximo da cache (omissão: 64)\n");
+    print_err("  --max-inflight N                máximo de jobs a correr ao mesmo tempo\n");
+    print_err("  --adaptive                      ajusta esse máximo à pressão da máquina (PSI)\n");
+    print_err("  --target-pressure PCT           pressão alvo para --adaptive, 1-99 (omissão: 10)\n");
+    print_err("  --executor [ENDEREÇO:]PORTA     aceita jobs de outros servidores por TCP\n");
+    print_err("                                  (omissão: 127.0.0.1; não tem autenticação)\n");
+    print_err("  --nodes HOST:PORTA,...          distribui jobs pelos executores indicados\n");
+    print_err("  --watch                         resultados em JSON para subscritores (" WATCH_PATH ")\n");
+    print_err("  --retain MB                     guarda os outputs recentes em memória (./client --fetch)\n");
+    print_err("  --retain-disk MB                espaço para outputs grandes em " RETAIN_DIR " (omissão: 256)\n");
+    print_err("  --shards K                      K servidores, com os FIFOs " FIFO_PATH ".0 ... .K-1\n");
+}
+
+void parse_args(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        const char *value = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+        if (strcmp(argv[i], "--placement") == 0 && value != NULL) {
+            if (strcmp(value, "none") == 0)       placement_policy = PLACEMENT_NONE;
+            else if (strcmp(value, "rr") == 0)    placement_policy = PLACEMENT_RR;
+            else if (strcmp(value, "least") == 0) placement_policy = PLACEMENT_LEAST;
+            else if (strcmp(value, "numa") == 0)  placement_policy = PLACEMENT_NUMA;
+            else {
+                print_usage();
+                exit(EXIT_FAILURE);
+            }
+            i++;
+        } else if (strcmp(argv[i], "--reserve-cores") == 0 && value != NULL) {
+            reserve_cores = atoi(value);
+            i++;
+        } else if (strcmp(argv[i], "--job-cores") == 0 && value != NULL) {
+            max_job_cores = atoi(value);
+            i++;
+        } else if (strcmp(argv[i], "--ring") == 0) {
+            use_ring = 1;
+        } else if (strcmp(argv[i], "--loop") == 0 && value != NULL) {
+            if (strcmp(value, "classic") == 0)    loop_backend = BACKEND_CLASSIC;
+            else if (strcmp(value, "uring") == 0) loop_backend = BACKEND_URING;
+            else if (strcmp(value, "threads") == 0) loop_backend = BACKEND_THREADS;
+            else {
+                print_usage();
+                exit(EXIT_FAILURE);
+            }
+            i++;
+        } else if (strcmp(argv[i], "--dispatchers") == 0 && value != NULL) {
+            num_dispatchers = atoi(value);
+            i++;
+        } else if (strcmp(argv[i], "--log") == 0 && value != NULL) {
+            log_path = value;
+            i++;
+        } else if (strcmp(argv[i], "--builtins") == 0 && value != NULL) {
+            if (builtins_enable(value) == -1) {
+                print_usage();
+                exit(EXIT_FAILURE);
+            }
+            i++;
+        } else if (strcmp(argv[i], "--metrics") == 0 && value != NULL) {
+            metrics_path = value;
+            i++;
+        } else if (strcmp(argv[i], "--cache-file") == 0 && value != NULL) {
+            cache_path = value;
+            i++;
+        } else if (strcmp(argv[i], "--cache-size") == 0 && value != NULL) {
+            cache_size_mb = atol(value);
+            if (cache_size_mb < 1) {
+                print_usage();
+                exit(EXIT_FAILURE);
+            }
+            i++;
+        } else if (strcmp(argv[i], "--max-inflight") == 0 && value != NULL) {
+            max_inflight = atoi(value);
+            if (max_inflight < 1 || max_inflight > MAX_JOBS) {
+                print_usage();
+                exit(EXIT_FAILURE);
+            }
+            i++;
+        } else if (strcmp(argv[i], "--adaptive") == 0) {
+            adaptive_active = 1;
+        } else if (strcmp(argv[i], "--target-pressure") == 0 && value != NULL) {
+            target_pressure = atoi(value);
+            // 0 e 100 prenderiam o limite ao mínimo ou ao máximo
+            if (target_pressure < 1 || target_pressure > 99) {
+                print_usage();
+                exit(EXIT_FAILURE);
+            }
+            i++;
+        } else if (strcmp(argv[i], "--executor") == 0 && value != NULL) {
+            executor_addr = value;
+            i++;
+        } else if (strcmp(argv[i], "--nodes") == 0 && value != NULL) {
+            nodes_list = value;
+            i++;
+        } else if (strcmp(argv[i], "--watch") == 0) {
+            watch_enabled = 1;
+        } else if ((strcmp(argv[i], "--retain") == 0 ||
+                    strcmp(argv[i], "--retain-disk") == 0) && value != NULL) {
+            long bytes = atol(value) * 1024 * 1024;
+            if (bytes < 1024 * 1024) {
+                print_usage();
+                exit(EXIT_FAILURE);
+            }
+            if (strcmp(argv[i], "--retain") == 0) {
+                retain_budget = bytes;
+                watch_enabled = 1;  // O --fetch usa o socket do --watch
+            } else {
+                retain_disk_budget = bytes;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--shards") == 0 && value != NULL) {
+            num_shards = atoi(value);
+            if (num_shards < 1 || num_shards > SHARDS_MAX) {
+                print_usage();
+                exit(EXIT_FAILURE);
+            }
+            i++;
+        } else if (strcmp(argv[i], "--shard") == 0 && value != NULL) {
+            // Interno: passado pelo supervisor (--shards)
+            shard_index = atoi(value);
+            i++;
+        } else if (strcmp(argv[i], "--upgrade-fd") == 0 && value != NULL) {
+            // Interno: passado pela versão anterior em do_upgrade()
+            upgrade_fd = atoi(value);
+            i++;
+        } else {
+            print_usage();
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+
+/*
+ * ============================================================================
+ * FUNÇÃO PRINCIPAL (main)
+ * ============================================================================
+ * 
+ * Esta é a função que controla todo o servidor.
+ * Cria o FIFO, fica à espera de mensagens, e processa-as.
  */
-int main(void) {
-    int fd;                   // Descritor do FIFO
-    char buffer[MAX_BUFFER];  // Buffer para ler as mensagens
+int main(int argc, char *argv[]) {
+    saved_argv = argv;
+    parse_args(argc, argv);
+
+    // --shards: este processo só vigia os shards
+    if (num_shards > 0) {
+        return run_supervisor();
+    }
+    if (shard_index >= 0) {
+        shard_init();
+    }
 
     /*
      * ========================================================================
@@ -534,14 +7031,39 @@ int main(void) {
      * Configuramos handlers para sinais comuns de terminação:
      * - SIGINT: Ctrl+C no terminal
      * - SIGTERM: kill <pid> (terminação normal)
-     * - SIGCHLD: filho terminou (previne zombies)
      * 
      * SIGINT/SIGTERM: Permitem cleanup gracioso (fechar FIFO, remover ficheiro)
-     * SIGCHLD: Safety net para prevenir processos zombie em casos de erro
+     * SIGHUP/SIGUSR2: Atualização sem parar o serviço (re-exec, ver acima)
+     * SIGUSR1: Liga/desliga o trace dos jobs (ver trace.h)
+     * 
+     * O SIGCHLD (filho terminou) é tratado pelo ciclo de eventos: o ciclo
+     * clássico instala o sigchld_handler; o io_uring e o reaper do
+     * --loop threads usam waitid.
      */
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
-    signal(SIGCHLD, sigchld_handler);  // Previne zombies
+
+    if (pipe2(upgrade_pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+        print_error("pipe");
+        exit(EXIT_FAILURE);
+    }
+    signal(SIGHUP, upgrade_handler);
+    signal(SIGUSR2, upgrade_handler);
+    signal(SIGUSR1, trace_handler);
+    trace_thread_name("main");
+
+    // A versão anterior bloqueou-os durante o execv()
+    sigset_t upgrade_signals;
+    sigemptyset(&upgrade_signals);
+    sigaddset(&upgrade_signals, SIGHUP);
+    sigaddset(&upgrade_signals, SIGUSR2);
+    sigaddset(&upgrade_signals, SIGUSR1);
+    sigprocmask(SIG_UNBLOCK, &upgrade_signals, NULL);
+
+    // Atualização: FIFO e log vêm da versão anterior
+    if (upgrade_fd != -1) {
+        upgrade_restore_fds();
+    }
 
     /*
      * ========================================================================
@@ -551,6 +7073,17 @@ int main(void) {
      * Se já existir, não faz nada (ignora o erro).
      */
     mkdir("logs", 0777);
+    if (upgrade_fd == -1) {
+        log_open();
+    }
+
+    // Afinidade de CPU / NUMA (só se foi pedida com --placement)
+    placement_init();
+
+    // --max-inflight / --adaptive
+    concurrency_init();
+    net_init();
+    retain_init();
 
     /*
      * ========================================================================
@@ -558,13 +7091,13 @@ int main(void) {
      * ========================================================================
      * 
      * mkfifo() cria um ficheiro especial do tipo FIFO.
-     * - FIFO_PATH: caminho do ficheiro
+     * - fifo_path: caminho do ficheiro (FIFO_PATH, ou FIFO_PATH.N num shard)
      * - 0666: permissões (rw-rw-rw-)
      * 
      * Se o FIFO já existir, mkfifo() retorna -1 e errno = EEXIST.
      * Nesse caso, ignoramos o erro e usamos o FIFO existente.
      */
-    if (mkfifo(FIFO_PATH, 0666) == -1) {
+    if (mkfifo(fifo_path, 0666) == -1) {
         if (errno != EEXIST) {
             print_error("mkfifo");
             exit(EXIT_FAILURE);
@@ -573,10 +7106,14 @@ int main(void) {
     }
 
     print_str("[Servidor] A aguardar comandos no FIFO ");
-    print_str(FIFO_PATH);
+    print_str(fifo_path);
     print_str(" ...\n");
     print_str("[Servidor] Pressiona Ctrl+C para terminar.\n");
 
+    if (use_ring) {
+        ring_start();
+    }
+
     /*
      * ========================================================================
      * PASSO 4: Abrir o FIFO para leitura
@@ -584,232 +7121,40 @@ int main(void) {
      * 
      * open() com O_RDONLY abre o FIFO apenas para leitura.
      * 
-     * NOTA IMPORTANTE:
-     * Esta chamada BLOQUEIA até que um cliente abra o FIFO para escrita!
+     * O_NONBLOCK: o open() não fica à espera de um cliente - quem espera
+     * é o poll() no ciclo principal, que também vigia o anel (--ring).
      * 
      * Guardamos o fd na variável global para o signal handler poder fechar.
+     *
+     * Numa atualização o FIFO já está aberto (fd herdado).
      */
-    fd = open(FIFO_PATH, O_RDONLY);
-    if (fd == -1) {
+    if (upgrade_fd == -1) {
+        server_fd = open(fifo_path, O_RDONLY | O_NONBLOCK);
+    }
+    if (server_fd == -1) {
         print_error("open");
         exit(EXIT_FAILURE);
     }
-    server_fd = fd;  // Guarda na global para signal handler
 
     /*
      * ========================================================================
      * PASSO 5: Loop principal - Processar mensagens
      * ========================================================================
      * 
-     * O servidor fica num ciclo infinito:
-     * 1. Lê uma mensagem do FIFO
-     * 2. Processa os comandos
-     * 3. Espera por mais mensagens
-     * 
-     * O loop pode ser interrompido por:
-     * - Signal handler (SIGINT/SIGTERM)
-     * - Erro fatal na leitura
+     * Com --loop uring tentamos o io_uring; se o kernel não o suportar,
+     * usamos o ciclo clássico (poll + waitpid). Com --loop threads, o
+     * ciclo clássico é a thread de receção.
      */
-    while (1) {
-        /*
-         * Lê dados do FIFO
-         * - read() bloqueia até haver dados para ler
-         * - Retorna o número de bytes lidos
-         * - Retorna 0 quando o cliente fecha o FIFO (EOF)
-         * - Retorna -1 se houver erro
-         */
-        ssize_t bytes = read(fd, buffer, sizeof(buffer) - 1);
-        
-        if (bytes > 0) {
-            // Recebemos dados!
-            buffer[bytes] = '\0';  // Adiciona terminador de string
-
-            print_str("[Servidor] Mensagem recebida: '");
-            print_str(buffer);
-            print_str("'\n");
-
-            /*
-             * ================================================================
-             * Arrays para guardar informação dos comandos
-             * ================================================================
-             * - pids[]: guarda o PID de cada processo filho
-             * - commands[]: guarda uma cópia de cada comando (para o log)
-             * - num_commands: conta quantos comandos foram lançados
-             */
-            pid_t pids[32];
-            char *commands[32];
-            int num_commands = 0;
-
-            /*
-             * ================================================================
-             * PARSING NÍVEL 1: Separar os comandos por ';'
-             * ================================================================
-             * 
-             * Exemplo: "ls -la;pwd;date" é separado em:
-             *   - "ls -la"
-             *   - "pwd"
-             *   - "date"
-             * 
-             * Usamos strtok_r() em vez de strtok() porque é mais seguro
-             * (strtok_r usa saveptr para guardar o estado)
-             */
-            char *saveptr1;
-            char *cmd = strtok_r(buffer, ";", &saveptr1);
-            
-            while (cmd != NULL && num_commands < 32) {
-                // Remove espaços no início do comando
-                while (*cmd == ' ') cmd++;
-                
-                // Se o comando não está vazio
-                if (strlen(cmd) > 0) {
-                    /*
-                     * strdup() faz uma cópia do comando.
-                     * Precisamos disto porque:
-                     * 1. strtok_r() modifica o buffer original
-                     * 2. Queremos guardar o comando para escrever no log depois
-                     */
-                    commands[num_commands] = strdup(cmd);
-                    
-                    // Executa o comando (cria processo filho)
-                    pids[num_commands] = execute_command(cmd);
-                    
-                    if (pids[num_commands] > 0) {
-                        // Comando lançado com sucesso
-                        num_commands++;
-                    } else {
-                        // Falhou - liberta a memória
-                        free(commands[num_commands]);
-                    }
-                }
-                
-                // Próximo comando
-                cmd = strtok_r(NULL, ";", &saveptr1);
-            }
-
-            print_str("[Servidor] A executar ");
-            print_int(STDOUT_FILENO, num_commands);
-            print_str(" comando(s)...\n");
-
-            /*
-             * ================================================================
-             * Esperar por todos os processos filhos (EXECUÇÃO CONCORRENTE)
-             * ================================================================
-             * 
-             * IMPORTANTE: Usamos waitpid(-1, ...) para esperar por QUALQUER
-             * filho que termine, não por uma ordem específica. Isto permite
-             * que os comandos executem verdadeiramente em paralelo.
-             * 
-             * Se usássemos waitpid(pids[i], ...) em sequência, teríamos que
-             * esperar que o primeiro comando terminasse antes de verificar os
-             * outros, mesmo que já tenham terminado.
-             * 
-             * waitpid(-1, &status, 0):
-             * - -1: espera por QUALQUER processo filho
-             * - &status: variável onde guarda o estado de saída
-             * - 0: bloqueia até um filho terminar
-             * 
-             * WIFEXITED(status): verifica se o filho terminou normalmente
-             * WEXITSTATUS(status): obtém o código de saída (0 = sucesso)
-             */
-            for (int i = 0; i < num_commands; i++) {
-                int status;
-                pid_t terminated_pid = waitpid(-1, &status, 0);
-                
-                // Encontra qual comando terminou (mapeamento PID -> índice)
-                int cmd_index = -1;
-                for (int j = 0; j < num_commands; j++) {
-                    if (pids[j] == terminated_pid) {
-                        cmd_index = j;
-                        break;
-                    }
-                }
-                
-                // Se não encontrou o PID (erro improvável), continua
-                if (cmd_index == -1) {
-                    print_err("[Servidor] Aviso: PID terminado não encontrado\n");
-                    continue;
-                }
-
-                // Prepara a entrada para o log
-                char log_entry[512];
-                int pos = 0;
-                
-                // Copia o comando
-                int cmd_len = strlen(commands[cmd_index]);
-                if (cmd_len < 500) {
-                    strncpy(log_entry, commands[cmd_index], cmd_len);
-                    pos = cmd_len;
-                }
-                
-                if (WIFEXITED(status)) {
-                    // O filho terminou normalmente
-                    int exit_code = WEXITSTATUS(status);
-                    strncpy(log_entry + pos, "; exit status: ", 512 - pos);
-                    pos += 15;
-                    
-                    // Converte exit_code para string manualmente
-                    char num_str[16];
-                    int num_len = 0;
-                    int temp = exit_code;
-                    if (temp == 0) {
-                        num_str[num_len++] = '0';
-                    } else {
-                        while (temp > 0) {
-                            num_str[num_len++] = '0' + (temp % 10);
-                            temp /= 10;
-                        }
-                        // Inverte
-                        for (int j = 0; j < num_len / 2; j++) {
-                            char t = num_str[j];
-                            num_str[j] = num_str[num_len - 1 - j];
-                            num_str[num_len - 1 - j] = t;
-                        }
-                    }
-                    strncpy(log_entry + pos, num_str, num_len);
-                    pos += num_len;
-                    log_entry[pos++] = '\n';
-                    log_entry[pos] = '\0';
-                } else {
-                    // O filho terminou de forma anormal (ex: signal)
-                    strncpy(log_entry + pos, "; terminou de forma anormal\n", 512 - pos);
-                    pos += 29;
-                    log_entry[pos] = '\0';
-                }
-
-                // Mostra e guarda o resultado
-                print_str("[Servidor] ");
-                print_str(log_entry);
-                append_log(log_entry);
-            }
-            
-            // Liberta memória de todos os comandos após processamento completo
-            for (int i = 0; i < num_commands; i++) {
-                free(commands[i]);
-            }
-
-            if (num_commands > 0) {
-                print_str("[Servidor] Todos os ");
-                print_int(STDOUT_FILENO, num_commands);
-                print_str(" comando(s) terminaram.\n");
-            }
+    if (loop_backend == BACKEND_URING && uring_setup() == -1) {
+        print_err("[Servidor] io_uring indisponível neste kernel, a usar o ciclo clássico.\n");
+        loop_backend = BACKEND_CLASSIC;
+    }
 
-        } else if (bytes == 0) {
-            /*
-             * ================================================================
-             * Cliente fechou o FIFO (EOF)
-             * ================================================================
-             * Quando o cliente fecha a sua ponta do FIFO, read() retorna 0.
-             * Temos de fechar e reabrir o FIFO para aceitar novos clientes.
-             */
-            print_str("[Servidor] Cliente terminou a escrita. A reabrir FIFO...\n");
-            close(fd);
-            fd = open(FIFO_PATH, O_RDONLY);
-            
-        } else {
-            // Erro na leitura
-            print_error("read");
-            break;
-        }
+    if (loop_backend == BACKEND_URING) {
+        print_str("[Servidor] Ciclo de eventos: io_uring.\n");
+        run_uring_loop();
+    } else {
+        run_classic_loop();
     }
 
     /*
@@ -817,7 +7162,9 @@ int main(void) {
      * Limpeza final (nunca chega aqui no uso normal)
      * ========================================================================
      */
-    close(fd);
-    unlink(FIFO_PATH);  // Remove o ficheiro FIFO
+    close(server_fd);
+    unlink(fifo_path);  // Remove o ficheiro FIFO
+    if (watch_fd != -1) unlink(WATCH_PATH);
+    ring_destroy(ring);
     return 0;
 }
@@ -0,0 +1,277 @@
+/*
+ * ============================================================================
+ * TRACE - Implementação - Projeto SO 25/26
+ * ============================================================================
+ *
+ * Ver trace.h. Só trace_record() está no caminho dos jobs; a gravação
+ * (trace_dump) é feita pelo ciclo principal depois de o trace ser
+ * desligado.
+ *
+ * ============================================================================
+ */
+
+#include <string.h>      // memcpy(), strlen()
+#include <unistd.h>      // write(), close(), getpid(), syscall()
+#include <fcntl.h>       // open()
+#include <time.h>        // clock_gettime()
+#include <sys/syscall.h> // SYS_gettid
+
+#include "trace.h"
+
+struct trace_slot {
+    _Atomic unsigned long seq;  // 0 = a ser escrita, i + 1 = evento i
+    long ts_ns;
+    long id;
+    int tid;
+    char event;
+    char phase;
+    char label[TRACE_LABEL];
+};
+
+_Atomic int trace_enabled = 0;
+
+static struct trace_slot ring[TRACE_SLOTS];
+static _Atomic unsigned long ring_head = 0;  // Próximo evento a escrever
+static unsigned long ring_dumped = 0;        // Eventos já gravados
+
+static const char *event_names[NUM_TRACE_EVENTS] = {
+    "receive", "parse", "spawn", "exit", "log_flush", "job", "run"
+};
+
+static __thread int cached_tid = 0;
+
+static int trace_tid(void) {
+    if (cached_tid == 0) cached_tid = syscall(SYS_gettid);
+    return cached_tid;
+}
+
+void trace_record(int event, char phase, long id, const char *label) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    unsigned long i = atomic_fetch_add_explicit(&ring_head, 1, memory_order_relaxed);
+    struct trace_slot *slot = &ring[i & (TRACE_SLOTS - 1)];
+
+    atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    slot->ts_ns = ts.tv_sec * 1000000000L + ts.tv_nsec;
+    slot->id = id;
+    slot->tid = trace_tid();
+    slot->event = event;
+    slot->phase = phase;
+    slot->label[0] = '\0';
+    if (label != NULL) {
+        int len = strlen(label);
+        if (len > TRACE_LABEL - 1) len = TRACE_LABEL - 1;
+        memcpy(slot->label, label, len);
+        slot->label[len] = '\0';
+    }
+
+    atomic_store_explicit(&slot->seq, i + 1, memory_order_release);
+}
+
+/*
+ * ================================================================
+ * Nomes das threads (metadados do trace)
+ * ================================================================
+ * Cada thread regista-se uma vez ao arrancar, ligado ou não o trace.
+ */
+#define TRACE_THREADS 64
+
+static struct {
+    int tid;
+    char name[16];
+} thread_names[TRACE_THREADS];
+static _Atomic int num_thread_names = 0;
+
+void trace_thread_name(const char *name) {
+    int i = atomic_fetch_add(&num_thread_names, 1);
+    if (i >= TRACE_THREADS) return;
+
+    thread_names[i].tid = trace_tid();
+    int len = strlen(name);
+    if (len > (int)sizeof(thread_names[i].name) - 1) len = sizeof(thread_names[i].name) - 1;
+    memcpy(thread_names[i].name, name, len);
+    thread_names[i].name[len] = '\0';
+}
+
+/*
+ * ================================================================
+ * Gravação em JSON
+ * ================================================================
+ * O output vai sendo juntado num buffer e escrito com write() quando
+ * enche (sem stdio, como o resto do servidor).
+ */
+struct trace_out {
+    int fd;
+    int len;
+    int failed;
+    char buf[64 * 1024];
+};
+
+static void out_flush(struct trace_out *out) {
+    int off = 0;
+    while (off < out->len && !out->failed) {
+        ssize_t n = write(out->fd, out->buf + off, out->len - off);
+        if (n <= 0) out->failed = 1;
+        else off += n;
+    }
+    out->len = 0;
+}
+
+static void out_str(struct trace_out *out, const char *s) {
+    while (*s != '\0') {
+        if (out->len == (int)sizeof(out->buf)) out_flush(out);
+        out->buf[out->len++] = *s++;
+    }
+}
+
+static void out_long(struct trace_out *out, long v) {
+    char tmp[24];
+    int n = 0;
+    int negative = v < 0;
+    unsigned long u = negative ? -(unsigned long)v : (unsigned long)v;
+    do {
+        tmp[n++] = '0' + u % 10;
+        u /= 10;
+    } while (u > 0);
+
+    char s[26];
+    int len = 0;
+    if (negative) s[len++] = '-';
+    while (n > 0) s[len++] = tmp[--n];
+    s[len] = '\0';
+    out_str(out, s);
+}
+
+// String JSON: aspas, \ e caracteres de controlo são escapados
+static void out_json(struct trace_out *out, const char *s) {
+    out_str(out, "\"");
+    for (; *s != '\0'; s++) {
+        char c[7] = {*s, '\0'};
+        if (*s == '"' || *s == '\\') {
+            c[0] = '\\';
+            c[1] = *s;
+            c[2] = '\0';
+        } else if ((unsigned char)*s < 0x20) {
+            const char *hex = "0123456789abcdef";
+            memcpy(c, "\\u00", 4);
+            c[4] = hex[(unsigned char)*s >> 4];
+            c[5] = hex[*s & 0xf];
+            c[6] = '\0';
+        }
+        out_str(out, c);
+    }
+    out_str(out, "\"");
+}
+
+// O formato do Chrome usa microssegundos; ficam 3 casas decimais
+static void out_ts(struct trace_out *out, long ns) {
+    out_long(out, ns / 1000);
+    char frac[5] = {'.', '0' + ns / 100 % 10, '0' + ns / 10 % 10, '0' + ns % 10, '\0'};
+    out_str(out, frac);
+}
+
+static void out_event(struct trace_out *out, const struct trace_slot *ev, int pid) {
+    char phase[2] = {ev->phase, '\0'};
+
+    out_str(out, "{\"name\":\"");
+    out_str(out, event_names[(int)ev->event]);
+    out_str(out, "\",\"cat\":\"exec\",\"ph\":\"");
+    out_str(out, phase);
+    out_str(out, "\",\"ts\":");
+    out_ts(out, ev->ts_ns);
+    out_str(out, ",\"pid\":");
+    out_long(out, pid);
+    out_str(out, ",\"tid\":");
+    out_long(out, ev->tid);
+
+    // Os intervalos assíncronos do mesmo job juntam-se pelo id
+    if (ev->phase == 'b' || ev->phase == 'e') {
+        out_str(out, ",\"id\":");
+        out_long(out, ev->id);
+    }
+    if (ev->phase == 'i') {
+        out_str(out, ",\"s\":\"t\"");
+    }
+
+    if (ev->id > 0 || ev->label[0] != '\0') {
+        out_str(out, ",\"args\":{");
+        if (ev->id > 0) {
+            out_str(out, "\"job\":");
+            out_long(out, ev->id);
+        }
+        if (ev->label[0] != '\0') {
+            if (ev->id > 0) out_str(out, ",");
+            out_str(out, "\"cmd\":");
+            out_json(out, ev->label);
+        }
+        out_str(out, "}");
+    }
+    out_str(out, "}");
+}
+
+/*
+ * Grava os eventos registados desde a última gravação.
+ * Retorna o número de eventos gravados, ou -1 se não foi possível
+ * escrever o ficheiro.
+ */
+long trace_dump(const char *path) {
+    static struct trace_out out;
+
+    out.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out.fd == -1) return -1;
+    out.len = 0;
+    out.failed = 0;
+
+    int pid = getpid();
+    out_str(&out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    out_str(&out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":");
+    out_long(&out, pid);
+    out_str(&out, ",\"tid\":0,\"args\":{\"name\":\"server\"}}");
+
+    int threads = atomic_load(&num_thread_names);
+    if (threads > TRACE_THREADS) threads = TRACE_THREADS;
+    for (int i = 0; i < threads; i++) {
+        out_str(&out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":");
+        out_long(&out, pid);
+        out_str(&out, ",\"tid\":");
+        out_long(&out, thread_names[i].tid);
+        out_str(&out, ",\"args\":{\"name\":");
+        out_json(&out, thread_names[i].name);
+        out_str(&out, "}}");
+    }
+
+    // Só os últimos TRACE_SLOTS eventos ainda estão no anel
+    unsigned long head = atomic_load_explicit(&ring_head, memory_order_acquire);
+    unsigned long first = ring_dumped;
+    if (head - first > TRACE_SLOTS) first = head - TRACE_SLOTS;
+
+    long count = 0;
+    for (unsigned long i = first; i < head; i++) {
+        struct trace_slot *slot = &ring[i & (TRACE_SLOTS - 1)];
+        struct trace_slot copy;
+
+        unsigned long seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        memcpy((char *)&copy + sizeof(copy.seq), (char *)slot + sizeof(slot->seq),
+               sizeof(copy) - sizeof(copy.seq));
+        atomic_thread_fence(memory_order_acquire);
+
+        // Ainda a ser escrita, ou já reescrita por um evento mais novo
+        if (seq != i + 1 || atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq) {
+            continue;
+        }
+        copy.label[TRACE_LABEL - 1] = '\0';
+
+        out_str(&out, ",\n");
+        out_event(&out, &copy, pid);
+        count++;
+    }
+    ring_dumped = head;
+
+    out_str(&out, "\n]}\n");
+    out_flush(&out);
+    close(out.fd);
+    return out.failed ? -1 : count;
+}
@@ -0,0 +1,76 @@
+/*
+ * ============================================================================
+ * TRACE - Eventos do ciclo de vida dos jobs - Projeto SO 25/26
+ * ============================================================================
+ *
+ * OBJETIVO:
+ * Quando uma batch é lenta, o log só diz quanto tempo ela demorou, não
+ * onde: a ler a mensagem, a separar os comandos, no fork()/exec, no
+ * próprio filho, à espera de ser recolhido ou a escrever o log. Com o
+ * trace ligado, o servidor marca esses pontos e grava-os no formato de
+ * trace do Chrome (JSON), que o Perfetto (ui.perfetto.dev) abre:
+ *
+ *   kill -USR1 <pid>     liga o trace
+ *   kill -USR1 <pid>     desliga e grava logs/trace-<pid>-<n>.json
+ *
+ * COMO FUNCIONA:
+ * Os eventos vão para um anel de TRACE_SLOTS posições, um por processo,
+ * partilhado por todas as threads (--loop threads). Quem escreve reserva
+ * uma posição com um atomic_fetch_add e preenche-a; não há mutex nem
+ * syscalls (o relógio é lido pelo vDSO). Quando o anel dá a volta, os
+ * eventos mais antigos perdem-se.
+ *
+ * Cada posição tem um número de sequência (0 = a ser escrita, i + 1 =
+ * evento i completo), como um seqlock: quem grava só aceita a posição
+ * se o número for o mesmo antes e depois da cópia.
+ *
+ * CUSTO:
+ * Desligado, cada ponto do trace é um load relaxado e um salto
+ * (TRACE() abaixo, marcado como improvável), sem chamar nada.
+ *
+ * ============================================================================
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdatomic.h>  // _Atomic
+
+#define TRACE_SLOTS 65536  // Eventos guardados (potência de 2)
+#define TRACE_LABEL 32     // Bytes do comando guardados com o evento
+
+/*
+ * Pontos do trace (o nome de cada um está em trace.c)
+ */
+enum trace_event {
+    TRACE_RECEIVE,   // process_message(): uma mensagem do FIFO/anel/rede
+    TRACE_PARSE,     // job_parse(): diretivas e %invoke de um comando
+    TRACE_SPAWN,     // job_fork(): fork() + exec
+    TRACE_EXIT,      // job_log(): o job terminou (instantâneo)
+    TRACE_LOG,       // log_write() / uring_flush_log()
+    TRACE_JOB,       // Assíncrono: da submissão até o job ser libertado
+    TRACE_RUN,       // Assíncrono: do exec até o filho terminar
+    NUM_TRACE_EVENTS
+};
+
+/*
+ * Fases do formato do Chrome: 'B'/'E' abrem e fecham uma fatia na
+ * thread, 'i' é instantâneo, 'b'/'e' abrem e fecham um intervalo
+ * assíncrono ligado ao id do job.
+ */
+extern _Atomic int trace_enabled;
+
+void trace_record(int event, char phase, long id, const char *label);
+
+#define TRACE(event, phase, id, label)                                          \
+    do {                                                                        \
+        if (__builtin_expect(atomic_load_explicit(&trace_enabled,               \
+                                                  memory_order_relaxed), 0)) {  \
+            trace_record(event, phase, id, label);                              \
+        }                                                                       \
+    } while (0)
+
+void trace_thread_name(const char *name);
+long trace_dump(const char *path);
+
+#endif
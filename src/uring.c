@@ -0,0 +1,264 @@
+/*
+ * ============================================================================
+ * URING - Implementação - Projeto SO 25/26
+ * ============================================================================
+ *
+ * Ver uring.h. As barreiras de memória seguem o protocolo documentado em
+ * io_uring(7): o kernel lê sq_tail com acquire, por isso publicamos com
+ * release; lemos cq_tail com acquire antes de ler as CQEs.
+ *
+ * ============================================================================
+ */
+
+#include <stdlib.h>     // calloc(), free()
+#include <unistd.h>     // close(), syscall()
+#include <string.h>     // memset()
+#include <errno.h>      // errno, ETIME, EINTR
+#include <signal.h>     // _NSIG
+#include <sys/mman.h>   // mmap(), munmap()
+#include <sys/syscall.h> // SYS_io_uring_setup, SYS_io_uring_enter, ...
+#include <time.h>       // struct timespec
+
+#include "uring.h"
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(SYS_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete,
+                     unsigned flags, void *arg, size_t argsz) {
+    return (int)syscall(SYS_io_uring_enter, fd, to_submit, min_complete,
+                        flags, arg, argsz);
+}
+
+static int sys_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(SYS_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+ * Cria o io_uring e mapeia os anéis. Retorna 0 ou -1 com errno
+ * (ex: ENOSYS em kernels sem io_uring, EPERM se estiver desativado).
+ */
+int uring_init(struct uring *r, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(r, 0, sizeof(*r));
+
+    r->fd = sys_setup(entries, &p);
+    if (r->fd == -1) return -1;
+    r->features = p.features;
+
+    r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    // IORING_FEAT_SINGLE_MMAP: SQ e CQ partilham o mesmo mapeamento
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_size > r->sq_size) r->sq_size = r->cq_size;
+        r->cq_size = r->sq_size;
+    }
+
+    r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) goto fail;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED) goto fail;
+    }
+
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) goto fail;
+
+    char *sq = r->sq_ptr;
+    char *cq = r->cq_ptr;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->sq_entries = p.sq_entries;
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+
+fail:
+    uring_exit(r);
+    return -1;
+}
+
+void uring_exit(struct uring *r) {
+    if (r->sqes != NULL && r->sqes != MAP_FAILED) munmap(r->sqes, r->sqes_size);
+    if (r->cq_ptr != NULL && r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr) {
+        munmap(r->cq_ptr, r->cq_size);
+    }
+    if (r->sq_ptr != NULL && r->sq_ptr != MAP_FAILED) munmap(r->sq_ptr, r->sq_size);
+    if (r->fd != -1) close(r->fd);
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+/*
+ * Verifica (IORING_REGISTER_PROBE) se o kernel suporta todas as operações.
+ * Retorna 1 se sim, 0 se não.
+ */
+int uring_supports(struct uring *r, const int *ops, int count) {
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    if (probe == NULL) return 0;
+
+    int ok = sys_register(r->fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    for (int i = 0; ok && i < count; i++) {
+        if (ops[i] > probe->last_op ||
+            (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED) == 0) {
+            ok = 0;
+        }
+    }
+    free(probe);
+    return ok;
+}
+
+/*
+ * Próxima SQE livre (já a zeros). Se a SQ estiver cheia, submete o que
+ * já lá está e tenta outra vez. Retorna NULL só se nem assim houver espaço
+ * (ex: EBUSY com a CQ a transbordar); quem chama tem de tratar o NULL.
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring *r) {
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *r->sq_tail + r->sq_pending;
+
+    if (tail - head >= r->sq_entries) {
+        if (uring_submit_and_wait(r, 0, 0) < 0) return NULL;
+        head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        tail = *r->sq_tail + r->sq_pending;
+        if (tail - head >= r->sq_entries) return NULL;
+    }
+
+    unsigned index = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[index] = index;
+    r->sq_pending++;
+    return sqe;
+}
+
+/*
+ * Quantas SQEs ainda cabem sem submeter (para cadeias IOSQE_IO_LINK,
+ * que não podem ser partidas a meio)
+ */
+unsigned uring_sq_space(struct uring *r) {
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    return r->sq_entries - (*r->sq_tail + r->sq_pending - head);
+}
+
+/*
+ * Submete as SQEs pendentes e espera por pelo menos wait_nr CQEs.
+ * timeout_ms < 0 espera para sempre. É a ÚNICA syscall por iteração.
+ *
+ * RETORNO: >= 0 em caso de sucesso (timeout e EINTR incluídos),
+ *          -1 com errno noutros erros.
+ */
+int uring_submit_and_wait(struct uring *r, unsigned wait_nr, int timeout_ms) {
+    // Conta também as SQEs que um io_uring_enter() falhado (EBUSY) deixou
+    // na SQ: com to_submit só das novas, essas ficavam lá esquecidas
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *r->sq_tail + r->sq_pending;
+    unsigned submit = tail - head;
+    __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+    r->sq_pending = 0;
+
+    unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    int ret;
+
+    if (wait_nr > 0 && timeout_ms >= 0 && (r->features & IORING_FEAT_EXT_ARG)) {
+        struct __kernel_timespec ts;
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+
+        struct io_uring_getevents_arg arg;
+        memset(&arg, 0, sizeof(arg));
+        arg.sigmask_sz = _NSIG / 8;
+        arg.ts = (unsigned long long)&ts;
+        ret = sys_enter(r->fd, submit, wait_nr, flags | IORING_ENTER_EXT_ARG,
+                        &arg, sizeof(arg));
+    } else {
+        ret = sys_enter(r->fd, submit, wait_nr, flags, NULL, _NSIG / 8);
+    }
+
+    if (ret == -1 && (errno == ETIME || errno == EINTR)) return 0;
+    return ret;
+}
+
+/*
+ * Próxima CQE por tratar, ou NULL se a CQ estiver vazia
+ */
+struct io_uring_cqe *uring_peek_cqe(struct uring *r) {
+    unsigned head = *r->cq_head;
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+    return &r->cqes[head & *r->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *r) {
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Regista um anel de buffers: nas leituras multishot o kernel escolhe um
+ * buffer livre e diz-nos qual foi (cqe->flags >> IORING_CQE_BUFFER_SHIFT).
+ */
+int uring_buf_ring_init(struct uring *r, struct uring_buf_ring *br,
+                        unsigned short group, unsigned entries, unsigned buf_size) {
+    size_t ring_size = entries * sizeof(struct io_uring_buf);
+
+    br->ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (br->ring == MAP_FAILED) return -1;
+
+    br->buffers = malloc((size_t)entries * buf_size);
+    if (br->buffers == NULL) {
+        munmap(br->ring, ring_size);
+        return -1;
+    }
+    br->entries = entries;
+    br->buf_size = buf_size;
+    br->group = group;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)br->ring;
+    reg.ring_entries = entries;
+    reg.bgid = group;
+    if (sys_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        free(br->buffers);
+        munmap(br->ring, ring_size);
+        return -1;
+    }
+
+    br->ring->tail = 0;
+    for (unsigned bid = 0; bid < entries; bid++) {
+        uring_buf_ring_recycle(br, bid);
+    }
+    return 0;
+}
+
+char *uring_buf_ring_get(struct uring_buf_ring *br, unsigned bid) {
+    return br->buffers + (size_t)bid * br->buf_size;
+}
+
+/*
+ * Devolve um buffer ao kernel depois de o termos consumido
+ */
+void uring_buf_ring_recycle(struct uring_buf_ring *br, unsigned bid) {
+    unsigned short tail = br->ring->tail;
+    struct io_uring_buf *buf = &br->ring->bufs[tail & (br->entries - 1)];
+
+    buf->addr = (unsigned long)uring_buf_ring_get(br, bid);
+    buf->len = br->buf_size;
+    buf->bid = (unsigned short)bid;
+    __atomic_store_n(&br->ring->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
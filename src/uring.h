@@ -0,0 +1,91 @@
+/*
+ * ============================================================================
+ * URING - Acesso mínimo ao io_uring sem liburing - Projeto SO 25/26
+ * ============================================================================
+ *
+ * OBJETIVO:
+ * O servidor pode usar o io_uring (--loop uring) para juntar, numa única
+ * syscall io_uring_enter() por iteração, tudo o que o ciclo clássico faz
+ * com dezenas de syscalls: ler o FIFO, esperar pelos filhos (waitid) e
+ * escrever no log.
+ *
+ * Usamos só as syscalls io_uring_setup(), io_uring_enter() e
+ * io_uring_register(), com os anéis mapeados em memória - o mesmo que a
+ * liburing faz, mas apenas com o que o servidor precisa.
+ *
+ * ESTRUTURA:
+ *   SQ (submission queue): o servidor escreve pedidos (SQEs)
+ *   CQ (completion queue): o kernel escreve resultados (CQEs)
+ *   Buffer ring: buffers que o kernel escolhe nas leituras multishot
+ *
+ * ============================================================================
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>         // size_t
+#include <linux/io_uring.h> // struct io_uring_sqe, struct io_uring_cqe, ...
+
+/*
+ * Operações recentes que os headers do sistema podem ainda não ter
+ * (valores fixos da ABI do kernel). Sem suporte, o servidor usa o
+ * ciclo clássico.
+ */
+#define URING_OP_READ_MULTISHOT 49  // Linux 6.7
+#define URING_OP_WAITID         50  // Linux 6.7
+
+struct uring {
+    int fd;
+    unsigned features;
+
+    // Submission queue
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_entries;
+    unsigned sq_pending;        // SQEs preparados e ainda não submetidos
+
+    // Completion queue
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // Zonas mapeadas (para munmap)
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    size_t sqes_size;
+};
+
+/*
+ * Anel de buffers para leituras multishot (IORING_REGISTER_PBUF_RING)
+ */
+struct uring_buf_ring {
+    struct io_uring_buf_ring *ring;
+    char *buffers;
+    unsigned entries;
+    unsigned buf_size;
+    unsigned short group;
+};
+
+int uring_init(struct uring *r, unsigned entries);
+void uring_exit(struct uring *r);
+int uring_supports(struct uring *r, const int *ops, int count);
+
+struct io_uring_sqe *uring_get_sqe(struct uring *r);
+unsigned uring_sq_space(struct uring *r);
+int uring_submit_and_wait(struct uring *r, unsigned wait_nr, int timeout_ms);
+struct io_uring_cqe *uring_peek_cqe(struct uring *r);
+void uring_cqe_seen(struct uring *r);
+
+int uring_buf_ring_init(struct uring *r, struct uring_buf_ring *br,
+                        unsigned short group, unsigned entries, unsigned buf_size);
+char *uring_buf_ring_get(struct uring_buf_ring *br, unsigned bid);
+void uring_buf_ring_recycle(struct uring_buf_ring *br, unsigned bid);
+
+#endif